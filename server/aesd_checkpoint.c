@@ -0,0 +1,193 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "aesd_checkpoint.h"
+
+#define CHECKPOINT_MAGIC "AESDCKP1"
+#define CHECKPOINT_FIELDS 6     // 64 bit fields of each segment
+
+typedef struct {
+    char magic[8];
+    uint64_t dataOffset;
+    uint64_t segmentSize;
+    uint64_t end;
+    uint64_t records;
+    uint64_t numSegments;
+    uint64_t checksum;      // FNV-1a of the whole file with this field zeroed
+} checkpoint_header_t;
+
+static uint64_t checkpoint_checksum(const unsigned char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Sync the directory holding @param path, so that a rename into it survives a crash.
+ */
+static int checkpoint_sync_dir(const char *path) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    if(slash == NULL) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) {
+        return -1;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+int aesd_checkpoint_write(const char *path, const aesd_checkpoint_t *ckpt) {
+    char tmp[PATH_MAX];
+    size_t len = sizeof(checkpoint_header_t) + ckpt->numSegments * CHECKPOINT_FIELDS * sizeof(uint64_t);
+    unsigned char *buf = calloc(1, len);
+    int fd = -1;
+
+    if(buf == NULL) {
+        return -1;
+    }
+    checkpoint_header_t *header = (checkpoint_header_t *)buf;
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->dataOffset = ckpt->dataOffset;
+    header->segmentSize = ckpt->segmentSize;
+    header->end = ckpt->end;
+    header->records = ckpt->records;
+    header->numSegments = ckpt->numSegments;
+    uint64_t *table = (uint64_t *)(header + 1);
+    for(size_t i = 0; i < ckpt->numSegments; i++, table += CHECKPOINT_FIELDS) {
+        const aesd_checkpoint_segment_t *seg = &ckpt->segments[i];
+        table[0] = seg->index;
+        table[1] = seg->len;
+        table[2] = seg->firstRecord;
+        table[3] = seg->firstSeq;
+        table[4] = seg->records;
+        table[5] = seg->lastRecord;
+    }
+    header->checksum = checkpoint_checksum(buf, len);
+
+    // written aside and renamed over the old one, which stays valid until then
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(fd < 0) {
+        goto fail;
+    }
+    for(size_t done = 0; done < len;) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0) {
+            goto fail;
+        }
+        done += n;
+    }
+    if(fdatasync(fd) < 0 || close(fd) < 0) {
+        fd = -1;
+        goto fail;
+    }
+    fd = -1;
+    if(rename(tmp, path) < 0) {
+        goto fail;
+    }
+    // until the directory is on disk, a crash may bring the older checkpoint back
+    if(checkpoint_sync_dir(path) < 0) {
+        syslog(LOG_ERR, "Unable to sync the directory of the checkpoint %s: %s", path, strerror(errno));
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "Unable to write the checkpoint %s: %s", path, strerror(errno));
+    if(fd >= 0) {
+        close(fd);
+    }
+    unlink(tmp);
+    free(buf);
+    return -1;
+}
+
+int aesd_checkpoint_read(const char *path, aesd_checkpoint_t *ckpt) {
+    struct stat st;
+    checkpoint_header_t *header;
+    unsigned char *buf = NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    memset(ckpt, 0, sizeof(*ckpt));
+    if(fd < 0) {
+        return -1;
+    }
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(checkpoint_header_t) ||
+       (buf = malloc(st.st_size)) == NULL) {
+        goto fail;
+    }
+    for(size_t done = 0; done < (size_t)st.st_size;) {
+        ssize_t n = read(fd, buf + done, st.st_size - done);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            goto fail;
+        }
+        done += n;
+    }
+    header = (checkpoint_header_t *)buf;
+    uint64_t checksum = header->checksum;
+    header->checksum = 0;
+    if(memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0 ||
+       header->numSegments != (st.st_size - sizeof(checkpoint_header_t)) / (CHECKPOINT_FIELDS * sizeof(uint64_t)) ||
+       checkpoint_checksum(buf, st.st_size) != checksum) {
+        syslog(LOG_WARNING, "Ignoring the damaged checkpoint %s", path);
+        goto fail;
+    }
+    ckpt->segments = calloc(header->numSegments > 0 ? header->numSegments : 1, sizeof(aesd_checkpoint_segment_t));
+    if(ckpt->segments == NULL) {
+        goto fail;
+    }
+    ckpt->dataOffset = header->dataOffset;
+    ckpt->segmentSize = header->segmentSize;
+    ckpt->end = header->end;
+    ckpt->records = header->records;
+    ckpt->numSegments = header->numSegments;
+    uint64_t *table = (uint64_t *)(header + 1);
+    for(size_t i = 0; i < ckpt->numSegments; i++, table += CHECKPOINT_FIELDS) {
+        aesd_checkpoint_segment_t *seg = &ckpt->segments[i];
+        seg->index = table[0];
+        seg->len = table[1];
+        seg->firstRecord = table[2];
+        seg->firstSeq = table[3];
+        seg->records = table[4];
+        seg->lastRecord = table[5];
+    }
+    free(buf);
+    close(fd);
+    return 0;
+
+fail:
+    free(buf);
+    close(fd);
+    return -1;
+}
+
+void aesd_checkpoint_free(aesd_checkpoint_t *ckpt) {
+    free(ckpt->segments);
+    ckpt->segments = NULL;
+    ckpt->numSegments = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef _AESD_CHECKPOINT_H_
+#define _AESD_CHECKPOINT_H_
+
+#include <stddef.h>
+
+#define AESD_CHECKPOINT_SUFFIX ".ckpt"
+
+/**
+ * What a checkpoint knew about one file of a store.
+ */
+typedef struct aesd_checkpoint_segment_s aesd_checkpoint_segment_t;
+struct aesd_checkpoint_segment_s {
+    size_t index;
+    size_t len;             // history bytes in the file
+    size_t firstRecord;     // where in the file its first record starts
+    size_t firstSeq;        // sequence number of that record
+    size_t records;         // entries of the record index of the file
+    size_t lastRecord;      // the last of them, if any
+};
+
+/**
+ * Metadata of a mapped file store saved now and then, so that opening it again
+ * trusts what the checkpoint covers and only checks what was appended since: the
+ * segment table, the history length and how far the record indexes reach. A
+ * checkpoint is a hint; everything it says is checked against the files before it
+ * is relied on, and one that is missing or does not match only costs a full check.
+ */
+typedef struct aesd_checkpoint_s aesd_checkpoint_t;
+struct aesd_checkpoint_s {
+    size_t dataOffset;      // layout of the store files
+    size_t segmentSize;
+    size_t end;             // offset one past the newest byte
+    size_t records;         // records indexed in all files
+    size_t numSegments;
+    aesd_checkpoint_segment_t *segments;    // oldest first
+};
+
+/**
+ * Replace the checkpoint at @param path with @param ckpt, in a way a crash leaves
+ * either the old or the new one.
+ * @return 0 on success, -1 on error.
+ */
+int aesd_checkpoint_write(const char *path, const aesd_checkpoint_t *ckpt);
+
+/**
+ * Read the checkpoint at @param path into @param ckpt, to be freed with
+ * aesd_checkpoint_free().
+ * @return 0 on success, -1 if there is none or it is damaged.
+ */
+int aesd_checkpoint_read(const char *path, aesd_checkpoint_t *ckpt);
+
+void aesd_checkpoint_free(aesd_checkpoint_t *ckpt);
+
+#endif
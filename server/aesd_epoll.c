@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "aesdsocket.h"
+#include "aesd_epoll.h"
+#include "aesd_packet.h"
+#include "aesd_framer.h"
+#include "aesd_slab.h"
+#include "aesd_metrics.h"
+#include "aesd_outq.h"
+
+#define RECV_MIN_SIZE 1024  // smallest receive, larger ones as the packet buffer grows
+#define MAX_EVENTS 64
+
+typedef struct aesd_conn_s aesd_conn_t;
+struct aesd_conn_s {
+    aesd_conn_t *prev;      // connections of the loop, swept for stalled replies
+    aesd_conn_t *next;
+    int fd;
+    char ip[INET6_ADDRSTRLEN];
+    aesd_framer_t framer;
+    aesd_outq_t out;        // replies waiting for the socket to drain
+    bool framed;            // without keep-alive, the one packet of the connection is complete
+    bool peerClosed;        // the client sent everything it is going to send
+    bool committing;        // commit holds a packet of the framer, nothing is received until it is back
+    bool closing;           // closed while committing, freed once commit is back
+    uint32_t events;        // events currently watched
+    aesd_commit_t commit;
+    aesd_registry_entry_t entry;
+};
+
+typedef struct aesd_loop_s aesd_loop_t;
+struct aesd_loop_s {
+    pthread_t thread;
+    int epollFd;
+    int listenFd;
+    aesd_completions_t completions; // packets of the loop's connections back from the committer
+    int conns;          // connections owned by this loop, closed ones until they are freed
+    aesd_conn_t *connList;
+    int blocked;        // connections waiting for EPOLLOUT, the only ones that can stall
+    uint64_t nextSweep; // aesd_metrics_now() to look for stalled connections at
+    bool stopping;      // no longer accepting, exits once conns drops to 0
+};
+
+static char stopMarker;     // epoll data of the shutdown eventfd
+static aesd_slab_t connSlab = AESD_SLAB_INITIALIZER("epoll connections", sizeof(aesd_conn_t));
+
+static void conn_release(aesd_loop_t *loop, aesd_conn_t *conn) {
+    aesd_outq_destroy(&conn->out);
+    aesd_framer_destroy(&conn->framer);
+    aesd_slab_free(&connSlab, conn);
+    loop->conns--;
+}
+
+/**
+ * Close @param conn, keeping its memory until the committer handed back a packet
+ * still referencing the framer.
+ */
+static void conn_close(aesd_loop_t *loop, aesd_conn_t *conn) {
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    syslog(LOG_INFO, "Closed connection from %s", conn->ip);
+    aesd_registry_remove(&registry, &conn->entry);
+    close(conn->fd);
+    if(conn->events & EPOLLOUT) {
+        loop->blocked--;
+    }
+    if(conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connList = conn->next;
+    }
+    if(conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    if(conn->committing) {
+        conn->closing = true;
+        return;
+    }
+    conn_release(loop, conn);
+}
+
+static int conn_watch(aesd_loop_t *loop, aesd_conn_t *conn, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    if(events == conn->events) {
+        return 0;
+    }
+    if(epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        return -1;
+    }
+    loop->blocked += ((events & EPOLLOUT) != 0) - ((conn->events & EPOLLOUT) != 0);
+    conn->events = events;
+    return 0;
+}
+
+/**
+ * Queue @param reply behind the earlier ones of @param conn.
+ * @return 0 on success, -1 if the connection has to be closed.
+ */
+static int conn_push_reply(aesd_conn_t *conn, aesd_history_reply_t *reply) {
+    if(aesd_outq_push(&conn->out, reply, conn->framer.packetSince, config.maxQueued) < 0) {
+        if(errno == ENOBUFS) {
+            syslog(LOG_WARNING, "Disconnecting %s, more than %zu bytes of replies queued", conn->ip,
+                   config.maxQueued);
+            aesd_metrics_add(AESD_METRIC_SLOW_READERS, 1);
+            aesd_outq_abort(conn->fd);
+        } else {
+            syslog(LOG_ERR, "Unable to allocate memory for a reply to %s", conn->ip);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Resolve the commands among the complete packets buffered in @param conn and queue
+ * their replies, up to the first packet to store: that one is submitted to the
+ * committer, and the packets after it wait for it to come back so that the replies
+ * keep their order.
+ * @return 0 on success, -1 if the connection has to be closed.
+ */
+static int conn_queue_replies(aesd_loop_t *loop, aesd_conn_t *conn) {
+    const char *packet;
+    size_t packetLen;
+    aesd_history_reply_t reply;
+
+    while(!conn->framed && !conn->committing && aesd_framer_next(&conn->framer, &packet, &packetLen)) {
+        conn->framed = !config.keepAlive;
+        int ret = aesd_packet_submit(packet, packetLen, conn->ip, &reply, &conn->commit, &loop->completions, conn);
+        if(ret == AESD_PACKET_SUBMITTED) {
+            conn->committing = true;
+        } else if(ret < 0 || conn_push_reply(conn, &reply) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Send the queued replies of @param conn until the socket would block, then watch
+ * for it to drain. The connection is closed once every reply is sent and no more
+ * packets can come.
+ */
+static void conn_flush(aesd_loop_t *loop, aesd_conn_t *conn) {
+    int ret = aesd_outq_send(&conn->out, conn->fd);
+    if(ret < 0 || (ret > 0 && !conn->committing && (conn->framed || conn->peerClosed))) {
+        conn_close(loop, conn);
+        return;
+    }
+    // keep reading while replies are queued, packets are committed in the meantime
+    uint32_t events = conn->framed || conn->peerClosed || conn->committing ? 0 : EPOLLIN | EPOLLRDHUP;
+    if(ret == 0) {
+        events |= EPOLLOUT;
+    }
+    if(conn_watch(loop, conn, events) < 0) {
+        conn_close(loop, conn);
+    }
+}
+
+static void conn_on_event(aesd_loop_t *loop, aesd_conn_t *conn, uint32_t events) {
+    bool readable = events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+
+    // hangups are reported whatever is watched, and no reply can reach the client anymore
+    if(conn->committing && (events & (EPOLLHUP | EPOLLERR))) {
+        conn_close(loop, conn);
+        return;
+    }
+
+    while(readable && !conn->framed && !conn->peerClosed && !conn->committing) {
+        size_t avail;
+        char *space = aesd_framer_reserve(&conn->framer, RECV_MIN_SIZE, &avail);
+        if(space == NULL) {
+            syslog(LOG_ERR, "Unable to grow receive buffer for %s", conn->ip);
+            conn_close(loop, conn);
+            return;
+        }
+
+        ssize_t recv_bytes = recv(conn->fd, space, avail, 0);
+        if(recv_bytes == 0) {
+            conn->peerClosed = true;
+            break;
+        }
+        if(recv_bytes < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Received error from %s", conn->ip);
+            conn_close(loop, conn);
+            return;
+        }
+        aesd_metrics_add(AESD_METRIC_BYTES_IN, recv_bytes);
+        aesd_framer_received(&conn->framer, recv_bytes);
+        if(conn_queue_replies(loop, conn) < 0) {
+            conn_close(loop, conn);
+            return;
+        }
+    }
+    conn_flush(loop, conn);
+}
+
+/**
+ * Queue the replies to the packets the committer handed back to @param loop, and
+ * go on with the packets that waited for them.
+ */
+static void loop_on_completions(aesd_loop_t *loop) {
+    aesd_commit_t *next;
+    for(aesd_commit_t *commit = aesd_completions_take(&loop->completions); commit != NULL; commit = next) {
+        next = commit->next;
+        aesd_conn_t *conn = commit->owner;
+        aesd_history_reply_t reply;
+
+        conn->committing = false;
+        if(conn->closing) {
+            conn_release(loop, conn);
+            continue;
+        }
+        if(aesd_packet_committed(commit, &reply) < 0 || conn_push_reply(conn, &reply) < 0 ||
+           conn_queue_replies(loop, conn) < 0) {
+            conn_close(loop, conn);
+            continue;
+        }
+        conn_flush(loop, conn);
+    }
+}
+
+/**
+ * Close the connections of @param loop whose replies made no progress within the write timeout.
+ */
+static void loop_sweep(aesd_loop_t *loop, uint64_t now) {
+    aesd_conn_t *next;
+    for(aesd_conn_t *conn = loop->connList; conn != NULL; conn = next) {
+        next = conn->next;
+        if(aesd_outq_stalled(&conn->out, now, config.writeTimeoutMs)) {
+            syslog(LOG_WARNING, "Disconnecting %s, no reply bytes read for %u ms", conn->ip,
+                   config.writeTimeoutMs);
+            aesd_metrics_add(AESD_METRIC_SLOW_READERS, 1);
+            aesd_outq_abort(conn->fd);
+            conn_close(loop, conn);
+        }
+    }
+}
+
+static void loop_accept(aesd_loop_t *loop) {
+    while(1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_sockfd = accept4(loop->listenFd, (struct sockaddr *)&client_addr, &client_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client_sockfd < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && !loop->stopping) {
+                syslog(LOG_ERR, "Unable to accept the client's connection");
+            }
+            return;
+        }
+
+        aesd_conn_t *conn = aesd_slab_zalloc(&connSlab);
+        if(conn == NULL || aesd_framer_init(&conn->framer, RECV_MIN_SIZE * 2, !config.keepAlive) < 0) {
+            syslog(LOG_ERR, "Unable to allocate memory for client connection");
+            aesd_slab_free(&connSlab, conn);
+            close(client_sockfd);
+            continue;
+        }
+        conn->fd = client_sockfd;
+        conn->events = EPOLLIN | EPOLLRDHUP;
+        aesd_outq_init(&conn->out);
+        inet_ntop(AF_INET, &client_addr.sin_addr, conn->ip, sizeof(conn->ip));
+
+        struct epoll_event ev = { .events = conn->events, .data.ptr = conn };
+        if(!aesd_registry_add(&registry, &conn->entry, client_sockfd)) {
+            aesd_framer_destroy(&conn->framer);
+            aesd_slab_free(&connSlab, conn);
+            close(client_sockfd);
+            continue;
+        }
+        if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, client_sockfd, &ev) < 0) {
+            syslog(LOG_ERR, "Unable to watch client connection");
+            aesd_registry_remove(&registry, &conn->entry);
+            aesd_framer_destroy(&conn->framer);
+            aesd_slab_free(&connSlab, conn);
+            close(client_sockfd);
+            continue;
+        }
+        conn->next = loop->connList;
+        if(loop->connList != NULL) {
+            loop->connList->prev = conn;
+        }
+        loop->connList = conn;
+        loop->conns++;
+        syslog(LOG_INFO, "Accepted connection from %s", conn->ip);
+    }
+}
+
+/**
+ * Stop accepting on @param loop once shutdown was requested; the connections it
+ * already has are served until they close or the registry shuts them down.
+ */
+static void loop_stop(aesd_loop_t *loop) {
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, loop->listenFd, NULL);
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, stopFd, NULL);
+    loop->stopping = true;
+}
+
+static void *loop_run(void *ptr) {
+    aesd_loop_t *loop = (aesd_loop_t *)ptr;
+    struct epoll_event events[MAX_EVENTS];
+
+    while(!loop->stopping || loop->conns > 0) {
+        // only wake up regularly while some connection has replies it does not read
+        int timeout = -1;
+        if(loop->blocked > 0 && config.writeTimeoutMs > 0) {
+            timeout = aesd_outq_sweep_ms(config.writeTimeoutMs);
+        }
+        int n = epoll_wait(loop->epollFd, events, MAX_EVENTS, timeout);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "epoll_wait failed");
+            break;
+        }
+        bool completed = false;
+        for(int i = 0; i < n; i++) {
+            aesd_conn_t *conn = events[i].data.ptr;
+            if(events[i].data.ptr == &stopMarker) {
+                loop_stop(loop);
+            } else if(events[i].data.ptr == &loop->completions) {
+                completed = true;
+            } else if(conn == NULL) {
+                if(!loop->stopping) {
+                    loop_accept(loop);
+                }
+            } else {
+                conn_on_event(loop, conn, events[i].events);
+            }
+        }
+        // after the events, so that none of them is for a connection freed meanwhile
+        if(completed) {
+            loop_on_completions(loop);
+        }
+        if(timeout >= 0) {
+            uint64_t now = aesd_metrics_now();
+            if(now >= loop->nextSweep) {
+                loop_sweep(loop, now);
+                loop->nextSweep = now + (uint64_t)timeout * 1000000;
+            }
+        }
+    }
+    return NULL;
+}
+
+int aesd_epoll_run(const int *listenFds, int numLoops) {
+    if(numLoops < 1) {
+        return -1;
+    }
+    for(int i = 0; i < numLoops; i++) {
+        int flags = fcntl(listenFds[i], F_GETFL, 0);
+        if(flags < 0 || fcntl(listenFds[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+            syslog(LOG_ERR, "Unable to make listening socket nonblocking");
+            return -1;
+        }
+    }
+
+    aesd_loop_t *loops = calloc(numLoops, sizeof(aesd_loop_t));
+    if(loops == NULL) {
+        syslog(LOG_ERR, "Unable to allocate event loops");
+        return -1;
+    }
+
+    int started = 0;
+    for(; started < numLoops; started++) {
+        aesd_loop_t *loop = &loops[started];
+        loop->listenFd = listenFds[started];
+        loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if(loop->epollFd < 0) {
+            syslog(LOG_ERR, "Unable to create epoll instance");
+            break;
+        }
+        if(aesd_completions_init(&loop->completions) < 0) {
+            close(loop->epollFd);
+            break;
+        }
+        // EPOLLEXCLUSIVE wakes a single loop per incoming connection on a shared listener
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+        struct epoll_event stopEv = { .events = EPOLLIN, .data.ptr = &stopMarker };
+        struct epoll_event doneEv = { .events = EPOLLIN, .data.ptr = &loop->completions };
+        if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->listenFd, &ev) < 0 ||
+           epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, stopFd, &stopEv) < 0 ||
+           epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->completions.fd, &doneEv) < 0 ||
+           pthread_create(&loop->thread, NULL, loop_run, loop) != 0) {
+            syslog(LOG_ERR, "Unable to start event loop %d", started);
+            aesd_completions_destroy(&loop->completions);
+            close(loop->epollFd);
+            break;
+        }
+    }
+    if(started == 0) {
+        free(loops);
+        return -1;
+    }
+    syslog(LOG_INFO, "Serving connections with %d epoll loop(s)", started);
+
+    for(int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+        aesd_completions_destroy(&loops[i].completions);
+        close(loops[i].epollFd);
+    }
+    free(loops);
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef _AESD_EPOLL_H_
+#define _AESD_EPOLL_H_
+
+/**
+ * Serve connections with @param numLoops event loop threads, loop i accepting on
+ * @param listenFds[i]: either the same socket for all, or with SO_REUSEPORT one of
+ * its own. Every loop owns an epoll instance watching its (nonblocking) listening
+ * socket and the connections it accepted itself, so accept, recv framing and reply
+ * sending for a connection always happen on the same thread without any
+ * per-connection thread. A loop never waits for a group commit: packets to store
+ * go to the commit thread of the history, and their replies are queued once it
+ * hands them back through the eventfd the loop watches.
+ * Once stopFd becomes readable each loop stops accepting and exits when its last
+ * connection closed.
+ * @return -1 if the loops could not be set up, otherwise only returns once all loops exit.
+ */
+int aesd_epoll_run(const int *listenFds, int numLoops);
+
+#endif
@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd_framer.h"
+#include "aesd_slab.h"
+#include "aesd_metrics.h"
+
+static aesd_slab_t framerBufs = AESD_SLAB_INITIALIZER("receive buffers", AESD_FRAMER_POOL_SIZE);
+
+int aesd_framer_init(aesd_framer_t *f, size_t cap, bool wholeBatch) {
+    memset(f, 0, sizeof(*f));
+    f->pooled = cap <= AESD_FRAMER_POOL_SIZE;
+    if(f->pooled) {
+        cap = AESD_FRAMER_POOL_SIZE;
+    }
+    f->buf = f->pooled ? aesd_slab_alloc(&framerBufs) : malloc(cap);
+    if(f->buf == NULL) {
+        return -1;
+    }
+    f->cap = cap;
+    f->wholeBatch = wholeBatch;
+    return 0;
+}
+
+void aesd_framer_destroy(aesd_framer_t *f) {
+    if(f->pooled) {
+        aesd_slab_free(&framerBufs, f->buf);
+    } else {
+        free(f->buf);
+    }
+    f->buf = NULL;
+}
+
+char *aesd_framer_reserve(aesd_framer_t *f, size_t minFree, size_t *avail) {
+    if(f->start == f->len) {
+        f->start = 0;
+        f->scanned = 0;
+        f->len = 0;
+    } else if(f->cap - f->len < minFree && f->start > 0) {
+        // only the partial packet is kept, so it is moved at most once per packet served
+        f->len -= f->start;
+        f->scanned -= f->start;
+        memmove(f->buf, f->buf + f->start, f->len);
+        f->start = 0;
+    }
+    if(f->cap - f->len < minFree) {
+        size_t cap = f->cap;
+        while(cap - f->len < minFree) {
+            cap *= 2;
+        }
+        // a packet outgrowing the slab buffer moves to a buffer of its own for good
+        char *grown = f->pooled ? malloc(cap) : realloc(f->buf, cap);
+        if(grown == NULL) {
+            return NULL;
+        }
+        if(f->pooled) {
+            memcpy(grown, f->buf, f->len);
+            aesd_slab_free(&framerBufs, f->buf);
+            f->pooled = false;
+        }
+        f->buf = grown;
+        f->cap = cap;
+    }
+    *avail = f->cap - f->len;
+    return f->buf + f->len;
+}
+
+void aesd_framer_received(aesd_framer_t *f, size_t len) {
+    if(f->start == f->len) {
+        f->pendingSince = aesd_metrics_now();
+    }
+    f->len += len;
+}
+
+int aesd_framer_push(aesd_framer_t *f, const char *data, size_t len) {
+    size_t avail;
+    char *space = aesd_framer_reserve(f, len, &avail);
+    if(space == NULL) {
+        return -1;
+    }
+    memcpy(space, data, len);
+    aesd_framer_received(f, len);
+    return 0;
+}
+
+bool aesd_framer_next(aesd_framer_t *f, const char **packet, size_t *len) {
+    char *scan = f->buf + f->scanned;
+    size_t scanLen = f->len - f->scanned;
+    char *newline = f->wholeBatch ? memrchr(scan, '\n', scanLen) : memchr(scan, '\n', scanLen);
+
+    if(newline == NULL) {
+        f->scanned = f->len;
+        return false;
+    }
+    *packet = f->buf + f->start;
+    f->packetSince = f->pendingSince;
+    *len = newline + 1 - *packet;
+    f->start += *len;
+    f->scanned = f->start;
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef _AESD_FRAMER_H_
+#define _AESD_FRAMER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESD_FRAMER_POOL_SIZE 2048  // initial buffers up to this size are recycled through a slab
+
+/**
+ * Incremental splitter of a received byte stream into newline-terminated packets.
+ * Bytes are received straight into a buffer that doubles as needed, so a packet of
+ * any size is assembled with amortized O(n) copying, and each byte is searched for
+ * a newline once however many receives it took to complete its packet. A packet is
+ * handed out whole, so it reaches the history as one append.
+ */
+typedef struct aesd_framer_s aesd_framer_t;
+struct aesd_framer_s {
+    char *buf;
+    size_t cap;
+    size_t start;           // first byte of the packet being assembled
+    size_t scanned;         // bytes from start up to here hold no newline
+    size_t len;             // bytes received
+    bool wholeBatch;        // frame everything up to the last newline as one packet
+    bool pooled;            // buf is a slab object of AESD_FRAMER_POOL_SIZE bytes
+    uint64_t pendingSince;  // aesd_metrics_now() when bytes arrived with none pending
+    uint64_t packetSince;   // pendingSince of the packet handed out last
+};
+
+/**
+ * Prepare @param f with an initial buffer of @param cap bytes, taken from a slab
+ * when it fits AESD_FRAMER_POOL_SIZE.
+ * @param wholeBatch frame everything received up to the last newline as one packet
+ *   instead of splitting it at each newline.
+ * @return 0 on success, -1 if the buffer could not be allocated.
+ */
+int aesd_framer_init(aesd_framer_t *f, size_t cap, bool wholeBatch);
+
+void aesd_framer_destroy(aesd_framer_t *f);
+
+/**
+ * Make room for at least @param minFree more bytes, dropping packets already handed
+ * out and growing the buffer if the partial packet does not leave enough space.
+ * @return where to receive up to @param avail bytes, or NULL if memory ran out.
+ */
+char *aesd_framer_reserve(aesd_framer_t *f, size_t minFree, size_t *avail);
+
+/**
+ * Account for @param len bytes received into the space given by aesd_framer_reserve().
+ */
+void aesd_framer_received(aesd_framer_t *f, size_t len);
+
+/**
+ * Copy @param len received bytes from @param data into the framer.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int aesd_framer_push(aesd_framer_t *f, const char *data, size_t len);
+
+/**
+ * Hand out the next complete packet, newline included, in @param packet and
+ * @param len. The packet stays valid until the next reserve or push. The time its
+ * first byte arrived is left in packetSince; pipelined packets received together
+ * share the time of their common receive.
+ * @return true if a packet was complete, false if more bytes are needed.
+ */
+bool aesd_framer_next(aesd_framer_t *f, const char **packet, size_t *len);
+
+#endif
@@ -0,0 +1,1045 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "aesd_history.h"
+#include "aesd_metrics.h"
+
+#define REPLY_MAX_IOV 64
+#define COMMIT_MAX_BATCH 1024   // IOV_MAX on Linux
+
+static const char *syncPolicyNames[] = {
+    [AESD_SYNC_NONE] = "none",
+    [AESD_SYNC_PACKET] = "packet",
+    [AESD_SYNC_GROUP] = "group",
+};
+
+static aesd_chunk_t *chunk_new(size_t base, size_t cap) {
+    aesd_chunk_t *chunk = malloc(sizeof(aesd_chunk_t) + cap);
+    if(chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->refs = 1;
+    chunk->base = base;
+    chunk->len = 0;
+    chunk->cap = cap;
+    chunk->data = (char *)(chunk + 1);
+    chunk->map = NULL;
+    chunk->mapLen = 0;
+    return chunk;
+}
+
+/**
+ * Wrap the part of the mapped store holding @param offset in a chunk, filled up to
+ * @param offset.
+ */
+static aesd_chunk_t *chunk_map(aesd_history_t *h, size_t offset) {
+    aesd_store_view_t view;
+    aesd_chunk_t *chunk = malloc(sizeof(aesd_chunk_t));
+
+    if(chunk == NULL) {
+        return NULL;
+    }
+    if(aesd_store_map(h->store, offset, &view) < 0) {
+        free(chunk);
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->refs = 1;
+    chunk->base = view.base;
+    chunk->len = offset - view.base;
+    chunk->cap = view.cap;
+    chunk->data = view.data;
+    chunk->map = view.map;
+    chunk->mapLen = view.mapLen;
+    return chunk;
+}
+
+static void chunk_ref(aesd_chunk_t *chunk) {
+    __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void chunk_unref(aesd_chunk_t *chunk) {
+    // freeing a chunk releases the reference its link held on the next one
+    while(chunk != NULL && __atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        aesd_chunk_t *next = chunk->next;
+        if(chunk->map != NULL) {
+            munmap(chunk->map, chunk->mapLen);
+        }
+        free(chunk);
+        chunk = next;
+    }
+}
+
+/**
+ * Copy @param len bytes into the tail chunks beyond the bytes filled so far, adding
+ * chunks as they fill up. A mapped store already holds them, its chunks only account
+ * for them. Only the committer calls this.
+ */
+static int history_fill(aesd_history_t *h, const char *data, size_t len) {
+    size_t offset = h->tail != NULL ? h->tail->base + h->tail->len : h->end;
+
+    while(len > 0) {
+        aesd_chunk_t *tail = h->tail;
+        if(tail == NULL || tail->len == tail->cap) {
+            size_t cap = len > AESD_HISTORY_CHUNK_SIZE ? len : AESD_HISTORY_CHUNK_SIZE;
+            aesd_chunk_t *chunk = h->mapped ? chunk_map(h, offset) : chunk_new(offset, cap);
+            if(chunk == NULL) {
+                return -1;
+            }
+            if(tail == NULL) {
+                uint64_t locked = aesd_metrics_lock(&h->publishLock, AESD_LOCK_PUBLISH);
+                h->head = chunk;
+                aesd_metrics_unlock(&h->publishLock, AESD_LOCK_PUBLISH, locked);
+            } else {
+                tail->next = chunk;
+            }
+            h->tail = tail = chunk;
+        }
+        size_t n = tail->cap - tail->len < len ? tail->cap - tail->len : len;
+        if(!h->mapped) {
+            memcpy(tail->data + tail->len, data, n);
+        }
+        tail->len += n;
+        offset += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @return the offset the retained record @param i starts at, counting from the oldest.
+ */
+static size_t history_record_start(aesd_history_t *h, size_t i) {
+    if(i < h->recordsIndexed) {
+        return aesd_store_record(h->store, h->recordsDropped + i);
+    }
+    return h->records[h->recordsFirst + (i - h->recordsIndexed)];
+}
+
+static int history_add_record(aesd_history_t *h, size_t offset) {
+    size_t len = h->recordsLen - h->recordsIndexed;
+
+    if(h->recordsFirst + len == h->recordsCap) {
+        if(h->recordsFirst > 0) {
+            memmove(h->records, h->records + h->recordsFirst, len * sizeof(size_t));
+            h->recordsFirst = 0;
+        }
+        if(len == h->recordsCap) {
+            size_t cap = h->recordsCap ? h->recordsCap * 2 : 64;
+            size_t *grown = realloc(h->records, cap * sizeof(size_t));
+            if(grown == NULL) {
+                return -1;
+            }
+            h->records = grown;
+            h->recordsCap = cap;
+        }
+    }
+    h->records[h->recordsFirst + len] = offset;
+    h->recordsLen++;
+    return 0;
+}
+
+/**
+ * Stop retaining the oldest @param count records.
+ */
+static void history_drop_records(aesd_history_t *h, size_t count) {
+    size_t indexed = count < h->recordsIndexed ? count : h->recordsIndexed;
+
+    h->recordsIndexed -= indexed;
+    h->recordsFirst += count - indexed;
+    h->recordsLen -= count;
+    h->recordsDropped += count;
+    h->start = history_record_start(h, 0);
+}
+
+/**
+ * Drop records beyond maxRecords and move the head past chunks that fall before
+ * the retained history or outside the maxCached window. Called with publishLock
+ * held; the old head is returned so its reference is dropped after unlocking.
+ */
+static aesd_chunk_t *history_trim(aesd_history_t *h) {
+    aesd_chunk_t *oldHead = h->head;
+
+    if(h->maxRecords != 0 && h->recordsLen > h->maxRecords) {
+        history_drop_records(h, h->recordsLen - h->maxRecords);
+    }
+    // the newest record is kept even if it is larger than maxBytes on its own
+    while(h->maxBytes != 0 && h->recordsLen > 1 && h->end - h->start > h->maxBytes) {
+        history_drop_records(h, 1);
+    }
+    if(h->cachedFrom < h->start) {
+        h->cachedFrom = h->start;
+    }
+    if(h->store->readBack && h->maxCached != 0 && h->end - h->cachedFrom > h->maxCached) {
+        h->cachedFrom = h->end - h->maxCached;
+    }
+    while(h->head != h->tail && h->head->base + h->head->cap <= h->cachedFrom) {
+        h->head = h->head->next;
+    }
+    if(h->head == oldHead) {
+        return NULL;
+    }
+    chunk_ref(h->head);
+    return oldHead;
+}
+
+/**
+ * Publish the @param count filled records of @param batch, in order.
+ */
+static int history_publish(aesd_history_t *h, aesd_commit_t *batch, size_t count) {
+    int ret = 0;
+
+    uint64_t locked = aesd_metrics_lock(&h->publishLock, AESD_LOCK_PUBLISH);
+    for(size_t i = 0; i < count && ret == 0; i++, batch = batch->next) {
+        ret = history_add_record(h, h->end);
+        if(ret == 0) {
+            h->end += batch->len;
+            batch->end = h->end;
+        }
+    }
+    size_t start = h->start;
+    aesd_chunk_t *dropped = history_trim(h);
+    aesd_metrics_unlock(&h->publishLock, AESD_LOCK_PUBLISH, locked);
+    chunk_unref(dropped);
+    if(h->start != start) {
+        aesd_store_trim(h->store, h->start);
+    }
+    if(h->notifyFd >= 0) {
+        uint64_t one = 1;
+        if(write(h->notifyFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            syslog(LOG_ERR, "Unable to signal a publish: %s", strerror(errno));
+        }
+    }
+    return ret;
+}
+
+/**
+ * Add a record of @param len bytes to the cache and publish it.
+ */
+static int history_record(aesd_history_t *h, const char *data, size_t len) {
+    aesd_commit_t record = { .data = data, .len = len };
+
+    if(history_fill(h, data, len) < 0) {
+        return -1;
+    }
+    return history_publish(h, &record, 1);
+}
+
+/**
+ * Leave the records of a mapped store in its index, to be looked up there, and take
+ * the cache from its mapping, without reading any of the history.
+ * @return 0 on success, -1 if the index can't be used, 1 if memory ran out.
+ */
+static int history_load_index(aesd_history_t *h) {
+    size_t count;
+    size_t firstSeq;
+
+    if(aesd_store_records(h->store, &count, &firstSeq) < 0) {
+        return -1;
+    }
+    if(history_fill(h, NULL, aesd_store_size(h->store) - h->end) < 0) {
+        return 1;
+    }
+    uint64_t locked = aesd_metrics_lock(&h->publishLock, AESD_LOCK_PUBLISH);
+    h->recordsIndexed = count;
+    h->recordsLen = count;
+    h->recordsDropped = firstSeq;
+    h->end = aesd_store_size(h->store);
+    size_t start = h->start;
+    aesd_chunk_t *dropped = history_trim(h);
+    aesd_metrics_unlock(&h->publishLock, AESD_LOCK_PUBLISH, locked);
+    chunk_unref(dropped);
+    if(h->start != start) {
+        aesd_store_trim(h->store, h->start);
+    }
+    return 0;
+}
+
+/**
+ * Rebuild records and cache from the store, from its index if it keeps one, or
+ * splitting the content at newlines.
+ */
+static int history_load(aesd_history_t *h) {
+    char *buf = malloc(AESD_HISTORY_CHUNK_SIZE);
+    char *record = NULL;
+    size_t recordLen = 0;
+    size_t offset = h->start;
+    ssize_t bytesRead;
+    int ret = 0;
+
+    if(h->mapped && aesd_store_indexed(h->store) && (ret = history_load_index(h)) >= 0) {
+        free(buf);
+        return ret == 0 ? 0 : -1;
+    }
+    ret = 0;
+    if(buf == NULL) {
+        return -1;
+    }
+    while((bytesRead = aesd_store_read(h->store, offset, buf, AESD_HISTORY_CHUNK_SIZE)) > 0) {
+        offset += bytesRead;
+        char *grown = realloc(record, recordLen + bytesRead);
+        if(grown == NULL) {
+            ret = -1;
+            break;
+        }
+        record = grown;
+        memcpy(record + recordLen, buf, bytesRead);
+        recordLen += bytesRead;
+
+        char *cursor = record;
+        char *newline;
+        while(ret == 0 && (newline = memchr(cursor, '\n', recordLen - (cursor - record))) != NULL) {
+            ret = history_record(h, cursor, newline + 1 - cursor);
+            cursor = newline + 1;
+        }
+        recordLen -= cursor - record;
+        memmove(record, cursor, recordLen);
+    }
+    if(bytesRead < 0) {
+        ret = -1;
+    }
+    if(ret == 0 && recordLen > 0) {
+        // unterminated tail left by an interrupted writer
+        ret = history_record(h, record, recordLen);
+    }
+    free(record);
+    free(buf);
+    return ret;
+}
+
+int aesd_history_init(aesd_history_t *h, aesd_store_t *store, size_t maxCached) {
+    pthread_condattr_t attr;
+
+    memset(h, 0, sizeof(*h));
+    pthread_mutex_init(&h->commitLock, NULL);
+    pthread_cond_init(&h->committed, NULL);
+    pthread_cond_init(&h->commitWanted, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&h->batchFull, &attr);
+    pthread_cond_init(&h->syncWanted, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&h->syncLock, NULL);
+    pthread_cond_init(&h->synced, NULL);
+    h->commitBatch = 1;
+    h->notifyFd = -1;
+    pthread_mutex_init(&h->publishLock, NULL);
+    h->store = store;
+    h->mapped = aesd_store_mapped(store);
+    h->start = store->start;
+    h->cachedFrom = store->start;
+    h->end = store->start;
+    h->maxRecords = store->maxRecords;
+    h->maxBytes = store->maxBytes;
+    h->maxCached = maxCached;
+    if(history_load(h) < 0) {
+        syslog(LOG_ERR, "Unable to load history from the store");
+        return -1;
+    }
+    // whatever the store held at startup is taken as durable
+    h->syncTarget = h->end;
+    h->durable = h->end;
+    syslog(LOG_INFO, "Loaded %zu record(s), %zu byte(s) of history", h->recordsLen, h->end - h->start);
+    return 0;
+}
+
+void aesd_history_destroy(aesd_history_t *h) {
+    if(h->commitRunning) {
+        uint64_t locked = aesd_metrics_lock(&h->commitLock, AESD_LOCK_COMMIT);
+        h->commitStop = true;
+        pthread_cond_signal(&h->commitWanted);
+        aesd_metrics_unlock(&h->commitLock, AESD_LOCK_COMMIT, locked);
+        pthread_join(h->commitThread, NULL);
+        h->commitRunning = false;
+    }
+    if(h->syncRunning) {
+        // the sync thread covers what is still pending before it exits
+        uint64_t locked = aesd_metrics_lock(&h->syncLock, AESD_LOCK_SYNC);
+        h->syncStop = true;
+        pthread_cond_signal(&h->syncWanted);
+        aesd_metrics_unlock(&h->syncLock, AESD_LOCK_SYNC, locked);
+        pthread_join(h->syncThread, NULL);
+        h->syncRunning = false;
+    }
+    chunk_unref(h->head);
+    h->head = NULL;
+    h->tail = NULL;
+    free(h->records);
+    aesd_store_close(h->store);
+    if(h->notifyFd >= 0) {
+        close(h->notifyFd);
+        h->notifyFd = -1;
+    }
+    pthread_cond_destroy(&h->synced);
+    pthread_cond_destroy(&h->syncWanted);
+    pthread_mutex_destroy(&h->syncLock);
+    pthread_mutex_destroy(&h->publishLock);
+    pthread_cond_destroy(&h->commitWanted);
+    pthread_cond_destroy(&h->batchFull);
+    pthread_cond_destroy(&h->committed);
+    pthread_mutex_destroy(&h->commitLock);
+}
+
+void aesd_history_group_commit(aesd_history_t *h, unsigned windowUs, size_t batch) {
+    uint64_t locked = aesd_metrics_lock(&h->commitLock, AESD_LOCK_COMMIT);
+    h->commitWindowUs = windowUs;
+    h->commitBatch = batch < 1 ? 1 : batch > COMMIT_MAX_BATCH ? COMMIT_MAX_BATCH : batch;
+    aesd_metrics_unlock(&h->commitLock, AESD_LOCK_COMMIT, locked);
+}
+
+/**
+ * Hand the submitted @param commit back to the event loop it came from, signalling
+ * the loop unless earlier ones are still waiting for it.
+ */
+static void history_complete(aesd_commit_t *commit) {
+    aesd_completions_t *c = commit->completions;
+
+    commit->next = NULL;
+    pthread_mutex_lock(&c->lock);
+    bool wake = c->head == NULL;
+    if(c->tail != NULL) {
+        c->tail->next = commit;
+    } else {
+        c->head = commit;
+    }
+    c->tail = commit;
+    pthread_mutex_unlock(&c->lock);
+    if(wake) {
+        uint64_t one = 1;
+        if(write(c->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            syslog(LOG_ERR, "Unable to signal a commit: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Hand back the held packets that end by @param end, with @param ret. Called with
+ * syncLock held.
+ */
+static void history_release_held(aesd_history_t *h, size_t end, int ret) {
+    while(h->heldHead != NULL && h->heldHead->end <= end) {
+        aesd_commit_t *commit = h->heldHead;
+        h->heldHead = commit->next;
+        commit->ret = ret;
+        history_complete(commit);
+    }
+    if(h->heldHead == NULL) {
+        h->heldTail = NULL;
+    }
+}
+
+/**
+ * Record that the store is on disk up to @param end, waking the appenders waiting
+ * for it and handing back the packets held for it. Called with syncLock held.
+ */
+static void history_synced(aesd_history_t *h, size_t end) {
+    if(end > h->durable) {
+        h->durable = end;
+    }
+    history_release_held(h, h->durable, 0);
+    h->syncs++;
+    pthread_cond_broadcast(&h->synced);
+    aesd_metrics_add(AESD_METRIC_SYNCS, 1);
+}
+
+/**
+ * Body of the AESD_SYNC_GROUP sync thread: one fdatasync() covers everything
+ * stored since the previous one.
+ */
+static void *history_syncer(void *ptr) {
+    aesd_history_t *h = (aesd_history_t *)ptr;
+
+    uint64_t locked = aesd_metrics_lock(&h->syncLock, AESD_LOCK_SYNC);
+    while(!h->syncStop || h->syncTarget > h->durable) {
+        if(h->syncTarget <= h->durable) {
+            aesd_metrics_cond_wait(&h->syncWanted, &h->syncLock, AESD_LOCK_SYNC, &locked, NULL);
+            continue;
+        }
+        struct timespec deadline = h->syncPending;
+        deadline.tv_nsec += (long)(h->syncIntervalMs % 1000) * 1000000;
+        deadline.tv_sec += h->syncIntervalMs / 1000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        int waited = 0;
+        while(!h->syncStop && waited != ETIMEDOUT && h->syncTarget > h->durable &&
+              (h->syncBytes == 0 || h->syncTarget - h->durable < h->syncBytes)) {
+            waited = aesd_metrics_cond_wait(&h->syncWanted, &h->syncLock, AESD_LOCK_SYNC, &locked, &deadline);
+        }
+
+        size_t target = h->syncTarget;
+        aesd_metrics_unlock(&h->syncLock, AESD_LOCK_SYNC, locked);
+        int ret = aesd_store_sync(h->store);
+        locked = aesd_metrics_lock(&h->syncLock, AESD_LOCK_SYNC);
+        if(ret == 0) {
+            history_synced(h, target);
+            continue;
+        }
+        // fail the appenders this sync covered, and retry an interval later
+        h->syncFailedTo = target;
+        history_release_held(h, target, -1);
+        clock_gettime(CLOCK_MONOTONIC, &h->syncPending);
+        pthread_cond_broadcast(&h->synced);
+        if(h->syncStop) {
+            break;
+        }
+    }
+    aesd_metrics_unlock(&h->syncLock, AESD_LOCK_SYNC, locked);
+    return NULL;
+}
+
+void aesd_history_durability(aesd_history_t *h, aesd_sync_policy_t policy, unsigned intervalMs, size_t bytes) {
+    h->syncPolicy = policy;
+    h->syncIntervalMs = intervalMs;
+    h->syncBytes = bytes;
+}
+
+int aesd_history_start_syncer(aesd_history_t *h) {
+    if(h->syncPolicy != AESD_SYNC_GROUP) {
+        return 0;
+    }
+    if(pthread_create(&h->syncThread, NULL, history_syncer, h) != 0) {
+        syslog(LOG_ERR, "Unable to start the sync thread");
+        return -1;
+    }
+    h->syncRunning = true;
+    return 0;
+}
+
+void aesd_history_checkpoints(aesd_history_t *h, unsigned intervalSec) {
+    uint64_t locked = aesd_metrics_lock(&h->commitLock, AESD_LOCK_COMMIT);
+    h->checkpointSec = intervalSec;
+    h->checkpointAt = aesd_metrics_now();
+    aesd_metrics_unlock(&h->commitLock, AESD_LOCK_COMMIT, locked);
+}
+
+int aesd_history_sync_policy(const char *name) {
+    for(size_t i = 0; i < sizeof(syncPolicyNames) / sizeof(syncPolicyNames[0]); i++) {
+        if(strcmp(syncPolicyNames[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Hand the store end @param end to the sync thread, waking it if that starts its
+ * interval or reaches its byte count.
+ */
+static void history_sync_request(aesd_history_t *h, size_t end) {
+    uint64_t locked = aesd_metrics_lock(&h->syncLock, AESD_LOCK_SYNC);
+    if(h->syncTarget <= h->durable) {
+        clock_gettime(CLOCK_MONOTONIC, &h->syncPending);
+        pthread_cond_signal(&h->syncWanted);
+    } else if(h->syncBytes != 0 && end - h->durable >= h->syncBytes) {
+        pthread_cond_signal(&h->syncWanted);
+    }
+    h->syncTarget = end;
+    aesd_metrics_unlock(&h->syncLock, AESD_LOCK_SYNC, locked);
+}
+
+/**
+ * Wait until the sync thread made the store durable up to @param end.
+ * @return 0 once it did, -1 if the sync covering @param end failed.
+ */
+static int history_wait_durable(aesd_history_t *h, size_t end) {
+    uint64_t locked = aesd_metrics_lock(&h->syncLock, AESD_LOCK_SYNC);
+    while(h->durable < end && h->syncFailedTo < end) {
+        aesd_metrics_cond_wait(&h->synced, &h->syncLock, AESD_LOCK_SYNC, &locked, NULL);
+    }
+    int ret = h->durable >= end ? 0 : -1;
+    aesd_metrics_unlock(&h->syncLock, AESD_LOCK_SYNC, locked);
+    return ret;
+}
+
+/**
+ * Append the @param count packets of @param batch to the store in one go, then add
+ * them to the cache and publish them.
+ */
+static int history_commit(aesd_history_t *h, aesd_commit_t *batch, size_t count) {
+    struct iovec iov[COMMIT_MAX_BATCH];
+    aesd_commit_t *commit = batch;
+    size_t len = 0;
+
+    for(size_t i = 0; i < count; i++, commit = commit->next) {
+        iov[i].iov_base = (void *)commit->data;
+        iov[i].iov_len = commit->len;
+        len += commit->len;
+    }
+    if(aesd_store_append(h->store, iov, count, len) < 0) {
+        return -1;
+    }
+    // the batch is in the store either way, the cache has to follow it
+    int synced = 0;
+    if(h->syncPolicy == AESD_SYNC_PACKET) {
+        synced = aesd_store_sync(h->store);
+    }
+
+    commit = batch;
+    for(size_t i = 0; i < count; i++, commit = commit->next) {
+        if(history_fill(h, commit->data, commit->len) < 0) {
+            syslog(LOG_ERR, "Unable to cache %zu byte(s) of history", commit->len);
+            return -1;
+        }
+    }
+    if(history_publish(h, batch, count) < 0) {
+        return -1;
+    }
+    // only the committer changes the store files, so it is the one to describe them
+    if(h->checkpointSec > 0) {
+        uint64_t now = aesd_metrics_now();
+        if(now - h->checkpointAt >= (uint64_t)h->checkpointSec * 1000000000) {
+            h->checkpointAt = now;
+            aesd_store_checkpoint(h->store);
+        }
+    }
+    if(h->syncPolicy == AESD_SYNC_PACKET && synced == 0) {
+        uint64_t locked = aesd_metrics_lock(&h->syncLock, AESD_LOCK_SYNC);
+        h->syncTarget = h->end;
+        history_synced(h, h->end);
+        aesd_metrics_unlock(&h->syncLock, AESD_LOCK_SYNC, locked);
+    } else if(h->syncPolicy == AESD_SYNC_GROUP) {
+        history_sync_request(h, h->end);
+    }
+    return synced;
+}
+
+/**
+ * Queue @param commit for the next group commit. Called with commitLock held.
+ */
+static void history_queue(aesd_history_t *h, aesd_commit_t *commit) {
+    if(h->queueTail != NULL) {
+        h->queueTail->next = commit;
+    } else {
+        h->queueHead = commit;
+    }
+    h->queueTail = commit;
+    if(++h->queueLen >= h->commitBatch) {
+        pthread_cond_signal(&h->batchFull);
+    }
+}
+
+/**
+ * Hold the submitted packets among the @param count committed ones of @param batch
+ * until the sync thread made them durable, handing back at once those it already
+ * did or failed to.
+ * @return the rest of the batch, @param count set to their number.
+ */
+static aesd_commit_t *history_hold(aesd_history_t *h, aesd_commit_t *batch, size_t *count) {
+    aesd_commit_t *rest = NULL;
+    aesd_commit_t **restTail = &rest;
+    size_t restCount = 0;
+
+    uint64_t locked = aesd_metrics_lock(&h->syncLock, AESD_LOCK_SYNC);
+    for(size_t i = 0; i < *count; i++) {
+        aesd_commit_t *next = batch->next;
+        if(batch->completions == NULL) {
+            *restTail = batch;
+            restTail = &batch->next;
+            restCount++;
+        } else if(batch->end <= h->durable || batch->end <= h->syncFailedTo) {
+            batch->ret = batch->end <= h->durable ? 0 : -1;
+            history_complete(batch);
+        } else {
+            batch->next = NULL;
+            if(h->heldTail != NULL) {
+                h->heldTail->next = batch;
+            } else {
+                h->heldHead = batch;
+            }
+            h->heldTail = batch;
+        }
+        batch = next;
+    }
+    aesd_metrics_unlock(&h->syncLock, AESD_LOCK_SYNC, locked);
+    *count = restCount;
+    return rest;
+}
+
+/**
+ * Take the committer role and commit the oldest batch of the queue, which may not
+ * include the packet of the caller. Called with commitLock held and the queue not
+ * empty; returns with it held and the role free again.
+ */
+static void history_commit_next(aesd_history_t *h, uint64_t *locked) {
+    h->committing = true;
+    if(h->commitWindowUs > 0 && h->queueLen < h->commitBatch) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += (long)(h->commitWindowUs % 1000000) * 1000;
+        deadline.tv_sec += h->commitWindowUs / 1000000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        int waited = 0;
+        while(h->queueLen < h->commitBatch && waited != ETIMEDOUT) {
+            waited = aesd_metrics_cond_wait(&h->batchFull, &h->commitLock, AESD_LOCK_COMMIT, locked, &deadline);
+        }
+    }
+
+    aesd_commit_t *batch = h->queueHead;
+    aesd_commit_t *last = batch;
+    size_t count = 1;
+    while(count < h->commitBatch && last->next != NULL) {
+        last = last->next;
+        count++;
+    }
+    h->queueHead = last->next;
+    if(h->queueHead == NULL) {
+        h->queueTail = NULL;
+    }
+    h->queueLen -= count;
+    aesd_metrics_unlock(&h->commitLock, AESD_LOCK_COMMIT, *locked);
+
+    int ret = history_commit(h, batch, count);
+    if(ret == 0) {
+        aesd_metrics_add(AESD_METRIC_PACKETS, count);
+    }
+    // appenders wait for their own sync, the packets of event loops are held until it is done
+    if(ret == 0 && h->syncPolicy == AESD_SYNC_GROUP) {
+        batch = history_hold(h, batch, &count);
+    }
+
+    *locked = aesd_metrics_lock(&h->commitLock, AESD_LOCK_COMMIT);
+    for(size_t i = 0; i < count; i++) {
+        aesd_commit_t *next = batch->next;
+        if(batch->completions != NULL) {
+            batch->ret = ret;
+            history_complete(batch);
+        } else {
+            batch->ret = ret;
+            batch->done = true;
+        }
+        batch = next;
+    }
+    h->committing = false;
+    pthread_cond_broadcast(&h->committed);
+    if(h->queueHead != NULL) {
+        pthread_cond_signal(&h->commitWanted);
+    }
+}
+
+/**
+ * Body of the commit thread: commits whatever is queued while no appender does.
+ */
+static void *history_committer(void *ptr) {
+    aesd_history_t *h = (aesd_history_t *)ptr;
+
+    uint64_t locked = aesd_metrics_lock(&h->commitLock, AESD_LOCK_COMMIT);
+    while(!h->commitStop || h->queueHead != NULL) {
+        if(h->queueHead == NULL || h->committing) {
+            aesd_metrics_cond_wait(&h->commitWanted, &h->commitLock, AESD_LOCK_COMMIT, &locked, NULL);
+            continue;
+        }
+        history_commit_next(h, &locked);
+    }
+    aesd_metrics_unlock(&h->commitLock, AESD_LOCK_COMMIT, locked);
+    return NULL;
+}
+
+int aesd_history_start_committer(aesd_history_t *h) {
+    if(pthread_create(&h->commitThread, NULL, history_committer, h) != 0) {
+        syslog(LOG_ERR, "Unable to start the commit thread");
+        return -1;
+    }
+    h->commitRunning = true;
+    return 0;
+}
+
+int aesd_history_append(aesd_history_t *h, const char *data, size_t len) {
+    aesd_commit_t self = { .data = data, .len = len };
+
+    uint64_t locked = aesd_metrics_lock(&h->commitLock, AESD_LOCK_COMMIT);
+    history_queue(h, &self);
+    while(!self.done) {
+        if(h->committing) {
+            aesd_metrics_cond_wait(&h->committed, &h->commitLock, AESD_LOCK_COMMIT, &locked, NULL);
+            continue;
+        }
+        history_commit_next(h, &locked);
+    }
+    aesd_metrics_unlock(&h->commitLock, AESD_LOCK_COMMIT, locked);
+    if(self.ret < 0) {
+        return -1;
+    }
+    if(h->syncPolicy == AESD_SYNC_GROUP) {
+        return history_wait_durable(h, self.end);
+    }
+    return 0;
+}
+
+void aesd_history_submit(aesd_history_t *h, aesd_commit_t *commit, const char *data, size_t len,
+                         aesd_completions_t *completions, void *owner) {
+    memset(commit, 0, sizeof(*commit));
+    commit->data = data;
+    commit->len = len;
+    commit->completions = completions;
+    commit->owner = owner;
+
+    uint64_t locked = aesd_metrics_lock(&h->commitLock, AESD_LOCK_COMMIT);
+    history_queue(h, commit);
+    if(!h->committing) {
+        pthread_cond_signal(&h->commitWanted);
+    }
+    aesd_metrics_unlock(&h->commitLock, AESD_LOCK_COMMIT, locked);
+}
+
+int aesd_completions_init(aesd_completions_t *c) {
+    memset(c, 0, sizeof(*c));
+    c->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(c->fd < 0) {
+        syslog(LOG_ERR, "Unable to create a commit eventfd: %s", strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    return 0;
+}
+
+void aesd_completions_destroy(aesd_completions_t *c) {
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+}
+
+aesd_commit_t *aesd_completions_take(aesd_completions_t *c) {
+    uint64_t count;
+    if(read(c->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        syslog(LOG_ERR, "Unable to read a commit eventfd: %s", strerror(errno));
+    }
+    pthread_mutex_lock(&c->lock);
+    aesd_commit_t *done = c->head;
+    c->head = NULL;
+    c->tail = NULL;
+    pthread_mutex_unlock(&c->lock);
+    return done;
+}
+
+int aesd_history_seekto(aesd_history_t *h, uint32_t record, uint32_t offset, size_t *from) {
+    int ret = -1;
+
+    uint64_t locked = aesd_metrics_lock(&h->publishLock, AESD_LOCK_PUBLISH);
+    if(record < h->recordsLen) {
+        size_t begin = history_record_start(h, record);
+        size_t finish = record + 1 < h->recordsLen ? history_record_start(h, record + 1) : h->end;
+        if(offset <= finish - begin) {
+            *from = begin + offset;
+            ret = 0;
+        }
+    }
+    aesd_metrics_unlock(&h->publishLock, AESD_LOCK_PUBLISH, locked);
+    return ret;
+}
+
+void aesd_history_record_offset(aesd_history_t *h, size_t seq, size_t *from) {
+    uint64_t locked = aesd_metrics_lock(&h->publishLock, AESD_LOCK_PUBLISH);
+    if(seq < h->recordsDropped) {
+        *from = h->start;
+    } else if(seq - h->recordsDropped < h->recordsLen) {
+        *from = history_record_start(h, seq - h->recordsDropped);
+    } else {
+        *from = h->end;
+    }
+    aesd_metrics_unlock(&h->publishLock, AESD_LOCK_PUBLISH, locked);
+}
+
+void aesd_history_record_after(aesd_history_t *h, size_t offset, size_t *from) {
+    uint64_t locked = aesd_metrics_lock(&h->publishLock, AESD_LOCK_PUBLISH);
+    // record starts only grow, so the first one at or after offset is found by bisection
+    size_t lo = 0;
+    size_t hi = h->recordsLen;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(history_record_start(h, mid) < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if(lo == h->recordsLen && lo > 0) {
+        lo--;
+    }
+    *from = lo < h->recordsLen ? history_record_start(h, lo) : h->end;
+    aesd_metrics_unlock(&h->publishLock, AESD_LOCK_PUBLISH, locked);
+}
+
+int aesd_history_watch(aesd_history_t *h) {
+    if(h->notifyFd < 0) {
+        h->notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    return h->notifyFd;
+}
+
+void aesd_history_unwatch(aesd_history_t *h) {
+    if(h->notifyFd >= 0) {
+        close(h->notifyFd);
+        h->notifyFd = -1;
+    }
+}
+
+void aesd_history_stats(aesd_history_t *h, aesd_history_stats_t *stats) {
+    uint64_t locked = aesd_metrics_lock(&h->publishLock, AESD_LOCK_PUBLISH);
+    stats->start = h->start;
+    stats->end = h->end;
+    stats->cachedFrom = h->cachedFrom;
+    stats->firstRecord = h->recordsDropped;
+    stats->records = h->recordsLen;
+    aesd_metrics_unlock(&h->publishLock, AESD_LOCK_PUBLISH, locked);
+    stats->syncPolicy = syncPolicyNames[h->syncPolicy];
+    locked = aesd_metrics_lock(&h->syncLock, AESD_LOCK_SYNC);
+    stats->durable = h->durable;
+    stats->syncs = h->syncs;
+    aesd_metrics_unlock(&h->syncLock, AESD_LOCK_SYNC, locked);
+}
+
+int aesd_history_sync(aesd_history_t *h, size_t *end) {
+    uint64_t locked = aesd_metrics_lock(&h->publishLock, AESD_LOCK_PUBLISH);
+    *end = h->end;
+    aesd_metrics_unlock(&h->publishLock, AESD_LOCK_PUBLISH, locked);
+    if(aesd_store_sync(h->store) < 0) {
+        return -1;
+    }
+    locked = aesd_metrics_lock(&h->syncLock, AESD_LOCK_SYNC);
+    history_synced(h, *end);
+    aesd_metrics_unlock(&h->syncLock, AESD_LOCK_SYNC, locked);
+    return 0;
+}
+
+void aesd_history_reply_init(aesd_history_t *h, aesd_history_reply_t *reply, size_t from) {
+    aesd_history_reply_range(h, reply, from, SIZE_MAX);
+}
+
+void aesd_history_reply_range(aesd_history_t *h, aesd_history_reply_t *reply, size_t from, size_t to) {
+    memset(reply, 0, sizeof(*reply));
+    reply->store.pipeFds[0] = -1;
+    reply->store.pipeFds[1] = -1;
+
+    uint64_t locked = aesd_metrics_lock(&h->publishLock, AESD_LOCK_PUBLISH);
+    if(to > h->end) {
+        to = h->end;
+    }
+    if(from < h->start) {
+        from = h->start;
+    }
+    if(from > to) {
+        from = to;
+    }
+    if(from < h->cachedFrom) {
+        // evicted from memory, but still in the store at the same offset
+        size_t storeEnd = to < h->cachedFrom ? to : h->cachedFrom;
+        aesd_zc_init_range(&reply->store, h->store->fd, h->store->dataOffset + from, storeEnd - from);
+        reply->fromStore = true;
+        from = storeEnd;
+    }
+    reply->snap.pos = from;
+    reply->snap.end = to;
+    if(from < to) {
+        aesd_chunk_t *chunk = h->head;
+        while(chunk->base + chunk->cap <= from) {
+            chunk = chunk->next;
+        }
+        chunk_ref(chunk);
+        reply->snap.chunk = chunk;
+    }
+    aesd_metrics_unlock(&h->publishLock, AESD_LOCK_PUBLISH, locked);
+}
+
+int aesd_history_reply_text(aesd_history_reply_t *reply, const char *text, size_t len) {
+    memset(reply, 0, sizeof(*reply));
+    reply->store.pipeFds[0] = -1;
+    reply->store.pipeFds[1] = -1;
+    if(len == 0) {
+        return 0;
+    }
+
+    // a private chunk outside the history, freed by the snapshot once sent
+    aesd_chunk_t *chunk = chunk_new(0, len);
+    if(chunk == NULL) {
+        return -1;
+    }
+    memcpy(chunk->data, text, len);
+    chunk->len = len;
+    reply->snap.chunk = chunk;
+    reply->snap.end = len;
+    return 0;
+}
+
+size_t aesd_history_reply_pending(const aesd_history_reply_t *reply) {
+    size_t pending = reply->snap.end - reply->snap.pos;
+    if(reply->fromStore) {
+        pending += reply->store.remaining + reply->store.pending;
+    }
+    return pending;
+}
+
+int aesd_history_reply_iov(aesd_history_reply_t *reply, struct iovec *iov, int maxIov) {
+    aesd_snapshot_t *snap = &reply->snap;
+    aesd_chunk_t *chunk = snap->chunk;
+    size_t pos = snap->pos;
+    int n = 0;
+
+    while(n < maxIov && pos < snap->end) {
+        size_t chunkEnd = chunk->base + chunk->cap < snap->end ? chunk->base + chunk->cap : snap->end;
+        iov[n].iov_base = chunk->data + (pos - chunk->base);
+        iov[n].iov_len = chunkEnd - pos;
+        pos = chunkEnd;
+        chunk = chunk->next;
+        n++;
+    }
+    return n;
+}
+
+void aesd_history_reply_advance(aesd_history_reply_t *reply, size_t sent) {
+    aesd_snapshot_t *snap = &reply->snap;
+
+    snap->pos += sent;
+    while(snap->chunk != NULL && (snap->pos >= snap->end || snap->pos >= snap->chunk->base + snap->chunk->cap)) {
+        aesd_chunk_t *done = snap->chunk;
+        snap->chunk = snap->pos < snap->end ? done->next : NULL;
+        if(snap->chunk != NULL) {
+            chunk_ref(snap->chunk);
+        }
+        chunk_unref(done);
+    }
+}
+
+int aesd_history_reply_send(aesd_history_reply_t *reply, int sockfd) {
+    struct iovec iov[REPLY_MAX_IOV];
+    struct msghdr msg;
+    int n;
+
+    if(reply->fromStore) {
+        size_t remaining = reply->store.remaining;
+        int ret = aesd_zc_send(&reply->store, sockfd);
+        aesd_metrics_add(AESD_METRIC_BYTES_OUT, remaining - reply->store.remaining);
+        if(ret != 1) {
+            return ret;
+        }
+        reply->fromStore = false;
+    }
+    while((n = aesd_history_reply_iov(reply, iov, REPLY_MAX_IOV)) > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        aesd_history_reply_advance(reply, sent);
+        aesd_metrics_add(AESD_METRIC_BYTES_OUT, sent);
+    }
+    return 1;
+}
+
+void aesd_history_reply_release(aesd_history_reply_t *reply) {
+    aesd_zc_release(&reply->store);
+    chunk_unref(reply->snap.chunk);
+    reply->snap.chunk = NULL;
+}
@@ -0,0 +1,369 @@
+#ifndef _AESD_HISTORY_H_
+#define _AESD_HISTORY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "aesd_zerocopy.h"
+#include "aesd_store.h"
+
+#define AESD_HISTORY_CHUNK_SIZE (64 * 1024)
+
+typedef enum {
+    AESD_SYNC_NONE,         // leave flushing to the kernel, or to AESDCHAR_SYNC
+    AESD_SYNC_PACKET,       // fdatasync() each group commit before publishing it
+    AESD_SYNC_GROUP,        // a sync thread covers every packet stored within an interval or a byte count
+} aesd_sync_policy_t;
+
+/**
+ * One segment of the in-memory history. Chunks are filled in order and only ever
+ * appended to, so published bytes of a chunk never change. A chunk is kept alive
+ * by a reference from the history (for the head) or from the previous chunk, plus
+ * one per snapshot positioned in it, and drops its reference on next when freed.
+ * With a mapped store, a chunk is a view of one file of the store instead of a copy.
+ */
+typedef struct aesd_chunk_s aesd_chunk_t;
+struct aesd_chunk_s {
+    aesd_chunk_t *next;     // linked before any byte of the next chunk is published
+    int refs;
+    size_t base;            // history offset of data[0]
+    size_t len;             // bytes filled, only meaningful to the appender
+    size_t cap;
+    char *data;             // allocated along with the chunk, or in map
+    void *map;              // mapping of the store unmapped with the chunk, NULL if none
+    size_t mapLen;
+};
+
+typedef struct aesd_commit_s aesd_commit_t;
+
+/**
+ * Packets an event loop submitted with aesd_history_submit(), handed back by the
+ * committer once they are committed, or by the sync thread once they are durable
+ * if the sync policy waits for it. Handing back the first of them signals fd, an
+ * eventfd the loop watches, which then takes the whole list at once.
+ */
+typedef struct aesd_completions_s aesd_completions_t;
+struct aesd_completions_s {
+    pthread_mutex_t lock;
+    aesd_commit_t *head;    // oldest first
+    aesd_commit_t *tail;
+    int fd;
+};
+
+/**
+ * A packet waiting for the group commit that stores it, either in
+ * aesd_history_append() or, when submitted by an event loop, without anyone waiting.
+ */
+struct aesd_commit_s {
+    aesd_commit_t *next;
+    const char *data;
+    size_t len;
+    size_t end;             // offset one past the packet once published
+    bool done;
+    int ret;
+    aesd_completions_t *completions;    // where to hand a submitted packet back, NULL in aesd_history_append()
+    void *owner;                        // whatever the submitter tracks the packet with
+};
+
+/**
+ * Append-only cache of everything written to the store, kept in sync with the
+ * store by routing every packet through aesd_history_append(). Replies are served
+ * from memory; the store is read back only at startup, and for the part of a
+ * store that can be read back which was evicted from memory because of maxCached.
+ * A store mapped into memory is the cache: its chunks are views of the store files
+ * and replies point straight into them, and if it keeps a record index the records
+ * are looked up there instead of scanning the history for newlines at startup; only
+ * those appended since are held in memory. The committer checkpoints the store every
+ * checkpointSec, so the next startup only checks what was appended after that.
+ *
+ * Appenders queue their packets under commitLock. One of them at a time becomes
+ * the committer: it optionally waits commitWindowUs for more packets to join, takes
+ * up to commitBatch of them in queue order, writes them to the store with a single
+ * append and fills chunks past the published end, which readers never look at,
+ * then wakes every appender of the batch at once. Event loops can not wait for a
+ * commit, so they submit their packets instead and the commit thread takes the
+ * committer role for them, handing each packet back once it is committed. The new end, the record offsets
+ * and trimming are published under publishLock, the only lock a reader takes, and
+ * only for as long as it needs to reference its first chunk.
+ *
+ * How far the store is durable depends on the sync policy. AESD_SYNC_PACKET syncs
+ * each batch before publishing it. With AESD_SYNC_GROUP the committer only hands
+ * the new end to the sync thread, which syncs syncIntervalMs after the first byte
+ * that is not durable, or once syncBytes are pending; the appenders a sync covers
+ * all return once it completes, and the packets event loops submitted are held
+ * until then before they are handed back, so no reply promises more than the disk.
+ *
+ * Offsets count history bytes from the creation of the store. Records are the
+ * packets as they were appended; with a record or byte limit set by the store (the
+ * aesdchar driver keeps AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED writes, the memory
+ * store a number of bytes, the other stores their retention caps) the oldest ones
+ * are dropped, and a store with segments gives back the space they took.
+ */
+typedef struct aesd_history_s aesd_history_t;
+struct aesd_history_s {
+    pthread_mutex_t commitLock;
+    pthread_cond_t committed;       // a batch was stored, or the committer role is free
+    pthread_cond_t batchFull;       // wakes a committer waiting out its window
+    aesd_commit_t *queueHead;       // packets waiting for a committer, oldest first
+    aesd_commit_t *queueTail;
+    size_t queueLen;
+    bool committing;
+    unsigned commitWindowUs;
+    size_t commitBatch;
+    pthread_cond_t commitWanted;    // wakes the commit thread
+    bool commitStop;
+    bool commitRunning;             // commitThread was started
+    pthread_t commitThread;
+    pthread_mutex_t publishLock;
+    aesd_store_t *store;
+    bool mapped;            // chunks are views of the store rather than copies
+    aesd_chunk_t *head;     // oldest chunk still in memory
+    aesd_chunk_t *tail;     // owned by the committer
+    size_t start;           // offset of the oldest retained byte
+    size_t cachedFrom;      // offset of the oldest byte held in memory, >= start
+    size_t end;             // offset one past the newest published byte
+    size_t *records;        // start offsets of the retained records past those indexed, from recordsFirst on
+    size_t recordsFirst;
+    size_t recordsIndexed;  // oldest retained records looked up in the store index instead
+    size_t recordsDropped;  // sequence number of the oldest retained record
+    size_t recordsLen;
+    size_t recordsCap;
+    size_t maxRecords;      // records retained, 0 for no limit
+    size_t maxBytes;        // bytes retained, whole records at a time, 0 for no limit
+    size_t maxCached;       // bytes of a store that can be read back held in memory, 0 for no limit
+    unsigned checkpointSec; // interval of the store checkpoints, 0 for only on close
+    int notifyFd;           // eventfd written after each publish, -1 until aesd_history_watch()
+    uint64_t checkpointAt;  // aesd_metrics_now() of the last one, owned by the committer
+    pthread_mutex_t syncLock;
+    pthread_cond_t syncWanted;      // wakes the sync thread
+    pthread_cond_t synced;          // durable moved, or a sync failed
+    aesd_sync_policy_t syncPolicy;
+    unsigned syncIntervalMs;
+    size_t syncBytes;               // bytes pending that trigger a sync at once, 0 for none
+    size_t syncTarget;              // offset one past the newest byte stored
+    size_t durable;                 // offset one past the newest byte known to be on disk
+    size_t syncFailedTo;            // a sync covering up to there failed
+    aesd_commit_t *heldHead;        // submitted packets waiting for durable to pass their end, oldest first
+    aesd_commit_t *heldTail;
+    struct timespec syncPending;    // when the oldest byte that is not durable was stored
+    size_t syncs;
+    bool syncStop;
+    bool syncRunning;               // syncThread was started
+    pthread_t syncThread;
+};
+
+/**
+ * Immutable view of the cached history from pos to end, streamed without any lock.
+ */
+typedef struct aesd_snapshot_s aesd_snapshot_t;
+struct aesd_snapshot_s {
+    aesd_chunk_t *chunk;    // referenced chunk holding pos, NULL once pos reaches end
+    size_t pos;
+    size_t end;
+};
+
+/**
+ * State of a reply covering history from some offset to the end at the time it
+ * was prepared: the part only found in the store is streamed from there, the
+ * cached part from a snapshot.
+ */
+typedef struct aesd_history_reply_s aesd_history_reply_t;
+struct aesd_history_reply_s {
+    bool fromStore;         // still sending the part before the cache
+    aesd_zc_t store;
+    aesd_snapshot_t snap;
+};
+
+/**
+ * Counters describing the history at one point in time.
+ */
+typedef struct aesd_history_stats_s aesd_history_stats_t;
+struct aesd_history_stats_s {
+    size_t start;           // offset of the oldest retained byte
+    size_t end;             // offset one past the newest byte
+    size_t cachedFrom;      // offset of the oldest byte held in memory
+    size_t firstRecord;     // sequence number of the oldest retained record
+    size_t records;         // retained records
+    const char *syncPolicy;
+    size_t durable;         // offset one past the newest byte known to be on disk
+    size_t syncs;           // syncs done by the policy or asked for
+};
+
+/**
+ * Load the history found in the open @param store, which is closed with @param h,
+ * retaining as much as the store does.
+ * @param maxCached bytes of a store that can be read back to keep in memory, 0 for no limit.
+ * @return 0 on success, -1 if the store could not be read or memory allocated.
+ */
+int aesd_history_init(aesd_history_t *h, aesd_store_t *store, size_t maxCached);
+
+/**
+ * Let each group commit wait up to @param windowUs microseconds for more packets,
+ * and store at most @param batch packets (at least 1) per writev().
+ */
+void aesd_history_group_commit(aesd_history_t *h, unsigned windowUs, size_t batch);
+
+/**
+ * Make appends durable according to @param policy. With AESD_SYNC_GROUP, a sync
+ * runs @param intervalMs after the first byte that is not durable was stored, or
+ * as soon as @param bytes (0 for no limit) are pending, whichever comes first,
+ * once aesd_history_start_syncer() started the sync thread.
+ */
+void aesd_history_durability(aesd_history_t *h, aesd_sync_policy_t policy, unsigned intervalMs, size_t bytes);
+
+/**
+ * Start the sync thread if the policy of aesd_history_durability() needs one, before
+ * anything is appended.
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int aesd_history_start_syncer(aesd_history_t *h);
+
+/**
+ * Start the commit thread, which commits the packets of aesd_history_submit() when
+ * no appender is committing.
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int aesd_history_start_committer(aesd_history_t *h);
+
+/**
+ * Checkpoint the store every @param intervalSec seconds in which packets were
+ * committed, 0 for only when it is closed.
+ */
+void aesd_history_checkpoints(aesd_history_t *h, unsigned intervalSec);
+
+/**
+ * @return the sync policy named @param name, or -1 if there is none.
+ */
+int aesd_history_sync_policy(const char *name);
+
+/**
+ * Stop the commit and sync threads, free the cached history and close the store and the
+ * eventfd of aesd_history_watch().
+ */
+void aesd_history_destroy(aesd_history_t *h);
+
+/**
+ * Write the packet @param data of @param len bytes to the store and the cache as one
+ * record, as part of the next group commit. Returns once the packet is published,
+ * and durable if the sync policy asks for it.
+ * @return 0 on success, -1 if the store write or the sync covering the packet
+ *   failed (the cache is left untouched by a failed write).
+ */
+int aesd_history_append(aesd_history_t *h, const char *data, size_t len);
+
+/**
+ * Queue the packet @param data of @param len bytes like aesd_history_append(), but
+ * return at once. @param commit, which keeps @param owner, is handed back through
+ * @param completions once the packet is published, and durable if the sync policy
+ * asks for it, with ret set to what aesd_history_append() would have returned. Until
+ * then neither @param commit nor @param data may change.
+ */
+void aesd_history_submit(aesd_history_t *h, aesd_commit_t *commit, const char *data, size_t len,
+                         aesd_completions_t *completions, void *owner);
+
+/**
+ * Set up @param c with its eventfd.
+ * @return 0 on success, -1 if the eventfd could not be created.
+ */
+int aesd_completions_init(aesd_completions_t *c);
+
+void aesd_completions_destroy(aesd_completions_t *c);
+
+/**
+ * Clear the eventfd of @param c and take the packets handed back so far.
+ * @return the oldest of them, linked through next, or NULL if there are none.
+ */
+aesd_commit_t *aesd_completions_take(aesd_completions_t *c);
+
+/**
+ * Translate the AESDCHAR_IOCSEEKTO pair (@param record, @param offset) into a history
+ * offset, counting records from the oldest retained one like the driver does.
+ * @return 0 and the offset in @param from, or -1 if the pair is out of range.
+ */
+int aesd_history_seekto(aesd_history_t *h, uint32_t record, uint32_t offset, size_t *from);
+
+/**
+ * Translate the sequence number @param seq of a record (counting every record ever
+ * appended, from 0) into the history offset it starts at. Records no longer retained
+ * resolve to the oldest retained byte, records not appended yet to the end.
+ * @return the offset in @param from.
+ */
+void aesd_history_record_offset(aesd_history_t *h, size_t seq, size_t *from);
+
+/**
+ * @return in @param from the offset of the first retained record starting at or
+ *   after @param offset, that of the newest record if none does, or the end if no
+ *   record is retained.
+ */
+void aesd_history_record_after(aesd_history_t *h, size_t offset, size_t *from);
+
+/**
+ * @return a nonblocking eventfd written to each time a group commit is published,
+ *   created by the first call, which has to come before anything is appended, and
+ *   closed with the history; -1 if it could not be created.
+ */
+int aesd_history_watch(aesd_history_t *h);
+
+/**
+ * Close the eventfd of aesd_history_watch() again, for a watcher that failed to start
+ * before anything was appended.
+ */
+void aesd_history_unwatch(aesd_history_t *h);
+
+void aesd_history_stats(aesd_history_t *h, aesd_history_stats_t *stats);
+
+/**
+ * Flush everything published so far to stable storage.
+ * @return 0 with the offset the store is durable up to in @param end, -1 on error.
+ */
+int aesd_history_sync(aesd_history_t *h, size_t *end);
+
+/**
+ * Prepare @param reply to send the history from offset @param from (clamped to the
+ * oldest retained byte) up to the current end.
+ */
+void aesd_history_reply_init(aesd_history_t *h, aesd_history_reply_t *reply, size_t from);
+
+/**
+ * Like aesd_history_reply_init() but stop at offset @param to, or the current end if
+ * it comes first.
+ */
+void aesd_history_reply_range(aesd_history_t *h, aesd_history_reply_t *reply, size_t from, size_t to);
+
+/**
+ * Prepare @param reply to send a copy of the @param len bytes of @param text instead
+ * of history, e.g. the answer to a command.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int aesd_history_reply_text(aesd_history_reply_t *reply, const char *text, size_t len);
+
+/**
+ * @return the bytes of @param reply not sent yet.
+ */
+size_t aesd_history_reply_pending(const aesd_history_reply_t *reply);
+
+/**
+ * Fill @param iov with up to @param maxIov pieces of the cached part of @param reply.
+ * @return the number of entries filled, 0 once the cached part is sent.
+ */
+int aesd_history_reply_iov(aesd_history_reply_t *reply, struct iovec *iov, int maxIov);
+
+/**
+ * Account for @param sent bytes of the cached part having been sent.
+ */
+void aesd_history_reply_advance(aesd_history_reply_t *reply, size_t sent);
+
+/**
+ * Send as much of @param reply to @param sockfd as it accepts.
+ * @return 1 when the reply is complete, 0 if the socket would block, -1 on error.
+ */
+int aesd_history_reply_send(aesd_history_reply_t *reply, int sockfd);
+
+void aesd_history_reply_release(aesd_history_reply_t *reply);
+
+#endif
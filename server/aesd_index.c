@@ -0,0 +1,240 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aesd_index.h"
+
+#define INDEX_MAGIC "AESDIDX1"
+#define INDEX_BLOCK 1024        // entries read or written at a time
+
+typedef struct {
+    char magic[8];
+    uint64_t firstSeq;
+} index_header_t;
+
+static off_t index_entry_offset(size_t entry) {
+    return sizeof(index_header_t) + (off_t)entry * sizeof(uint64_t);
+}
+
+static int index_pwrite(int fd, const void *buf, size_t len, off_t offset) {
+    while(len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0) {
+            return -1;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int index_pread(int fd, void *buf, size_t len, off_t offset) {
+    ssize_t n;
+    while((n = pread(fd, buf, len, offset)) < 0 && errno == EINTR) {
+    }
+    if(n >= 0 && (size_t)n != len) {
+        errno = EIO;
+    }
+    return (size_t)n == len ? 0 : -1;
+}
+
+/**
+ * Give up on an index that could not be written: with a hole it would merge records.
+ */
+static void index_drop(aesd_index_t *idx) {
+    syslog(LOG_ERR, "Unable to write %s, removing it: %s", idx->path, strerror(errno));
+    close(idx->fd);
+    idx->fd = -1;
+    unlink(idx->path);
+}
+
+void aesd_index_append(aesd_index_t *idx, const size_t *offsets, size_t count) {
+    uint64_t buf[INDEX_BLOCK];
+
+    for(size_t done = 0; idx->fd >= 0 && done < count;) {
+        size_t n = count - done < INDEX_BLOCK ? count - done : INDEX_BLOCK;
+        for(size_t i = 0; i < n; i++) {
+            buf[i] = offsets[done + i];
+        }
+        if(index_pwrite(idx->fd, buf, n * sizeof(uint64_t), index_entry_offset(idx->count + done)) < 0) {
+            index_drop(idx);
+        }
+        done += n;
+    }
+    if(count > 0) {
+        idx->count += count;
+        idx->last = offsets[count - 1];
+        idx->dirty = true;
+    }
+}
+
+void aesd_index_truncate(aesd_index_t *idx, size_t count) {
+    if(count >= idx->count) {
+        return;
+    }
+    uint64_t last = 0;
+    idx->count = count;
+    if(idx->fd >= 0 && (ftruncate(idx->fd, index_entry_offset(count)) < 0 ||
+                        (count > 0 && index_pread(idx->fd, &last, sizeof(last), index_entry_offset(count - 1)) < 0))) {
+        index_drop(idx);
+    }
+    idx->last = last;
+}
+
+int aesd_index_sync(aesd_index_t *idx) {
+    if(idx->fd < 0) {
+        return -1;
+    }
+    if(idx->dirty && fdatasync(idx->fd) < 0) {
+        syslog(LOG_ERR, "Unable to sync %s: %s", idx->path, strerror(errno));
+        return -1;
+    }
+    idx->dirty = false;
+    return 0;
+}
+
+int aesd_index_open(aesd_index_t *idx, const char *path, const char *data, size_t base, size_t len,
+                    size_t first, size_t firstSeq, size_t trusted, size_t trustedLast) {
+    index_header_t header;
+    struct stat st;
+    uint64_t buf[INDEX_BLOCK];
+    size_t entries = 0;
+    size_t last = 0;
+
+    memset(idx, 0, sizeof(*idx));
+    idx->firstSeq = firstSeq;
+    idx->fd = -1;
+    idx->path = strdup(path);
+    if(idx->path == NULL) {
+        return -1;
+    }
+    idx->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(idx->fd < 0 || fstat(idx->fd, &st) < 0) {
+        goto fail;
+    }
+    if(st.st_size >= (off_t)sizeof(header) && index_pread(idx->fd, &header, sizeof(header), 0) == 0 &&
+       memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0) {
+        idx->firstSeq = header.firstSeq;
+        entries = (st.st_size - sizeof(header)) / sizeof(uint64_t);
+        // vouched for entries only need the last of them to carry on from
+        if(trusted > 0 && trusted <= entries && header.firstSeq == firstSeq &&
+           index_pread(idx->fd, buf, sizeof(uint64_t), index_entry_offset(trusted - 1)) == 0 &&
+           buf[0] == trustedLast && buf[0] < base + len) {
+            idx->count = trusted;
+            last = buf[0];
+        }
+    } else {
+        memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+        header.firstSeq = firstSeq;
+        if(ftruncate(idx->fd, 0) < 0 || index_pwrite(idx->fd, &header, sizeof(header), 0) < 0) {
+            goto fail;
+        }
+    }
+
+    // keep the entries that fit the file, up to the first that does not
+    bool valid = true;
+    while(valid && idx->count < entries) {
+        size_t n = entries - idx->count < INDEX_BLOCK ? entries - idx->count : INDEX_BLOCK;
+        if(index_pread(idx->fd, buf, n * sizeof(uint64_t), index_entry_offset(idx->count)) < 0) {
+            goto fail;
+        }
+        for(size_t i = 0; i < n && valid; i++) {
+            valid = (idx->count == 0 ? buf[i] == base + first : buf[i] > last) && buf[i] < base + len;
+            if(valid) {
+                last = buf[i];
+                idx->count++;
+            }
+        }
+    }
+    if(idx->count < entries && ftruncate(idx->fd, index_entry_offset(idx->count)) < 0) {
+        goto fail;
+    }
+    idx->last = last;
+
+    // the records after the last entry end where the newlines are
+    size_t found[INDEX_BLOCK];
+    size_t n = 0;
+    size_t added = 0;
+    size_t from = idx->count > 0 ? last - base : first;
+    const char *newline;
+    if(idx->count == 0 && first < len) {
+        found[n++] = base + first;
+    }
+    while(from < len && (newline = memchr(data + from, '\n', len - from)) != NULL) {
+        from = newline + 1 - data;
+        if(from == len) {
+            break;
+        }
+        found[n++] = base + from;
+        if(n == INDEX_BLOCK) {
+            aesd_index_append(idx, found, n);
+            added += n;
+            n = 0;
+        }
+    }
+    if(n > 0) {
+        aesd_index_append(idx, found, n);
+        added += n;
+    }
+    if(idx->fd < 0) {
+        errno = EIO;
+        return -1;
+    }
+    if(added > 0) {
+        syslog(LOG_INFO, "Indexed %zu record(s) of %s from the history", added, path);
+    }
+
+    if(idx->count > 0) {
+        idx->mapLen = index_entry_offset(idx->count);
+        idx->map = mmap(NULL, idx->mapLen, PROT_READ, MAP_SHARED, idx->fd, 0);
+        if(idx->map == MAP_FAILED) {
+            idx->map = NULL;
+            goto fail;
+        }
+        idx->entries = (const uint64_t *)((const char *)idx->map + sizeof(header));
+        idx->mapped = idx->count;
+    }
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "Unable to open %s: %s", path, strerror(errno));
+    int err = errno;
+    // a stale index left behind could pass for a valid one later on
+    unlink(path);
+    aesd_index_close(idx);
+    errno = err;
+    return -1;
+}
+
+void aesd_index_close(aesd_index_t *idx) {
+    if(idx->map != NULL) {
+        munmap(idx->map, idx->mapLen);
+    }
+    idx->map = NULL;
+    idx->entries = NULL;
+    idx->mapped = 0;
+    if(idx->fd >= 0) {
+        close(idx->fd);
+    }
+    idx->fd = -1;
+    free(idx->path);
+    idx->path = NULL;
+}
+
+void aesd_index_remove(aesd_index_t *idx) {
+    if(idx->path != NULL && unlink(idx->path) < 0 && errno != ENOENT) {
+        syslog(LOG_WARNING, "Unable to remove %s: %s", idx->path, strerror(errno));
+    }
+    aesd_index_close(idx);
+}
@@ -0,0 +1,83 @@
+#ifndef _AESD_INDEX_H_
+#define _AESD_INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESD_INDEX_SUFFIX ".idx"
+
+/**
+ * Append-only sidecar of one store file, listing the history offset every record
+ * starting in the file starts at, so record boundaries are found with a lookup
+ * instead of a scan of the history. The file is a header holding the sequence
+ * number of the first record, followed by one 64 bit offset per record.
+ *
+ * An index is only written after the bytes it points to, and may lose its newest
+ * entries in a crash; opening it keeps the entries that fit the file and finds the
+ * records after the last one by scanning for newlines, which also rebuilds an index
+ * that is missing. Entries a checkpoint vouches for are not checked again, so only
+ * the tail written since costs anything. An index that cannot be written is removed
+ * rather than left with a hole, to be rebuilt on the next start.
+ *
+ * The entries found on open stay mapped read-only for lookups; those appended later
+ * are only written.
+ */
+typedef struct aesd_index_s aesd_index_t;
+struct aesd_index_s {
+    char *path;
+    int fd;                 // -1 once the index is gone
+    size_t firstSeq;        // sequence number of the first record of the file
+    size_t count;           // records starting in the file
+    size_t last;            // offset of the last of them, if any
+    const uint64_t *entries;    // the first mapped of them
+    size_t mapped;
+    void *map;
+    size_t mapLen;
+    bool dirty;             // appended to since the last aesd_index_sync()
+};
+
+/**
+ * Open the index at @param path of the store file holding the @param len history
+ * bytes at @param data, the first of which is at offset @param base, and bring it
+ * up to date with the file.
+ * @param first where in the file its first record starts, @param len if none does.
+ * @param firstSeq sequence number of that record, if the index has to be created.
+ * @param trusted entries of an index numbering from @param firstSeq known to be
+ *   valid, the last of them @param trustedLast, 0 to check them all.
+ * @return 0 on success, -1 with errno set if the index can't be used.
+ */
+int aesd_index_open(aesd_index_t *idx, const char *path, const char *data, size_t base, size_t len,
+                    size_t first, size_t firstSeq, size_t trusted, size_t trustedLast);
+
+/**
+ * Add the @param count records starting at @param offsets.
+ */
+void aesd_index_append(aesd_index_t *idx, const size_t *offsets, size_t count);
+
+/**
+ * Forget every record after the first @param count.
+ */
+void aesd_index_truncate(aesd_index_t *idx, size_t count);
+
+/**
+ * @return the offset record @param i of the file starts at, for i < mapped.
+ */
+static inline size_t aesd_index_entry(const aesd_index_t *idx, size_t i) {
+    return idx->entries[i];
+}
+
+/**
+ * Flush the entries appended since the last call to stable storage.
+ * @return 0 on success, -1 if the index is gone or could not be flushed.
+ */
+int aesd_index_sync(aesd_index_t *idx);
+
+void aesd_index_close(aesd_index_t *idx);
+
+/**
+ * Close the index and delete its file along with the store file.
+ */
+void aesd_index_remove(aesd_index_t *idx);
+
+#endif
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "aesd_metrics.h"
+#include "aesd_slab.h"
+
+#define METRICS_REQUEST_WAIT_MS 100     // time a client gets to send an HTTP request line
+
+/* only the owning thread writes a block, aesd_metrics_render() reads them relaxed */
+typedef struct metrics_block_s metrics_block_t;
+struct metrics_block_s {
+    metrics_block_t *prev;
+    metrics_block_t *next;
+    size_t counters[AESD_METRIC_COUNT];
+    size_t lockWaitNs[AESD_LOCK_COUNT];
+    size_t lockHoldNs[AESD_LOCK_COUNT];
+    size_t lockAcquired[AESD_LOCK_COUNT];
+    size_t latency[AESD_METRICS_LATENCY_BUCKETS];
+    size_t latencySumNs;
+};
+
+static const char *lockNames[AESD_LOCK_COUNT] = { "commit", "publish", "sync" };
+
+static pthread_mutex_t blocksLock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_block_t *blocks;
+static metrics_block_t retired;         // totals of the threads that exited, under blocksLock
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t blockKey;
+static __thread metrics_block_t *self;
+
+static void block_add(size_t *value, size_t n) {
+    __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+static void block_retire(void *ptr) {
+    metrics_block_t *block = (metrics_block_t *)ptr;
+    size_t *from = block->counters;
+    size_t *to = retired.counters;
+    size_t count = (sizeof(metrics_block_t) - offsetof(metrics_block_t, counters)) / sizeof(size_t);
+
+    pthread_mutex_lock(&blocksLock);
+    for(size_t i = 0; i < count; i++) {
+        to[i] += from[i];
+    }
+    if(block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        blocks = block->next;
+    }
+    if(block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    pthread_mutex_unlock(&blocksLock);
+    free(block);
+    self = NULL;
+}
+
+static void block_make_key(void) {
+    pthread_key_create(&blockKey, block_retire);
+}
+
+/**
+ * @return the block of the calling thread, or the retired totals if it cannot have
+ *   one, which then only loses precision to concurrent updates.
+ */
+static metrics_block_t *block_get(void) {
+    if(self != NULL) {
+        return self;
+    }
+    pthread_once(&keyOnce, block_make_key);
+    metrics_block_t *block = calloc(1, sizeof(metrics_block_t));
+    if(block == NULL) {
+        return &retired;
+    }
+    pthread_mutex_lock(&blocksLock);
+    block->next = blocks;
+    if(blocks != NULL) {
+        blocks->prev = block;
+    }
+    blocks = block;
+    pthread_mutex_unlock(&blocksLock);
+    pthread_setspecific(blockKey, block);
+    self = block;
+    return block;
+}
+
+uint64_t aesd_metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void aesd_metrics_add(aesd_metric_t metric, size_t n) {
+    block_add(&block_get()->counters[metric], n);
+}
+
+void aesd_metrics_latency(uint64_t ns) {
+    metrics_block_t *block = block_get();
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+
+    while(bucket < AESD_METRICS_LATENCY_BUCKETS - 1 && us > (1ULL << bucket)) {
+        bucket++;
+    }
+    block_add(&block->latency[bucket], 1);
+    block_add(&block->latencySumNs, ns);
+}
+
+uint64_t aesd_metrics_lock(pthread_mutex_t *m, aesd_lock_id_t lock) {
+    metrics_block_t *block = block_get();
+    uint64_t start = aesd_metrics_now();
+
+    pthread_mutex_lock(m);
+    uint64_t locked = aesd_metrics_now();
+    block_add(&block->lockWaitNs[lock], locked - start);
+    block_add(&block->lockAcquired[lock], 1);
+    return locked;
+}
+
+void aesd_metrics_unlock(pthread_mutex_t *m, aesd_lock_id_t lock, uint64_t locked) {
+    block_add(&block_get()->lockHoldNs[lock], aesd_metrics_now() - locked);
+    pthread_mutex_unlock(m);
+}
+
+int aesd_metrics_cond_wait(pthread_cond_t *cond, pthread_mutex_t *m, aesd_lock_id_t lock,
+                           uint64_t *locked, const struct timespec *deadline) {
+    metrics_block_t *block = block_get();
+
+    block_add(&block->lockHoldNs[lock], aesd_metrics_now() - *locked);
+    int ret = deadline != NULL ? pthread_cond_timedwait(cond, m, deadline) : pthread_cond_wait(cond, m);
+    *locked = aesd_metrics_now();
+    return ret;
+}
+
+static void render_slab(const aesd_slab_t *s, const aesd_slab_stats_t *stats, void *arg) {
+    FILE *out = (FILE *)arg;
+
+    fprintf(out, "aesd_slab_hits_total{slab=\"%s\"} %zu\n", s->name, stats->hits);
+    fprintf(out, "aesd_slab_misses_total{slab=\"%s\"} %zu\n", s->name, stats->misses);
+    fprintf(out, "aesd_slab_free_objects{slab=\"%s\"} %zu\n", s->name, stats->free);
+}
+
+char *aesd_metrics_render(size_t *len) {
+    metrics_block_t sum;
+    size_t *to = sum.counters;
+    size_t count = (sizeof(metrics_block_t) - offsetof(metrics_block_t, counters)) / sizeof(size_t);
+
+    pthread_mutex_lock(&blocksLock);
+    sum = retired;
+    for(metrics_block_t *block = blocks; block != NULL; block = block->next) {
+        size_t *from = block->counters;
+        for(size_t i = 0; i < count; i++) {
+            to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&blocksLock);
+
+    char *text = NULL;
+    FILE *out = open_memstream(&text, len);
+    if(out == NULL) {
+        return NULL;
+    }
+    size_t *c = sum.counters;
+    fprintf(out, "# TYPE aesd_connections_accepted_total counter\n");
+    fprintf(out, "aesd_connections_accepted_total %zu\n", c[AESD_METRIC_ACCEPTED]);
+    fprintf(out, "# TYPE aesd_connections_active gauge\n");
+    fprintf(out, "aesd_connections_active %zu\n", c[AESD_METRIC_ACCEPTED] - c[AESD_METRIC_CLOSED]);
+    fprintf(out, "# TYPE aesd_slow_readers_disconnected_total counter\n");
+    fprintf(out, "aesd_slow_readers_disconnected_total %zu\n", c[AESD_METRIC_SLOW_READERS]);
+    fprintf(out, "# TYPE aesd_received_bytes_total counter\n");
+    fprintf(out, "aesd_received_bytes_total %zu\n", c[AESD_METRIC_BYTES_IN]);
+    fprintf(out, "# TYPE aesd_sent_bytes_total counter\n");
+    fprintf(out, "aesd_sent_bytes_total %zu\n", c[AESD_METRIC_BYTES_OUT]);
+    fprintf(out, "# TYPE aesd_packets_committed_total counter\n");
+    fprintf(out, "aesd_packets_committed_total %zu\n", c[AESD_METRIC_PACKETS]);
+    fprintf(out, "# TYPE aesd_store_syncs_total counter\n");
+    fprintf(out, "aesd_store_syncs_total %zu\n", c[AESD_METRIC_SYNCS]);
+    fprintf(out, "# TYPE aesd_subscribers_active gauge\n");
+    fprintf(out, "aesd_subscribers_active %zu\n", c[AESD_METRIC_SUBSCRIBED] - c[AESD_METRIC_UNSUBSCRIBED]);
+    fprintf(out, "# TYPE aesd_subscriber_skipped_bytes_total counter\n");
+    fprintf(out, "aesd_subscriber_skipped_bytes_total %zu\n", c[AESD_METRIC_SKIPPED]);
+
+    fprintf(out, "# TYPE aesd_lock_wait_seconds_total counter\n");
+    for(int i = 0; i < AESD_LOCK_COUNT; i++) {
+        fprintf(out, "aesd_lock_wait_seconds_total{lock=\"%s\"} %.9f\n", lockNames[i], sum.lockWaitNs[i] / 1e9);
+    }
+    fprintf(out, "# TYPE aesd_lock_hold_seconds_total counter\n");
+    for(int i = 0; i < AESD_LOCK_COUNT; i++) {
+        fprintf(out, "aesd_lock_hold_seconds_total{lock=\"%s\"} %.9f\n", lockNames[i], sum.lockHoldNs[i] / 1e9);
+    }
+    fprintf(out, "# TYPE aesd_lock_acquisitions_total counter\n");
+    for(int i = 0; i < AESD_LOCK_COUNT; i++) {
+        fprintf(out, "aesd_lock_acquisitions_total{lock=\"%s\"} %zu\n", lockNames[i], sum.lockAcquired[i]);
+    }
+
+    size_t packets = 0;
+    fprintf(out, "# TYPE aesd_packet_latency_seconds histogram\n");
+    for(int i = 0; i < AESD_METRICS_LATENCY_BUCKETS; i++) {
+        packets += sum.latency[i];
+        if(i < AESD_METRICS_LATENCY_BUCKETS - 1) {
+            fprintf(out, "aesd_packet_latency_seconds_bucket{le=\"%g\"} %zu\n", (double)(1ULL << i) / 1e6, packets);
+        } else {
+            fprintf(out, "aesd_packet_latency_seconds_bucket{le=\"+Inf\"} %zu\n", packets);
+        }
+    }
+    fprintf(out, "aesd_packet_latency_seconds_sum %.9f\n", sum.latencySumNs / 1e9);
+    fprintf(out, "aesd_packet_latency_seconds_count %zu\n", packets);
+
+    fprintf(out, "# TYPE aesd_slab_hits_total counter\n");
+    fprintf(out, "# TYPE aesd_slab_misses_total counter\n");
+    fprintf(out, "# TYPE aesd_slab_free_objects gauge\n");
+    aesd_slab_foreach(render_slab, out);
+
+    if(fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static void metrics_write(int fd, const char *data, size_t len) {
+    while(len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void metrics_reply(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct timeval timeout = { .tv_sec = 1 };
+    char request[512];
+    ssize_t n = 0;
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if(poll(&pfd, 1, METRICS_REQUEST_WAIT_MS) > 0) {
+        n = recv(fd, request, sizeof(request), 0);
+    }
+
+    size_t len;
+    char *text = aesd_metrics_render(&len);
+    if(text == NULL) {
+        return;
+    }
+    if(n >= 4 && memcmp(request, "GET ", 4) == 0) {
+        char header[128];
+        int headerLen = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\n\r\n", len);
+        metrics_write(fd, header, headerLen);
+    }
+    metrics_write(fd, text, len);
+    free(text);
+}
+
+static void *metrics_run(void *ptr) {
+    aesd_metrics_server_t *server = (aesd_metrics_server_t *)ptr;
+    struct pollfd fds[3] = {
+        { .fd = server->stopFd, .events = POLLIN },
+        { .fd = server->tcpFd, .events = POLLIN },
+        { .fd = server->unixFd, .events = POLLIN },
+    };
+
+    while(1) {
+        if(poll(fds, 3, -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Metrics server poll failed");
+            break;
+        }
+        if(fds[0].revents) {
+            break;
+        }
+        for(int i = 1; i < 3; i++) {
+            if(fds[i].revents & POLLIN) {
+                int fd = accept4(fds[i].fd, NULL, NULL, SOCK_CLOEXEC);
+                if(fd >= 0) {
+                    metrics_reply(fd);
+                    close(fd);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static int metrics_listen_tcp(int port) {
+    struct sockaddr_in addr;
+    int opt = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+       bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int metrics_listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // a socket left behind by an earlier run would make bind() fail
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+aesd_metrics_server_t *aesd_metrics_start(int port, const char *unixPath) {
+    aesd_metrics_server_t *server = calloc(1, sizeof(aesd_metrics_server_t));
+    if(server == NULL) {
+        return NULL;
+    }
+    server->tcpFd = port > 0 ? metrics_listen_tcp(port) : -1;
+    server->unixFd = unixPath != NULL ? metrics_listen_unix(unixPath) : -1;
+    server->unixPath = unixPath != NULL ? strdup(unixPath) : NULL;
+    server->stopFd = eventfd(0, EFD_CLOEXEC);
+
+    if((port > 0 && server->tcpFd < 0) || (unixPath != NULL && (server->unixFd < 0 || server->unixPath == NULL)) ||
+       server->stopFd < 0 || pthread_create(&server->thread, NULL, metrics_run, server) != 0) {
+        syslog(LOG_ERR, "Unable to start metrics server: %s", strerror(errno));
+        if(server->tcpFd >= 0) {
+            close(server->tcpFd);
+        }
+        if(server->unixFd >= 0) {
+            close(server->unixFd);
+            unlink(unixPath);
+        }
+        if(server->stopFd >= 0) {
+            close(server->stopFd);
+        }
+        free(server->unixPath);
+        free(server);
+        return NULL;
+    }
+    return server;
+}
+
+void aesd_metrics_stop(aesd_metrics_server_t *server) {
+    uint64_t one = 1;
+
+    if(write(server->stopFd, &one, sizeof(one)) != sizeof(one)) {
+        syslog(LOG_ERR, "Unable to stop metrics server");
+        return;
+    }
+    pthread_join(server->thread, NULL);
+    if(server->tcpFd >= 0) {
+        close(server->tcpFd);
+    }
+    if(server->unixFd >= 0) {
+        close(server->unixFd);
+        unlink(server->unixPath);
+    }
+    close(server->stopFd);
+    free(server->unixPath);
+    free(server);
+}
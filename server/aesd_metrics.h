@@ -0,0 +1,96 @@
+#ifndef _AESD_METRICS_H_
+#define _AESD_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#define AESD_METRICS_LATENCY_BUCKETS 26     // powers of two from 1us to 2^24us, then +Inf
+
+typedef enum {
+    AESD_METRIC_ACCEPTED,       // connections registered
+    AESD_METRIC_CLOSED,         // connections unregistered
+    AESD_METRIC_BYTES_IN,
+    AESD_METRIC_BYTES_OUT,
+    AESD_METRIC_PACKETS,        // packets appended to the history
+    AESD_METRIC_SLOW_READERS,   // connections cut off for not reading their replies
+    AESD_METRIC_SYNCS,          // store syncs completed
+    AESD_METRIC_SUBSCRIBED,     // subscribers registered
+    AESD_METRIC_UNSUBSCRIBED,   // subscribers gone
+    AESD_METRIC_SKIPPED,        // history bytes lagging subscribers were skipped past
+    AESD_METRIC_COUNT
+} aesd_metric_t;
+
+typedef enum {
+    AESD_LOCK_COMMIT,           // history commitLock
+    AESD_LOCK_PUBLISH,          // history publishLock
+    AESD_LOCK_SYNC,             // history syncLock
+    AESD_LOCK_COUNT
+} aesd_lock_id_t;
+
+/**
+ * Server metrics. Every thread counts into a block of its own that only it writes,
+ * so counting is a plain add without a lock or a contended cache line; readers sum
+ * the blocks of the running threads and the totals of the threads that exited.
+ */
+
+uint64_t aesd_metrics_now(void);
+
+void aesd_metrics_add(aesd_metric_t metric, size_t n);
+
+/**
+ * Account a packet that took @param ns nanoseconds from its first received byte
+ * to the last byte of its reply.
+ */
+void aesd_metrics_latency(uint64_t ns);
+
+/**
+ * Lock @param m, accounting the time it took to @param lock.
+ * @return the time the lock was acquired, for aesd_metrics_unlock().
+ */
+uint64_t aesd_metrics_lock(pthread_mutex_t *m, aesd_lock_id_t lock);
+
+/**
+ * Unlock @param m, accounting the time since @param locked as held.
+ */
+void aesd_metrics_unlock(pthread_mutex_t *m, aesd_lock_id_t lock, uint64_t locked);
+
+/**
+ * pthread_cond_wait(), or pthread_cond_timedwait() with a non-NULL @param deadline,
+ * not accounting the time spent sleeping as held. @param locked is updated for the
+ * reacquired lock.
+ */
+int aesd_metrics_cond_wait(pthread_cond_t *cond, pthread_mutex_t *m, aesd_lock_id_t lock,
+                           uint64_t *locked, const struct timespec *deadline);
+
+/**
+ * Render every metric, the slab counters included, in the Prometheus text format.
+ * @return a malloc()ed string of @param len bytes, or NULL if memory ran out.
+ */
+char *aesd_metrics_render(size_t *len);
+
+/**
+ * Local endpoint serving aesd_metrics_render() to every client that connects, on
+ * a TCP port bound to 127.0.0.1 and/or a UNIX socket. A client that sends an HTTP
+ * GET within a short delay gets an HTTP response, so both a Prometheus scraper
+ * and a plain "nc localhost PORT" work.
+ */
+typedef struct aesd_metrics_server_s aesd_metrics_server_t;
+struct aesd_metrics_server_s {
+    pthread_t thread;
+    int tcpFd;
+    int unixFd;
+    char *unixPath;
+    int stopFd;             // eventfd signalled by aesd_metrics_stop()
+};
+
+/**
+ * Start serving metrics on @param port (0 for none) and at @param unixPath (NULL for none).
+ * @return the server, or NULL if it could not be started.
+ */
+aesd_metrics_server_t *aesd_metrics_start(int port, const char *unixPath);
+
+void aesd_metrics_stop(aesd_metrics_server_t *server);
+
+#endif
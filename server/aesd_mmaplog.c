@@ -0,0 +1,715 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aesd_store.h"
+#include "aesd_index.h"
+#include "aesd_checkpoint.h"
+
+#define MMAPLOG_MAGIC "AESDLOG1"
+#define MMAPLOG_HEADER_SIZE 4096            // the history starts on its own page
+#define MMAPLOG_EXTENT (4 * 1024 * 1024)    // file space allocated at a time
+#define MMAPLOG_RESERVE_MIN (64 * 1024 * 1024)
+// address space a single file is mapped with up front, so the mapping never moves
+#define MMAPLOG_RESERVE (sizeof(void *) == 8 ? (size_t)64 << 30 : (size_t)512 << 20)
+#define MMAPLOG_NO_RECORD UINT64_MAX
+
+/**
+ * First page of every file of an AESD_STORE_MMAP store, and of the segment files
+ * of an AESD_STORE_MMAPFILE store. The length is only advanced once the bytes it
+ * covers are in place, so a crash mid-append leaves the previous length.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t length;        // history bytes in the file
+    uint64_t firstRecord;   // where the first record starting in the file starts, MMAPLOG_NO_RECORD if none
+} mmaplog_header_t;
+
+/**
+ * One file of a mapped store. A single file store has one that holds everything;
+ * a segmented one names them "<path>.<index>" and holds segmentSize history bytes
+ * in each, starting at offset index * segmentSize, records running on from one
+ * segment into the next.
+ */
+struct aesd_segment_s {
+    aesd_segment_t *next;
+    size_t index;
+    size_t base;            // offset of the first history byte in the file
+    size_t cap;             // history bytes the file can hold
+    size_t len;             // history bytes in the file
+    size_t firstRecord;     // offset in the file of the first record starting in it, MMAPLOG_NO_RECORD if none
+    int fd;
+    char *map;              // read-write mapping while the segment is appended to, NULL once full
+    size_t mapLen;          // address space a mapping of the whole file takes
+    size_t allocated;       // file bytes allocated
+    bool dirty;             // unmapped with writes that were not synced yet
+    aesd_index_t records;   // sidecar index of the records starting in the file
+};
+
+static mmaplog_header_t *segment_header(aesd_segment_t *seg) {
+    return (mmaplog_header_t *)seg->map;
+}
+
+static void segment_path(const aesd_store_t *s, size_t index, char *path, size_t len) {
+    if(s->segmentSize == 0) {
+        snprintf(path, len, "%s", s->path);
+    } else {
+        snprintf(path, len, "%s.%010zu", s->path, index);
+    }
+}
+
+/**
+ * Allocate file space for at least @param need bytes of @param seg, in whole extents.
+ * The pages are mapped already; they only become accessible once the file covers them.
+ * A file of nothing but history keeps its size, so it never shows the extent past its
+ * end as zeros: it is grown to each new end by segment_resize() instead.
+ */
+static int segment_extend(aesd_store_t *s, aesd_segment_t *seg, size_t need) {
+    size_t len = (need + MMAPLOG_EXTENT - 1) / MMAPLOG_EXTENT * MMAPLOG_EXTENT;
+    if(len > s->dataOffset + seg->cap) {
+        len = s->dataOffset + seg->cap;
+    }
+    int mode = s->dataOffset == 0 ? FALLOC_FL_KEEP_SIZE : 0;
+    int ret = fallocate(seg->fd, mode, seg->allocated, len - seg->allocated);
+    if(ret < 0 && errno == EOPNOTSUPP) {
+        // without preallocation the file is only ever as large as it has to be
+        ret = mode != 0 ? 0 : ftruncate(seg->fd, len);
+    }
+    if(ret < 0) {
+        syslog(LOG_ERR, "Unable to allocate %zu bytes for %s: %s", len, s->path, strerror(errno));
+        return -1;
+    }
+    seg->allocated = len;
+    return 0;
+}
+
+/**
+ * Set the size of a file of nothing but history to @param len, which it must reach
+ * before its pages are written.
+ */
+static int segment_resize(aesd_store_t *s, aesd_segment_t *seg, size_t len) {
+    if(ftruncate(seg->fd, len) < 0) {
+        syslog(LOG_ERR, "Unable to resize %s to %zu bytes: %s", s->path, len, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Map @param seg read-write, with as much room to grow as can be reserved for a
+ * single file, or exactly a segment.
+ */
+static int segment_map(aesd_store_t *s, aesd_segment_t *seg) {
+    size_t len = s->segmentSize != 0 ? s->dataOffset + s->segmentSize : MMAPLOG_RESERVE;
+    size_t min = s->segmentSize != 0 ? len : MMAPLOG_RESERVE_MIN;
+
+    for(; len >= min && len >= seg->allocated; len /= 2) {
+        void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+        if(map != MAP_FAILED) {
+            seg->map = map;
+            seg->mapLen = len;
+            seg->cap = len - s->dataOffset;
+            return 0;
+        }
+        if(errno != ENOMEM) {
+            break;
+        }
+    }
+    syslog(LOG_ERR, "Unable to map %s: %s", s->path, strerror(errno));
+    return -1;
+}
+
+static void segment_free(aesd_segment_t *seg) {
+    if(seg->map != NULL) {
+        munmap(seg->map, seg->mapLen);
+    }
+    if(seg->fd >= 0) {
+        close(seg->fd);
+    }
+    aesd_index_close(&seg->records);
+    free(seg);
+}
+
+/**
+ * Open the file of segment @param index, with @param flags added to O_RDWR, and map it.
+ * @return the segment, or NULL with errno set.
+ */
+static aesd_segment_t *segment_open(aesd_store_t *s, size_t index, int flags) {
+    char path[PATH_MAX];
+    struct stat st;
+    aesd_segment_t *seg = calloc(1, sizeof(*seg));
+
+    if(seg == NULL) {
+        return NULL;
+    }
+    segment_path(s, index, path, sizeof(path));
+    seg->records.fd = -1;
+    seg->index = index;
+    seg->base = index * s->segmentSize;
+    seg->fd = open(path, O_RDWR | O_CLOEXEC | flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(seg->fd < 0 || fstat(seg->fd, &st) < 0) {
+        goto fail;
+    }
+    seg->allocated = st.st_size;
+    if(segment_map(s, seg) < 0) {
+        goto fail;
+    }
+
+    if(s->dataOffset == 0) {
+        // nothing but history: past its end is either nothing or, after a crash,
+        // preallocated space that reads as zeros, and records end with a newline
+        size_t len = seg->allocated;
+        while(len > 0 && seg->map[len - 1] == '\0') {
+            len--;
+        }
+        seg->len = len;
+        seg->firstRecord = 0;
+        return seg;
+    }
+    if(seg->allocated == 0) {
+        if(segment_extend(s, seg, MMAPLOG_HEADER_SIZE) < 0) {
+            goto fail;
+        }
+        memcpy(segment_header(seg)->magic, MMAPLOG_MAGIC, sizeof(segment_header(seg)->magic));
+        segment_header(seg)->firstRecord = s->segmentSize != 0 ? MMAPLOG_NO_RECORD : 0;
+    }
+    mmaplog_header_t *header = segment_header(seg);
+    if(seg->allocated < MMAPLOG_HEADER_SIZE || memcmp(header->magic, MMAPLOG_MAGIC, sizeof(header->magic)) != 0 ||
+       header->length > seg->allocated - MMAPLOG_HEADER_SIZE || header->length > seg->cap) {
+        syslog(LOG_ERR, "%s is not an mmap log", path);
+        errno = EINVAL;
+        goto fail;
+    }
+    seg->len = header->length;
+    seg->firstRecord = header->firstRecord;
+    return seg;
+
+fail:
+    if(errno != EINVAL) {
+        syslog(LOG_ERR, "Unable to open %s: %s", path, strerror(errno));
+    }
+    int err = errno;
+    segment_free(seg);
+    errno = err;
+    return NULL;
+}
+
+/**
+ * Open the record index of @param seg, which is still mapped, numbering its records
+ * from @param firstSeq if the index is created, and afresh if @param fresh. The first
+ * @param trusted entries, ending with @param trustedLast, were vouched for by a checkpoint. A store whose index can't
+ * be opened still works; the history scans it on the next start.
+ */
+static void segment_index(aesd_store_t *s, aesd_segment_t *seg, size_t firstSeq, size_t trusted, size_t trustedLast,
+                          bool fresh) {
+    char file[PATH_MAX];
+    char path[PATH_MAX + sizeof(AESD_INDEX_SUFFIX)];
+    size_t first = seg->firstRecord == MMAPLOG_NO_RECORD ? seg->len : seg->firstRecord;
+
+    segment_path(s, seg->index, file, sizeof(file));
+    snprintf(path, sizeof(path), "%s%s", file, AESD_INDEX_SUFFIX);
+    if(fresh) {
+        unlink(path);
+    }
+    aesd_index_open(&seg->records, path, seg->map + s->dataOffset, seg->base, seg->len, first, firstSeq, trusted, trustedLast);
+}
+
+/**
+ * Stop appending to @param seg: drop its read-write mapping, leaving the writes
+ * to the next sync or to writeback.
+ */
+static void segment_seal(aesd_segment_t *seg) {
+    munmap(seg->map, seg->mapLen);
+    seg->map = NULL;
+    seg->dirty = true;
+}
+
+static void segment_remove(aesd_store_t *s, aesd_segment_t *seg) {
+    char path[PATH_MAX];
+
+    segment_path(s, seg->index, path, sizeof(path));
+    if(unlink(path) < 0) {
+        syslog(LOG_WARNING, "Unable to remove %s: %s", path, strerror(errno));
+    }
+    aesd_index_remove(&seg->records);
+    segment_free(seg);
+}
+
+static void mmaplog_close(aesd_store_t *s) {
+    while(s->head != NULL) {
+        aesd_segment_t *seg = s->head;
+        s->head = seg->next;
+        // give back the space preallocated past the end of the file appended to
+        if(seg->map != NULL && ftruncate(seg->fd, s->dataOffset + seg->len) < 0) {
+            syslog(LOG_WARNING, "Unable to trim %s: %s", s->path, strerror(errno));
+        }
+        segment_free(seg);
+    }
+    s->tail = NULL;
+}
+
+static bool segment_exists(const aesd_store_t *s, size_t index) {
+    char path[PATH_MAX];
+    segment_path(s, index, path, sizeof(path));
+    return access(path, F_OK) == 0;
+}
+
+/**
+ * Find the newest segment file of the store in @param last and the oldest one in
+ * @param first, stopping at the first gap going back from the newest.
+ * @return 1 if there is any, 0 if there is none, -1 if the directory can't be read.
+ */
+static int mmaplog_scan(aesd_store_t *s, size_t *first, size_t *last) {
+    char dir[PATH_MAX];
+    const char *name = strrchr(s->path, '/');
+    size_t nameLen;
+    struct dirent *entry;
+    int found = 0;
+
+    if(name == NULL) {
+        snprintf(dir, sizeof(dir), ".");
+        name = s->path;
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", name == s->path ? 1 : (int)(name - s->path), s->path);
+        name++;
+    }
+    nameLen = strlen(name);
+
+    DIR *d = opendir(dir);
+    if(d == NULL) {
+        syslog(LOG_ERR, "Unable to list %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    while((entry = readdir(d)) != NULL) {
+        const char *suffix = entry->d_name + nameLen;
+        char *end;
+        if(strncmp(entry->d_name, name, nameLen) != 0 || suffix[0] != '.' || !isdigit((unsigned char)suffix[1])) {
+            continue;
+        }
+        size_t index = strtoull(suffix + 1, &end, 10);
+        if(*end == '\0' && (!found || index > *last)) {
+            *last = index;
+            found = 1;
+        }
+    }
+    closedir(d);
+
+    *first = *last;
+    while(found && *first > 0 && segment_exists(s, *first - 1)) {
+        (*first)--;
+    }
+    return found;
+}
+
+static void mmaplog_checkpoint_path(const aesd_store_t *s, char *path, size_t len) {
+    snprintf(path, len, "%s%s", s->path, AESD_CHECKPOINT_SUFFIX);
+}
+
+/**
+ * Read the checkpoint of the store into @param ckpt, if it has one for this layout.
+ */
+static bool mmaplog_checkpoint_read(const aesd_store_t *s, aesd_checkpoint_t *ckpt) {
+    char path[PATH_MAX];
+
+    mmaplog_checkpoint_path(s, path, sizeof(path));
+    if(aesd_checkpoint_read(path, ckpt) < 0) {
+        return false;
+    }
+    if(ckpt->dataOffset != (size_t)s->dataOffset || ckpt->segmentSize != s->segmentSize || ckpt->numSegments == 0) {
+        aesd_checkpoint_free(ckpt);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @return the entry of @param ckpt for @param seg, if what it says of the segment
+ *   still holds, NULL otherwise.
+ */
+static const aesd_checkpoint_segment_t *mmaplog_checkpointed(const aesd_checkpoint_t *ckpt, const aesd_segment_t *seg) {
+    size_t first = ckpt->segments[0].index;
+
+    if(seg->index < first || seg->index - first >= ckpt->numSegments) {
+        return NULL;
+    }
+    const aesd_checkpoint_segment_t *entry = &ckpt->segments[seg->index - first];
+    if(entry->index != seg->index || entry->firstRecord != seg->firstRecord || entry->len > seg->len) {
+        return NULL;
+    }
+    return entry;
+}
+
+/**
+ * Open the files of the store, dropping leading segments that hold no record start
+ * (the rest of a record whose beginning was removed). With a checkpoint, the segments
+ * are taken from its table rather than listed, and their indexes are only checked
+ * past what it covers.
+ */
+static int mmaplog_open_files(aesd_store_t *s) {
+    aesd_checkpoint_t ckpt;
+    bool checkpointed = mmaplog_checkpoint_read(s, &ckpt);
+    size_t first = 0;
+    size_t last = 0;
+    size_t trusted = 0;
+
+    if(s->segmentSize != 0 && checkpointed) {
+        // segments are only ever added after the newest and removed from the oldest
+        first = ckpt.segments[0].index;
+        last = ckpt.segments[ckpt.numSegments - 1].index;
+        while(segment_exists(s, last + 1)) {
+            last++;
+        }
+        while(first < last && !segment_exists(s, first)) {
+            first++;
+        }
+    } else if(s->segmentSize != 0 && mmaplog_scan(s, &first, &last) < 0) {
+        return -1;
+    }
+    for(size_t i = first; i <= last; i++) {
+        aesd_segment_t *seg = segment_open(s, i, i == last ? O_CREAT : 0);
+        if(seg == NULL) {
+            if(checkpointed) {
+                aesd_checkpoint_free(&ckpt);
+            }
+            mmaplog_close(s);
+            return -1;
+        }
+        // records are numbered on from the previous segment
+        size_t firstSeq = s->tail != NULL ? s->tail->records.firstSeq + s->tail->records.count : 0;
+        const aesd_checkpoint_segment_t *entry = checkpointed ? mmaplog_checkpointed(&ckpt, seg) : NULL;
+        if(entry != NULL) {
+            firstSeq = entry->firstSeq;
+            trusted += entry->records;
+        }
+        segment_index(s, seg, firstSeq, entry != NULL ? entry->records : 0, entry != NULL ? entry->lastRecord : 0, false);
+        if(s->tail != NULL) {
+            s->tail->next = seg;
+        } else {
+            s->head = seg;
+        }
+        s->tail = seg;
+        if(i != last) {
+            if(seg->len != seg->cap) {
+                syslog(LOG_ERR, "Segment %zu of %s is incomplete", i, s->path);
+                mmaplog_close(s);
+                errno = EINVAL;
+                return -1;
+            }
+            segment_seal(seg);
+            seg->dirty = false;
+        }
+    }
+    while(s->head != s->tail && s->head->firstRecord == MMAPLOG_NO_RECORD) {
+        aesd_segment_t *seg = s->head;
+        s->head = seg->next;
+        segment_remove(s, seg);
+    }
+    if(checkpointed) {
+        syslog(LOG_INFO, "Checkpoint of %s vouched for %zu of its record(s)", s->path, trusted);
+        aesd_checkpoint_free(&ckpt);
+    }
+
+    aesd_segment_t *head = s->head;
+    s->start = head->base + (head->firstRecord == MMAPLOG_NO_RECORD ? head->len : head->firstRecord);
+    s->size = s->tail->base + s->tail->len;
+    s->fd = -1;
+    return 0;
+}
+
+static int mmapfile_open(aesd_store_t *s) {
+    // segment files need a header to tell where their first record starts
+    s->dataOffset = s->segmentSize != 0 ? MMAPLOG_HEADER_SIZE : 0;
+    return mmaplog_open_files(s);
+}
+
+static int mmaplog_open(aesd_store_t *s) {
+    s->dataOffset = MMAPLOG_HEADER_SIZE;
+    return mmaplog_open_files(s);
+}
+
+/**
+ * Start the next segment once the tail is full.
+ */
+static int mmaplog_rotate(aesd_store_t *s) {
+    if(s->segmentSize == 0) {
+        syslog(LOG_ERR, "%s would outgrow its %zu byte mapping", s->path, s->tail->mapLen);
+        errno = EFBIG;
+        return -1;
+    }
+    aesd_segment_t *seg = segment_open(s, s->tail->index + 1, O_CREAT | O_TRUNC);
+    if(seg == NULL) {
+        return -1;
+    }
+    segment_index(s, seg, s->tail->records.firstSeq + s->tail->records.count, 0, 0, true);
+    pthread_mutex_lock(&s->lock);
+    segment_seal(s->tail);
+    s->tail->next = seg;
+    s->tail = seg;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+static void segment_set_len(aesd_store_t *s, aesd_segment_t *seg, size_t len) {
+    seg->len = len;
+    if(s->dataOffset != 0) {
+        __atomic_store_n(&segment_header(seg)->length, len, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Undo a failed append back to @param tail holding @param len bytes and @param records
+ * records.
+ */
+static void mmaplog_rollback(aesd_store_t *s, aesd_segment_t *tail, size_t len, size_t records) {
+    pthread_mutex_lock(&s->lock);
+    aesd_segment_t *added = tail->next;
+    tail->next = NULL;
+    s->tail = tail;
+    pthread_mutex_unlock(&s->lock);
+    while(added != NULL) {
+        aesd_segment_t *next = added->next;
+        segment_remove(s, added);
+        added = next;
+    }
+    aesd_index_truncate(&tail->records, records);
+    // a full tail was sealed, it gets its mapping back to be appended to again
+    if(tail->map == NULL && segment_map(s, tail) < 0) {
+        return;
+    }
+    if(tail->firstRecord >= len && tail->firstRecord != MMAPLOG_NO_RECORD) {
+        tail->firstRecord = MMAPLOG_NO_RECORD;
+        if(s->dataOffset != 0) {
+            segment_header(tail)->firstRecord = MMAPLOG_NO_RECORD;
+        }
+    }
+    segment_set_len(s, tail, len);
+    if(s->dataOffset == 0) {
+        segment_resize(s, tail, len);
+    }
+}
+
+static int mmaplog_append(aesd_store_t *s, const struct iovec *iov, int iovcnt, size_t len) {
+    aesd_segment_t *tail = s->tail;
+    size_t tailLen = tail->len;
+    size_t tailRecords = tail->records.count;
+    size_t starts[iovcnt];      // records starting in s->tail not indexed yet
+    size_t numStarts = 0;
+
+    // the single file holding nothing but history is exactly as long as its records
+    if(s->dataOffset == 0 && tail->len + len <= tail->cap &&
+       segment_resize(s, tail, tail->len + len) < 0) {
+        return -1;
+    }
+    for(int i = 0; i < iovcnt; i++) {
+        const char *src = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        bool recordStart = true;
+
+        while(left > 0) {
+            if(s->tail->len == s->tail->cap) {
+                // the next segment numbers its records on from those of the full one
+                aesd_index_append(&s->tail->records, starts, numStarts);
+                numStarts = 0;
+                if(mmaplog_rotate(s) < 0) {
+                    mmaplog_rollback(s, tail, tailLen, tailRecords);
+                    return -1;
+                }
+            }
+            aesd_segment_t *seg = s->tail;
+            size_t n = left < seg->cap - seg->len ? left : seg->cap - seg->len;
+            size_t need = s->dataOffset + seg->len + n;
+            if(need > seg->allocated && segment_extend(s, seg, need) < 0) {
+                mmaplog_rollback(s, tail, tailLen, tailRecords);
+                return -1;
+            }
+            if(recordStart) {
+                starts[numStarts++] = seg->base + seg->len;
+            }
+            // only segment files start without a record, and they have a header
+            if(recordStart && seg->firstRecord == MMAPLOG_NO_RECORD) {
+                seg->firstRecord = seg->len;
+                segment_header(seg)->firstRecord = seg->len;
+            }
+            memcpy(seg->map + s->dataOffset + seg->len, src, n);
+            segment_set_len(s, seg, seg->len + n);
+            src += n;
+            left -= n;
+            recordStart = false;
+        }
+    }
+    // written after the records, so an index never points past the history
+    aesd_index_append(&s->tail->records, starts, numStarts);
+    return 0;
+}
+
+static ssize_t mmaplog_read(aesd_store_t *s, size_t offset, void *buf, size_t len) {
+    for(aesd_segment_t *seg = s->head; seg != NULL; seg = seg->next) {
+        if(offset < seg->base) {
+            errno = EINVAL;
+            return -1;
+        }
+        if(offset >= seg->base + seg->len) {
+            continue;
+        }
+        size_t left = seg->base + seg->len - offset;
+        ssize_t n;
+        while((n = pread(seg->fd, buf, len < left ? len : left, s->dataOffset + (offset - seg->base))) < 0 &&
+              errno == EINTR) {
+        }
+        return n;
+    }
+    return 0;
+}
+
+static int mmaplog_sync(aesd_store_t *s) {
+    int ret = 0;
+
+    pthread_mutex_lock(&s->lock);
+    for(aesd_segment_t *seg = s->head; seg != NULL && ret == 0; seg = seg->next) {
+        if(seg->map != NULL) {
+            ret = msync(seg->map, s->dataOffset + seg->len, MS_SYNC);
+        } else if(seg->dirty) {
+            ret = fdatasync(seg->fd);
+            seg->dirty = ret < 0;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    if(ret < 0) {
+        syslog(LOG_ERR, "Unable to sync %s: %s", s->path, strerror(errno));
+    }
+    return ret;
+}
+
+static int mmaplog_map(aesd_store_t *s, size_t offset, aesd_store_view_t *view) {
+    aesd_segment_t *seg = s->head;
+    while(seg != NULL && offset >= seg->base + seg->cap) {
+        seg = seg->next;
+    }
+    if(seg == NULL || offset < seg->base) {
+        errno = EINVAL;
+        return -1;
+    }
+    void *map = mmap(NULL, seg->mapLen, PROT_READ, MAP_SHARED, seg->fd, 0);
+    if(map == MAP_FAILED) {
+        syslog(LOG_ERR, "Unable to map %s: %s", s->path, strerror(errno));
+        return -1;
+    }
+    view->data = (char *)map + s->dataOffset;
+    view->base = seg->base;
+    view->cap = seg->cap;
+    view->map = map;
+    view->mapLen = seg->mapLen;
+    return 0;
+}
+
+static int mmaplog_records(aesd_store_t *s, size_t *count, size_t *firstSeq) {
+    size_t total = 0;
+
+    for(aesd_segment_t *seg = s->head; seg != NULL; seg = seg->next) {
+        // every record has to be found, numbered on from the previous segment
+        if(seg->records.fd < 0 || seg->records.mapped != seg->records.count ||
+           seg->records.firstSeq != s->head->records.firstSeq + total) {
+            return -1;
+        }
+        total += seg->records.mapped;
+    }
+    *count = total;
+    *firstSeq = s->head->records.firstSeq;
+    return 0;
+}
+
+static size_t mmaplog_record(aesd_store_t *s, size_t seq) {
+    size_t offset = s->size;
+
+    pthread_mutex_lock(&s->lock);
+    for(aesd_segment_t *seg = s->head; seg != NULL; seg = seg->next) {
+        if(seq - seg->records.firstSeq < seg->records.mapped) {
+            offset = aesd_index_entry(&seg->records, seq - seg->records.firstSeq);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return offset;
+}
+
+static int mmaplog_checkpoint(aesd_store_t *s) {
+    char path[PATH_MAX];
+    aesd_checkpoint_t ckpt = { .dataOffset = s->dataOffset, .segmentSize = s->segmentSize, .end = s->size };
+    size_t count = 0;
+
+    for(aesd_segment_t *seg = s->head; seg != NULL; seg = seg->next) {
+        count++;
+    }
+    // the checkpoint must not vouch for records a crash could still take back
+    if(mmaplog_sync(s) < 0) {
+        return -1;
+    }
+    ckpt.segments = calloc(count, sizeof(aesd_checkpoint_segment_t));
+    if(ckpt.segments == NULL) {
+        return -1;
+    }
+    for(aesd_segment_t *seg = s->head; seg != NULL; seg = seg->next) {
+        aesd_checkpoint_segment_t *entry = &ckpt.segments[ckpt.numSegments++];
+        entry->index = seg->index;
+        entry->len = seg->len;
+        entry->firstRecord = seg->firstRecord;
+        entry->firstSeq = seg->records.firstSeq;
+        // an index that is gone is rebuilt on the next start
+        entry->records = aesd_index_sync(&seg->records) == 0 ? seg->records.count : 0;
+        entry->lastRecord = entry->records > 0 ? seg->records.last : 0;
+        ckpt.records += entry->records;
+    }
+    mmaplog_checkpoint_path(s, path, sizeof(path));
+    int ret = aesd_checkpoint_write(path, &ckpt);
+    aesd_checkpoint_free(&ckpt);
+    return ret;
+}
+
+static void mmaplog_trim(aesd_store_t *s, size_t start) {
+    while(s->head != s->tail && s->head->base + s->head->cap <= start) {
+        pthread_mutex_lock(&s->lock);
+        aesd_segment_t *seg = s->head;
+        s->head = seg->next;
+        pthread_mutex_unlock(&s->lock);
+        segment_remove(s, seg);
+    }
+}
+
+const aesd_store_ops_t aesd_mmaplog_ops = {
+    .name = "mmap",
+    .open = mmaplog_open,
+    .append = mmaplog_append,
+    .read = mmaplog_read,
+    .sync = mmaplog_sync,
+    .close = mmaplog_close,
+    .map = mmaplog_map,
+    .trim = mmaplog_trim,
+    .records = mmaplog_records,
+    .record = mmaplog_record,
+    .checkpoint = mmaplog_checkpoint,
+};
+
+const aesd_store_ops_t aesd_mmapfile_ops = {
+    .name = "mmapfile",
+    .open = mmapfile_open,
+    .append = mmaplog_append,
+    .read = mmaplog_read,
+    .sync = mmaplog_sync,
+    .close = mmaplog_close,
+    .map = mmaplog_map,
+    .trim = mmaplog_trim,
+    .records = mmaplog_records,
+    .record = mmaplog_record,
+    .checkpoint = mmaplog_checkpoint,
+};
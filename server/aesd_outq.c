@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "aesd_outq.h"
+#include "aesd_slab.h"
+#include "aesd_metrics.h"
+
+static aesd_slab_t itemSlab = AESD_SLAB_INITIALIZER("reply queue entries", sizeof(aesd_outq_item_t));
+
+void aesd_outq_init(aesd_outq_t *q) {
+    q->head = NULL;
+    q->tail = NULL;
+    q->bytes = 0;
+    q->progress = 0;
+}
+
+void aesd_outq_destroy(aesd_outq_t *q) {
+    while(q->head != NULL) {
+        aesd_outq_item_t *item = q->head;
+        q->head = item->next;
+        aesd_history_reply_release(&item->reply);
+        aesd_slab_free(&itemSlab, item);
+    }
+    q->tail = NULL;
+    q->bytes = 0;
+}
+
+int aesd_outq_push(aesd_outq_t *q, aesd_history_reply_t *reply, uint64_t packetSince, size_t maxBytes) {
+    size_t len = aesd_history_reply_pending(reply);
+    aesd_outq_item_t *item = NULL;
+
+    if(q->head != NULL && maxBytes != 0 && q->bytes + len > maxBytes) {
+        aesd_history_reply_release(reply);
+        errno = ENOBUFS;
+        return -1;
+    }
+    item = aesd_slab_alloc(&itemSlab);
+    if(item == NULL) {
+        aesd_history_reply_release(reply);
+        errno = ENOMEM;
+        return -1;
+    }
+    item->reply = *reply;
+    item->left = len;
+    item->next = NULL;
+    item->packetSince = packetSince;
+    if(q->head == NULL) {
+        q->head = item;
+        q->progress = aesd_metrics_now();
+    } else {
+        q->tail->next = item;
+    }
+    q->tail = item;
+    q->bytes += item->left;
+    return 0;
+}
+
+void aesd_outq_sent(aesd_outq_t *q, size_t sent) {
+    aesd_outq_item_t *item = q->head;
+    if(sent > item->left) {
+        sent = item->left;
+    }
+    item->left -= sent;
+    q->bytes -= sent;
+    if(sent > 0) {
+        q->progress = aesd_metrics_now();
+    }
+}
+
+void aesd_outq_pop(aesd_outq_t *q) {
+    aesd_outq_item_t *item = q->head;
+
+    aesd_metrics_latency(aesd_metrics_now() - item->packetSince);
+    q->bytes -= item->left;
+    q->head = item->next;
+    if(q->head == NULL) {
+        q->tail = NULL;
+    }
+    aesd_history_reply_release(&item->reply);
+    aesd_slab_free(&itemSlab, item);
+}
+
+int aesd_outq_send(aesd_outq_t *q, int sockfd) {
+    while(q->head != NULL) {
+        aesd_history_reply_t *reply = &q->head->reply;
+        size_t before = aesd_history_reply_pending(reply);
+        int ret = aesd_history_reply_send(reply, sockfd);
+
+        aesd_outq_sent(q, before - aesd_history_reply_pending(reply));
+        if(ret <= 0) {
+            return ret;
+        }
+        aesd_outq_pop(q);
+    }
+    return 1;
+}
+
+void aesd_outq_abort(int sockfd) {
+    struct linger reset = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    shutdown(sockfd, SHUT_RDWR);
+}
+
+bool aesd_outq_stalled(const aesd_outq_t *q, uint64_t now, unsigned timeoutMs) {
+    return q->head != NULL && timeoutMs > 0 && now - q->progress >= (uint64_t)timeoutMs * 1000000;
+}
+
+int aesd_outq_timeout_ms(const aesd_outq_t *q, uint64_t now, unsigned timeoutMs) {
+    if(q->head == NULL || timeoutMs == 0) {
+        return -1;
+    }
+    uint64_t deadline = q->progress + (uint64_t)timeoutMs * 1000000;
+    if(now >= deadline) {
+        return 1;
+    }
+    // round up so the wakeup does not come just before the deadline
+    return (int)((deadline - now + 999999) / 1000000);
+}
@@ -0,0 +1,101 @@
+#ifndef _AESD_OUTQ_H_
+#define _AESD_OUTQ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aesd_history.h"
+
+/**
+ * One reply waiting in a connection's output queue.
+ */
+typedef struct aesd_outq_item_s aesd_outq_item_t;
+struct aesd_outq_item_s {
+    aesd_outq_item_t *next;
+    aesd_history_reply_t reply;
+    size_t left;            // bytes of the reply not accounted as sent yet
+    uint64_t packetSince;   // first byte of the packet replied to arrived, for the latency metric
+};
+
+/**
+ * Replies of one connection not sent yet, oldest first. Replies reference the history
+ * without any lock, so packets keep being committed while a slow reader drains its
+ * queue, and the engines only ever send with nonblocking calls. A queue that makes no
+ * progress for the write timeout, or grows past the byte limit, marks a reader that
+ * is too slow or stuck; the engine disconnects it.
+ */
+typedef struct aesd_outq_s aesd_outq_t;
+struct aesd_outq_s {
+    aesd_outq_item_t *head;
+    aesd_outq_item_t *tail;
+    size_t bytes;           // bytes of the queued replies not sent yet
+    uint64_t progress;      // aesd_metrics_now() of the last bytes sent, or of the push into an empty queue
+};
+
+void aesd_outq_init(aesd_outq_t *q);
+
+/**
+ * Release every queued reply.
+ */
+void aesd_outq_destroy(aesd_outq_t *q);
+
+static inline bool aesd_outq_empty(const aesd_outq_t *q) {
+    return q->head == NULL;
+}
+
+/**
+ * Queue the prepared @param reply, which the queue takes over, for the packet whose
+ * first byte arrived at @param packetSince. An empty queue takes a reply of any size,
+ * a non-empty one only while it stays within @param maxBytes (0 for no limit).
+ * @return 0 on success, -1 with errno ENOBUFS if the limit was exceeded or ENOMEM
+ *   if memory ran out (the reply is released then).
+ */
+int aesd_outq_push(aesd_outq_t *q, aesd_history_reply_t *reply, uint64_t packetSince, size_t maxBytes);
+
+/**
+ * Send queued replies to the nonblocking socket @param sockfd until it would block.
+ * @return 1 once the queue is empty, 0 if the socket would block, -1 on error.
+ */
+int aesd_outq_send(aesd_outq_t *q, int sockfd);
+
+/**
+ * For engines sending the head reply themselves: account @param sent bytes of it as sent.
+ */
+void aesd_outq_sent(aesd_outq_t *q, size_t sent);
+
+/**
+ * For engines sending the head reply themselves: drop the head reply once it was sent
+ * completely, accounting the latency of its packet.
+ */
+void aesd_outq_pop(aesd_outq_t *q);
+
+/**
+ * @return true if replies are queued and none made progress for @param timeoutMs
+ *   milliseconds (0 for no timeout) up to @param now.
+ */
+bool aesd_outq_stalled(const aesd_outq_t *q, uint64_t now, unsigned timeoutMs);
+
+/**
+ * @return the milliseconds until the queue stalls, at least 1, or -1 if it cannot,
+ *   for use as a poll() timeout.
+ */
+int aesd_outq_timeout_ms(const aesd_outq_t *q, uint64_t now, unsigned timeoutMs);
+
+/**
+ * Make the next close() of @param sockfd reset the connection of a client cut off for
+ * being too slow, dropping the replies it did not read instead of leaving them to the
+ * kernel to deliver. Also wakes up sends still waiting on the socket.
+ */
+void aesd_outq_abort(int sockfd);
+
+/**
+ * @return how often an engine watching many queues should look for stalled ones so
+ *   none stays connected much longer than @param timeoutMs (not 0).
+ */
+static inline unsigned aesd_outq_sweep_ms(unsigned timeoutMs) {
+    unsigned ms = timeoutMs / 4;
+    return ms < 10 ? 10 : ms > 1000 ? 1000 : ms;
+}
+
+#endif
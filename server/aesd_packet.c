@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "aesdsocket.h"
+#include "aesd_packet.h"
+
+#define NOT_A_COMMAND 1     // returned by a command whose arguments do not parse
+
+/**
+ * Arguments of a command, parsed in place from the name up to the end of its line.
+ */
+typedef struct {
+    const char *pos;
+    const char *end;
+} packet_args_t;
+
+typedef int (*packet_command_fn)(packet_args_t *args, const char *ip, aesd_history_reply_t *reply);
+
+static bool args_take(packet_args_t *args, char c) {
+    if(args->pos < args->end && *args->pos == c) {
+        args->pos++;
+        return true;
+    }
+    return false;
+}
+
+static bool args_number(packet_args_t *args, size_t *value) {
+    const char *p = args->pos;
+    size_t v = 0;
+
+    while(p < args->end && *p >= '0' && *p <= '9') {
+        size_t digit = *p - '0';
+        if(v > (SIZE_MAX - digit) / 10) {
+            return false;
+        }
+        v = v * 10 + digit;
+        p++;
+    }
+    if(p == args->pos) {
+        return false;
+    }
+    args->pos = p;
+    *value = v;
+    return true;
+}
+
+static bool args_done(const packet_args_t *args) {
+    return args->pos == args->end;
+}
+
+static int command_seekto(packet_args_t *args, const char *ip, aesd_history_reply_t *reply) {
+    size_t record, offset;
+    size_t from = 0;
+
+    if(!args_take(args, ':') || !args_number(args, &record) || !args_take(args, ',') ||
+       !args_number(args, &offset) || !args_done(args)) {
+        return NOT_A_COMMAND;
+    }
+    if(record > UINT32_MAX || offset > UINT32_MAX ||
+       aesd_history_seekto(&history, record, offset, &from) < 0) {
+        syslog(LOG_ERR, "Invalid seek to %zu,%zu from %s", record, offset, ip);
+    }
+    aesd_history_reply_init(&history, reply, from);
+    return 0;
+}
+
+static int command_since(packet_args_t *args, const char *ip, aesd_history_reply_t *reply) {
+    bool bySequence;
+    size_t since;
+    size_t from;
+
+    (void)ip;
+    if(!args_take(args, ':')) {
+        return NOT_A_COMMAND;
+    }
+    bySequence = args_take(args, '#');
+    if(!args_number(args, &since) || !args_done(args)) {
+        return NOT_A_COMMAND;
+    }
+    from = since;
+    if(bySequence) {
+        aesd_history_record_offset(&history, since, &from);
+    }
+    aesd_history_reply_init(&history, reply, from);
+    return 0;
+}
+
+static int command_tail(packet_args_t *args, const char *ip, aesd_history_reply_t *reply) {
+    aesd_history_stats_t stats;
+    size_t count;
+
+    (void)ip;
+    if(!args_take(args, ':') || !args_number(args, &count) || !args_done(args)) {
+        return NOT_A_COMMAND;
+    }
+    aesd_history_stats(&history, &stats);
+    aesd_history_reply_range(&history, reply, stats.end > count ? stats.end - count : 0, stats.end);
+    return 0;
+}
+
+static int command_range(packet_args_t *args, const char *ip, aesd_history_reply_t *reply) {
+    size_t from, len;
+
+    (void)ip;
+    if(!args_take(args, ':') || !args_number(args, &from) || !args_take(args, ',') ||
+       !args_number(args, &len) || !args_done(args)) {
+        return NOT_A_COMMAND;
+    }
+    aesd_history_reply_range(&history, reply, from, len > SIZE_MAX - from ? SIZE_MAX : from + len);
+    return 0;
+}
+
+static int command_stats(packet_args_t *args, const char *ip, aesd_history_reply_t *reply) {
+    aesd_history_stats_t stats;
+    char text[256];
+
+    (void)ip;
+    if(!args_done(args)) {
+        return NOT_A_COMMAND;
+    }
+    aesd_history_stats(&history, &stats);
+    int len = snprintf(text, sizeof(text), "start %zu\nend %zu\ncached_from %zu\nfirst_record %zu\nrecords %zu\n"
+                       "sync %s\ndurable %zu\nsyncs %zu\n",
+                       stats.start, stats.end, stats.cachedFrom, stats.firstRecord, stats.records,
+                       stats.syncPolicy, stats.durable, stats.syncs);
+    return aesd_history_reply_text(reply, text, len);
+}
+
+static int command_sync(packet_args_t *args, const char *ip, aesd_history_reply_t *reply) {
+    char text[64];
+    size_t end;
+
+    if(!args_done(args)) {
+        return NOT_A_COMMAND;
+    }
+    if(aesd_history_sync(&history, &end) < 0) {
+        syslog(LOG_ERR, "Unable to sync the store for %s", ip);
+        return -1;
+    }
+    int len = snprintf(text, sizeof(text), "synced %zu\n", end);
+    return aesd_history_reply_text(reply, text, len);
+}
+
+static const struct {
+    const char *name;
+    packet_command_fn fn;
+} commands[] = {
+    { "IOCSEEKTO", command_seekto },
+    { "SINCE",     command_since },
+    { "TAIL",      command_tail },
+    { "RANGE",     command_range },
+    { "STATS",     command_stats },
+    { "SYNC",      command_sync },
+};
+
+/**
+ * Act on @param packet if it starts with a command that parses.
+ * @return what the command returned, or NOT_A_COMMAND if the packet is to be stored.
+ */
+static int packet_command(const char *packet, size_t len, const char *ip, aesd_history_reply_t *reply) {
+    size_t prefixLen = strlen(AESD_COMMAND_PREFIX);
+
+    if(len > prefixLen && memcmp(packet, AESD_COMMAND_PREFIX, prefixLen) == 0) {
+        // the packet ends with a newline, so its first line always ends
+        const char *name = packet + prefixLen;
+        const char *lineEnd = memchr(name, '\n', len - prefixLen);
+        if(lineEnd > name && lineEnd[-1] == '\r') {
+            lineEnd--;
+        }
+        for(size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+            size_t nameLen = strlen(commands[i].name);
+            if((size_t)(lineEnd - name) >= nameLen && memcmp(name, commands[i].name, nameLen) == 0) {
+                packet_args_t args = { .pos = name + nameLen, .end = lineEnd };
+                return commands[i].fn(&args, ip, reply);
+            }
+        }
+    }
+    return NOT_A_COMMAND;
+}
+
+int aesd_packet_commit(const char *packet, size_t len, const char *ip, aesd_history_reply_t *reply) {
+    int ret = packet_command(packet, len, ip, reply);
+    if(ret != NOT_A_COMMAND) {
+        return ret;
+    }
+    if(aesd_history_append(&history, packet, len) < 0) {
+        return -1;
+    }
+    aesd_history_reply_init(&history, reply, 0);
+    return 0;
+}
+
+int aesd_packet_submit(const char *packet, size_t len, const char *ip, aesd_history_reply_t *reply,
+                       aesd_commit_t *commit, aesd_completions_t *completions, void *owner) {
+    int ret = packet_command(packet, len, ip, reply);
+    if(ret != NOT_A_COMMAND) {
+        return ret;
+    }
+    aesd_history_submit(&history, commit, packet, len, completions, owner);
+    return AESD_PACKET_SUBMITTED;
+}
+
+int aesd_packet_committed(const aesd_commit_t *commit, aesd_history_reply_t *reply) {
+    if(commit->ret < 0) {
+        return -1;
+    }
+    aesd_history_reply_init(&history, reply, 0);
+    return 0;
+}
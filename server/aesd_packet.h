@@ -0,0 +1,50 @@
+#ifndef _AESD_PACKET_H_
+#define _AESD_PACKET_H_
+
+#include <stddef.h>
+
+#include "aesd_history.h"
+
+#define AESD_COMMAND_PREFIX "AESDCHAR_"
+#define AESD_PACKET_SUBMITTED 1     // returned by aesd_packet_submit() for a packet handed to the committer
+
+/**
+ * Act on one framed packet received from @param ip and prepare its @param reply.
+ * A packet whose first line is one of the commands below is not stored:
+ *   AESDCHAR_IOCSEEKTO:X,Y  history from byte Y of record X, counted from the oldest
+ *                           retained one (the whole history if out of range)
+ *   AESDCHAR_SINCE:N        history from offset N, e.g. the bytes received so far, so
+ *                           a tailing client only gets what was appended since
+ *   AESDCHAR_SINCE:#N       history from the record with sequence number N
+ *   AESDCHAR_TAIL:N         the last N bytes of the history
+ *   AESDCHAR_RANGE:N,L      L bytes of history from offset N
+ *   AESDCHAR_STATS          "name value" lines describing the history and how much
+ *                           of it is durable
+ *   AESDCHAR_SYNC           flush the store, then "synced N" with the durable end
+ * Commands are only recognised at the very start of a packet, and a packet whose
+ * command does not parse is stored like any other. Anything else is appended to the
+ * history as one record, and replied to with the whole history.
+ * @param packet the @param len bytes of the packet, ending with its newline.
+ * @return 0 on success, -1 if the packet could not be stored or the command failed
+ *   (@param reply is not prepared then).
+ */
+int aesd_packet_commit(const char *packet, size_t len, const char *ip, aesd_history_reply_t *reply);
+
+/**
+ * Like aesd_packet_commit() for an event loop, which must not wait for the group
+ * commit: a command is acted on at once, but a packet to store is submitted with
+ * aesd_history_submit() as @param commit, keeping @param owner, and comes back
+ * through @param completions. Its reply is prepared by aesd_packet_committed() then.
+ * @return 0 if @param reply is prepared, AESD_PACKET_SUBMITTED if the packet was
+ *   submitted, -1 if the command failed.
+ */
+int aesd_packet_submit(const char *packet, size_t len, const char *ip, aesd_history_reply_t *reply,
+                       aesd_commit_t *commit, aesd_completions_t *completions, void *owner);
+
+/**
+ * Prepare the @param reply to the packet of @param commit once it came back.
+ * @return 0 on success, -1 if the packet could not be stored.
+ */
+int aesd_packet_committed(const aesd_commit_t *commit, aesd_history_reply_t *reply);
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "aesd_pool.h"
+
+static void *pool_worker(void *ptr) {
+    aesd_pool_t *pool = (aesd_pool_t *)ptr;
+
+    while(1) {
+        pthread_mutex_lock(&pool->lock);
+        while(pool->count == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->notEmpty, &pool->lock);
+        }
+        if(pool->count == 0) {
+            // stopping and fully drained
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        void *job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->queueDepth;
+        pool->count--;
+        pthread_cond_signal(&pool->notFull);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->handler(job);
+    }
+    return NULL;
+}
+
+aesd_pool_t *aesd_pool_create(int numWorkers, int queueDepth, aesd_job_handler_t handler) {
+    aesd_pool_t *pool = calloc(1, sizeof(aesd_pool_t));
+    if(pool == NULL) {
+        return NULL;
+    }
+    pool->jobs = calloc(queueDepth, sizeof(void *));
+    pool->workers = calloc(numWorkers, sizeof(pthread_t));
+    if(pool->jobs == NULL || pool->workers == NULL) {
+        free(pool->jobs);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->notEmpty, NULL);
+    pthread_cond_init(&pool->notFull, NULL);
+    pool->queueDepth = queueDepth;
+    pool->handler = handler;
+
+    for(; pool->numWorkers < numWorkers; pool->numWorkers++) {
+        if(pthread_create(&pool->workers[pool->numWorkers], NULL, pool_worker, pool) != 0) {
+            syslog(LOG_ERR, "Unable to create pool worker %d", pool->numWorkers);
+            break;
+        }
+    }
+    if(pool->numWorkers == 0) {
+        aesd_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+bool aesd_pool_submit(aesd_pool_t *pool, void *job, bool wait) {
+    pthread_mutex_lock(&pool->lock);
+    while(wait && pool->count == pool->queueDepth && !pool->stopping) {
+        pthread_cond_wait(&pool->notFull, &pool->lock);
+    }
+    if(pool->count == pool->queueDepth || pool->stopping) {
+        pthread_mutex_unlock(&pool->lock);
+        return false;
+    }
+    pool->jobs[(pool->head + pool->count) % pool->queueDepth] = job;
+    pool->count++;
+    pthread_cond_signal(&pool->notEmpty);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+void aesd_pool_destroy(aesd_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->notEmpty);
+    pthread_cond_broadcast(&pool->notFull);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = 0; i < pool->numWorkers; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    pthread_cond_destroy(&pool->notFull);
+    pthread_cond_destroy(&pool->notEmpty);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool->jobs);
+    free(pool);
+}
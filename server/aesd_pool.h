@@ -0,0 +1,48 @@
+#ifndef _AESD_POOL_H_
+#define _AESD_POOL_H_
+
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef void *(*aesd_job_handler_t)(void *job);
+
+/**
+ * A fixed set of worker threads fed from a bounded multi-producer/multi-consumer
+ * ring of jobs. Producers either fail fast or block when the ring is full, so a
+ * connection burst can never create more threads than the pool was sized with.
+ */
+typedef struct aesd_pool_s aesd_pool_t;
+struct aesd_pool_s {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    void **jobs;            // ring of queueDepth pending jobs
+    int queueDepth;
+    int head;               // next job to hand to a worker
+    int count;              // number of queued jobs
+    bool stopping;
+    aesd_job_handler_t handler;
+    pthread_t *workers;
+    int numWorkers;
+};
+
+/**
+ * Start @param numWorkers threads running @param handler on jobs queued with
+ * aesd_pool_submit(), with room for @param queueDepth jobs waiting for a worker.
+ * @return the pool, or NULL if it could not be allocated or no worker could be started.
+ */
+aesd_pool_t *aesd_pool_create(int numWorkers, int queueDepth, aesd_job_handler_t handler);
+
+/**
+ * Queue @param job for the next idle worker.
+ * @param wait if true block while the queue is full, otherwise give up immediately.
+ * @return true if the job was queued, false if the queue was full (or the pool is stopping).
+ */
+bool aesd_pool_submit(aesd_pool_t *pool, void *job, bool wait);
+
+/**
+ * Let the workers drain the queued jobs, join them and free the pool.
+ */
+void aesd_pool_destroy(aesd_pool_t *pool);
+
+#endif
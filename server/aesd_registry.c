@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "aesd_registry.h"
+#include "aesd_slab.h"
+#include "aesd_metrics.h"
+
+typedef struct {
+    aesd_registry_t *reg;
+    void *(*fn)(void *);
+    void *arg;
+} registry_thread_t;
+
+static aesd_slab_t threadSlab = AESD_SLAB_INITIALIZER("thread arguments", sizeof(registry_thread_t));
+
+void aesd_registry_init(aesd_registry_t *reg) {
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&reg->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reg->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    reg->entries = NULL;
+    reg->live = 0;
+    reg->threads = 0;
+    reg->stopping = false;
+}
+
+void aesd_registry_destroy(aesd_registry_t *reg) {
+    pthread_cond_destroy(&reg->changed);
+    pthread_mutex_destroy(&reg->lock);
+}
+
+bool aesd_registry_add(aesd_registry_t *reg, aesd_registry_entry_t *entry, int fd) {
+    pthread_mutex_lock(&reg->lock);
+    if(reg->stopping) {
+        pthread_mutex_unlock(&reg->lock);
+        return false;
+    }
+    entry->fd = fd;
+    entry->prev = NULL;
+    entry->next = reg->entries;
+    if(reg->entries != NULL) {
+        reg->entries->prev = entry;
+    }
+    reg->entries = entry;
+    reg->live++;
+    pthread_mutex_unlock(&reg->lock);
+    aesd_metrics_add(AESD_METRIC_ACCEPTED, 1);
+    return true;
+}
+
+void aesd_registry_remove(aesd_registry_t *reg, aesd_registry_entry_t *entry) {
+    pthread_mutex_lock(&reg->lock);
+    if(entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        reg->entries = entry->next;
+    }
+    if(entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    }
+    reg->live--;
+    pthread_cond_broadcast(&reg->changed);
+    pthread_mutex_unlock(&reg->lock);
+    aesd_metrics_add(AESD_METRIC_CLOSED, 1);
+}
+
+static void *registry_thread(void *ptr) {
+    registry_thread_t thread = *(registry_thread_t *)ptr;
+    aesd_slab_free(&threadSlab, ptr);
+
+    thread.fn(thread.arg);
+
+    pthread_mutex_lock(&thread.reg->lock);
+    thread.reg->threads--;
+    pthread_cond_broadcast(&thread.reg->changed);
+    pthread_mutex_unlock(&thread.reg->lock);
+    return NULL;
+}
+
+int aesd_registry_spawn(aesd_registry_t *reg, void *(*fn)(void *), void *arg) {
+    registry_thread_t *thread = aesd_slab_alloc(&threadSlab);
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    if(thread == NULL) {
+        return -1;
+    }
+    thread->reg = reg;
+    thread->fn = fn;
+    thread->arg = arg;
+
+    pthread_mutex_lock(&reg->lock);
+    reg->threads++;
+    pthread_mutex_unlock(&reg->lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret = pthread_create(&tid, &attr, registry_thread, thread);
+    pthread_attr_destroy(&attr);
+    if(ret != 0) {
+        pthread_mutex_lock(&reg->lock);
+        reg->threads--;
+        pthread_mutex_unlock(&reg->lock);
+        aesd_slab_free(&threadSlab, thread);
+        return -1;
+    }
+    return 0;
+}
+
+size_t aesd_registry_live(aesd_registry_t *reg) {
+    pthread_mutex_lock(&reg->lock);
+    size_t live = reg->live;
+    pthread_mutex_unlock(&reg->lock);
+    return live;
+}
+
+/**
+ * Wait with the lock held until nothing is running or @param deadline passes.
+ */
+static bool registry_wait(aesd_registry_t *reg, const struct timespec *deadline) {
+    int ret = 0;
+    while((reg->live > 0 || reg->threads > 0) && ret != ETIMEDOUT) {
+        ret = pthread_cond_timedwait(&reg->changed, &reg->lock, deadline);
+    }
+    return reg->live == 0 && reg->threads == 0;
+}
+
+int aesd_registry_drain(aesd_registry_t *reg, unsigned timeoutSec) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&reg->lock);
+    reg->stopping = true;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutSec;
+    if(!registry_wait(reg, &deadline)) {
+        syslog(LOG_WARNING, "Closing %zu connection(s) still open after %u s", reg->live, timeoutSec);
+        for(aesd_registry_entry_t *entry = reg->entries; entry != NULL; entry = entry->next) {
+            shutdown(entry->fd, SHUT_RDWR);
+        }
+        deadline.tv_sec += 1;
+        registry_wait(reg, &deadline);
+    }
+    int ret = reg->live == 0 && reg->threads == 0 ? 0 : -1;
+    pthread_mutex_unlock(&reg->lock);
+    return ret;
+}
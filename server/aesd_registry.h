@@ -0,0 +1,66 @@
+#ifndef _AESD_REGISTRY_H_
+#define _AESD_REGISTRY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * Registration of one open client connection, embedded in whatever tracks the
+ * connection in its engine.
+ */
+typedef struct aesd_registry_entry_s aesd_registry_entry_t;
+struct aesd_registry_entry_s {
+    aesd_registry_entry_t *prev;
+    aesd_registry_entry_t *next;
+    int fd;
+};
+
+/**
+ * Every open client connection, whatever engine serves it, and the detached threads
+ * started for connections. Threads clean up after themselves when they finish, so
+ * nothing accumulates while the server runs, and shutdown can wait for the live
+ * connections to finish within a bound, cutting off the remaining ones.
+ */
+typedef struct aesd_registry_s aesd_registry_t;
+struct aesd_registry_s {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;         // a connection or thread went away
+    aesd_registry_entry_t *entries;
+    size_t live;                    // registered connections
+    size_t threads;                 // running threads started with aesd_registry_spawn()
+    bool stopping;                  // no new connections are registered
+};
+
+void aesd_registry_init(aesd_registry_t *reg);
+
+void aesd_registry_destroy(aesd_registry_t *reg);
+
+/**
+ * Register the connection on @param fd with @param entry, which stays owned by the caller.
+ * @return false if the server is shutting down and the connection should be closed.
+ */
+bool aesd_registry_add(aesd_registry_t *reg, aesd_registry_entry_t *entry, int fd);
+
+/**
+ * Unregister @param entry, before its descriptor is closed.
+ */
+void aesd_registry_remove(aesd_registry_t *reg, aesd_registry_entry_t *entry);
+
+/**
+ * Run @param fn with @param arg on a detached thread accounted for by @param reg.
+ * @return 0 on success, -1 if the thread could not be created.
+ */
+int aesd_registry_spawn(aesd_registry_t *reg, void *(*fn)(void *), void *arg);
+
+size_t aesd_registry_live(aesd_registry_t *reg);
+
+/**
+ * Stop registering connections and wait up to @param timeoutSec seconds for the live
+ * connections and their threads to finish. Connections still open then are shut
+ * down, which makes their engine close them, and waited for up to one more second.
+ * @return 0 once everything finished, -1 if something was still running.
+ */
+int aesd_registry_drain(aesd_registry_t *reg, unsigned timeoutSec);
+
+#endif
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "aesd_slab.h"
+
+#define SLAB_CACHE_BYTES (256 * 1024)       // rough bound of what one thread caches per slab
+#define SLAB_CACHE_MIN 4
+#define SLAB_CACHE_MAX 64
+#define SLAB_DEPOT_BYTES (8 * 1024 * 1024)  // rough bound of the depot of a slab
+#define SLAB_DEPOT_MAX 4096
+
+/* the counters are only written by the owning thread, and read by aesd_slab_stats() */
+typedef struct {
+    void *free;
+    size_t len;
+    size_t hits;
+    size_t misses;
+} slab_cache_t;
+
+typedef struct slab_thread_s slab_thread_t;
+struct slab_thread_s {
+    slab_thread_t *prev;
+    slab_thread_t *next;
+    slab_cache_t caches[AESD_SLAB_MAX];
+};
+
+static pthread_mutex_t slabsLock = PTHREAD_MUTEX_INITIALIZER;
+static aesd_slab_t *slabs[AESD_SLAB_MAX];
+static int numSlabs;
+static slab_thread_t *threads;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t threadKey;
+static __thread slab_thread_t *self;
+
+static size_t counter_get(const size_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void counter_set(size_t *counter, size_t value) {
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+static size_t clamp(size_t value, size_t min, size_t max) {
+    return value < min ? min : value > max ? max : value;
+}
+
+static size_t slab_depot_max(const aesd_slab_t *s) {
+    return clamp(SLAB_DEPOT_BYTES / s->objSize, s->cacheMax, SLAB_DEPOT_MAX);
+}
+
+/**
+ * Move up to @param count objects from the cache @param c to the depot of @param s,
+ * freeing those the depot has no room for.
+ */
+static void slab_spill(aesd_slab_t *s, slab_cache_t *c, size_t count) {
+    void *excess = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    size_t depotMax = slab_depot_max(s);
+    for(size_t i = 0; i < count && c->free != NULL; i++) {
+        void *obj = c->free;
+        c->free = *(void **)obj;
+        if(s->depotLen < depotMax) {
+            *(void **)obj = s->depot;
+            s->depot = obj;
+            s->depotLen++;
+        } else {
+            *(void **)obj = excess;
+            excess = obj;
+        }
+        counter_set(&c->len, c->len - 1);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    while(excess != NULL) {
+        void *next = *(void **)excess;
+        free(excess);
+        excess = next;
+    }
+}
+
+static void slab_refill(aesd_slab_t *s, slab_cache_t *c) {
+    pthread_mutex_lock(&s->lock);
+    for(size_t i = 0; i < s->cacheMax / 2 && s->depot != NULL; i++) {
+        void *obj = s->depot;
+        s->depot = *(void **)obj;
+        s->depotLen--;
+        *(void **)obj = c->free;
+        c->free = obj;
+        counter_set(&c->len, c->len + 1);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Hand the caches of an exiting thread back to their slabs.
+ */
+static void slab_thread_exit(void *ptr) {
+    slab_thread_t *th = (slab_thread_t *)ptr;
+
+    pthread_mutex_lock(&slabsLock);
+    for(int id = 0; id < numSlabs; id++) {
+        aesd_slab_t *s = slabs[id];
+        slab_cache_t *c = &th->caches[id];
+        slab_spill(s, c, c->len);
+        pthread_mutex_lock(&s->lock);
+        s->retiredHits += c->hits;
+        __atomic_fetch_add(&s->retiredMisses, c->misses, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&s->lock);
+    }
+    if(th->prev != NULL) {
+        th->prev->next = th->next;
+    } else {
+        threads = th->next;
+    }
+    if(th->next != NULL) {
+        th->next->prev = th->prev;
+    }
+    pthread_mutex_unlock(&slabsLock);
+    free(th);
+    self = NULL;
+}
+
+static void slab_make_key(void) {
+    pthread_key_create(&threadKey, slab_thread_exit);
+}
+
+/**
+ * @return the index of @param s, registering it on first use, or AESD_SLAB_MAX if
+ *   too many slabs exist and @param s has to fall back to malloc().
+ */
+static int slab_id(aesd_slab_t *s) {
+    int id = __atomic_load_n(&s->id, __ATOMIC_ACQUIRE);
+    if(id >= 0) {
+        return id;
+    }
+
+    pthread_once(&keyOnce, slab_make_key);
+    pthread_mutex_lock(&slabsLock);
+    id = s->id;
+    if(id < 0) {
+        if(s->objSize < sizeof(void *)) {
+            s->objSize = sizeof(void *);
+        }
+        s->cacheMax = clamp(SLAB_CACHE_BYTES / s->objSize, SLAB_CACHE_MIN, SLAB_CACHE_MAX);
+        id = numSlabs < AESD_SLAB_MAX ? numSlabs++ : AESD_SLAB_MAX;
+        if(id < AESD_SLAB_MAX) {
+            slabs[id] = s;
+        } else {
+            syslog(LOG_WARNING, "Too many slabs, %s falls back to malloc", s->name);
+        }
+        __atomic_store_n(&s->id, id, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&slabsLock);
+    return id;
+}
+
+static slab_thread_t *slab_thread(void) {
+    if(self != NULL) {
+        return self;
+    }
+    slab_thread_t *th = calloc(1, sizeof(slab_thread_t));
+    if(th == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&slabsLock);
+    th->next = threads;
+    if(threads != NULL) {
+        threads->prev = th;
+    }
+    threads = th;
+    pthread_mutex_unlock(&slabsLock);
+    pthread_setspecific(threadKey, th);
+    self = th;
+    return th;
+}
+
+void *aesd_slab_alloc(aesd_slab_t *s) {
+    int id = slab_id(s);
+    slab_thread_t *th = id < AESD_SLAB_MAX ? slab_thread() : NULL;
+    if(th == NULL) {
+        __atomic_fetch_add(&s->retiredMisses, 1, __ATOMIC_RELAXED);
+        return malloc(s->objSize);
+    }
+
+    slab_cache_t *c = &th->caches[id];
+    if(c->free == NULL) {
+        slab_refill(s, c);
+    }
+    if(c->free == NULL) {
+        counter_set(&c->misses, c->misses + 1);
+        return malloc(s->objSize);
+    }
+    void *obj = c->free;
+    c->free = *(void **)obj;
+    counter_set(&c->len, c->len - 1);
+    counter_set(&c->hits, c->hits + 1);
+    return obj;
+}
+
+void *aesd_slab_zalloc(aesd_slab_t *s) {
+    void *obj = aesd_slab_alloc(s);
+    if(obj != NULL) {
+        memset(obj, 0, s->objSize);
+    }
+    return obj;
+}
+
+void aesd_slab_free(aesd_slab_t *s, void *obj) {
+    if(obj == NULL) {
+        return;
+    }
+    int id = slab_id(s);
+    slab_thread_t *th = id < AESD_SLAB_MAX ? slab_thread() : NULL;
+    if(th == NULL) {
+        free(obj);
+        return;
+    }
+
+    slab_cache_t *c = &th->caches[id];
+    *(void **)obj = c->free;
+    c->free = obj;
+    counter_set(&c->len, c->len + 1);
+    if(c->len > s->cacheMax) {
+        slab_spill(s, c, s->cacheMax / 2);
+    }
+}
+
+void aesd_slab_stats(aesd_slab_t *s, aesd_slab_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    int id = __atomic_load_n(&s->id, __ATOMIC_ACQUIRE);
+    if(id < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&slabsLock);
+    pthread_mutex_lock(&s->lock);
+    stats->hits = s->retiredHits;
+    stats->misses = __atomic_load_n(&s->retiredMisses, __ATOMIC_RELAXED);
+    stats->free = s->depotLen;
+    pthread_mutex_unlock(&s->lock);
+    for(slab_thread_t *th = threads; th != NULL && id < AESD_SLAB_MAX; th = th->next) {
+        stats->hits += counter_get(&th->caches[id].hits);
+        stats->misses += counter_get(&th->caches[id].misses);
+        stats->free += counter_get(&th->caches[id].len);
+    }
+    pthread_mutex_unlock(&slabsLock);
+}
+
+void aesd_slab_foreach(void (*fn)(const aesd_slab_t *, const aesd_slab_stats_t *, void *), void *arg) {
+    pthread_mutex_lock(&slabsLock);
+    int count = numSlabs;
+    pthread_mutex_unlock(&slabsLock);
+
+    for(int id = 0; id < count; id++) {
+        aesd_slab_stats_t stats;
+        aesd_slab_stats(slabs[id], &stats);
+        fn(slabs[id], &stats, arg);
+    }
+}
+
+static void slab_log(const aesd_slab_t *s, const aesd_slab_stats_t *stats, void *arg) {
+    (void)arg;
+    syslog(LOG_INFO, "Slab %s (%zu byte objects): %zu hits, %zu misses, %zu free",
+           s->name, s->objSize, stats->hits, stats->misses, stats->free);
+}
+
+void aesd_slab_log_stats(void) {
+    aesd_slab_foreach(slab_log, NULL);
+}
@@ -0,0 +1,75 @@
+#ifndef _AESD_SLAB_H_
+#define _AESD_SLAB_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define AESD_SLAB_MAX 16            // slabs a process can have, further ones fall back to malloc
+
+/**
+ * Recycler of fixed-size objects such as connection contexts and I/O buffers.
+ * Every thread keeps a small cache of free objects per slab, so allocating and
+ * freeing on the hot path touches neither malloc nor any lock. A thread whose
+ * cache runs dry refills it in one go from the slab's shared depot, one whose
+ * cache overflows moves half of it there, and a thread that exits hands its whole
+ * cache back. Objects may be freed by another thread than the one that allocated
+ * them, they simply move to that thread's cache.
+ *
+ * Slabs are defined statically with AESD_SLAB_INITIALIZER and register themselves
+ * on first use.
+ */
+typedef struct aesd_slab_s aesd_slab_t;
+struct aesd_slab_s {
+    const char *name;
+    size_t objSize;
+    int id;                     // index of the slab in every thread's caches, -1 until used
+    size_t cacheMax;            // free objects a thread keeps before moving some to the depot
+    pthread_mutex_t lock;
+    void *depot;                // free objects shared by all threads, linked through their first word
+    size_t depotLen;
+    size_t retiredHits;         // counters of caches of threads that exited
+    size_t retiredMisses;
+};
+
+#define AESD_SLAB_INITIALIZER(slabName, size) \
+    { .name = (slabName), .objSize = (size), .id = -1, .lock = PTHREAD_MUTEX_INITIALIZER }
+
+/**
+ * Counters of a slab. A hit is an allocation served from a cache or the depot,
+ * a miss one that had to call malloc().
+ */
+typedef struct aesd_slab_stats_s aesd_slab_stats_t;
+struct aesd_slab_stats_s {
+    size_t hits;
+    size_t misses;
+    size_t free;                // objects waiting in the caches and the depot
+};
+
+/**
+ * @return an uninitialized object of the slab's size, or NULL if memory ran out.
+ */
+void *aesd_slab_alloc(aesd_slab_t *s);
+
+/**
+ * @return a zeroed object of the slab's size, or NULL if memory ran out.
+ */
+void *aesd_slab_zalloc(aesd_slab_t *s);
+
+/**
+ * Return @param obj, allocated from @param s, for reuse. NULL is ignored.
+ */
+void aesd_slab_free(aesd_slab_t *s, void *obj);
+
+void aesd_slab_stats(aesd_slab_t *s, aesd_slab_stats_t *stats);
+
+/**
+ * Call @param fn with the counters of every slab used so far, and @param arg.
+ */
+void aesd_slab_foreach(void (*fn)(const aesd_slab_t *, const aesd_slab_stats_t *, void *), void *arg);
+
+/**
+ * Log the counters of every slab used so far to syslog.
+ */
+void aesd_slab_log_stats(void);
+
+#endif
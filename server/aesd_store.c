@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "aesd_store.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * writev() all of @param iov to @param fd, resuming short writes.
+ */
+static int store_writev(int fd, const struct iovec *iov, int iovcnt) {
+    struct iovec pending[iovcnt];
+    struct iovec *next = pending;
+
+    memcpy(pending, iov, iovcnt * sizeof(struct iovec));
+    while(iovcnt > 0) {
+        ssize_t n = writev(fd, next, iovcnt);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Unable to write to the store: %s", strerror(errno));
+            return -1;
+        }
+        while(iovcnt > 0 && (size_t)n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            next->iov_base = (char *)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int fd_append(aesd_store_t *s, const struct iovec *iov, int iovcnt, size_t len) {
+    (void)len;
+    return store_writev(s->fd, iov, iovcnt);
+}
+
+static ssize_t fd_read(aesd_store_t *s, size_t offset, void *buf, size_t len) {
+    ssize_t n;
+    while((n = pread(s->fd, buf, len, offset)) < 0 && errno == EINTR) {
+    }
+    return n;
+}
+
+static int fd_sync(aesd_store_t *s) {
+    // the aesdchar driver keeps its records in memory, it has nothing to flush
+    if(fdatasync(s->fd) < 0 && errno != EINVAL && errno != EROFS) {
+        syslog(LOG_ERR, "Unable to sync the store: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void fd_close(aesd_store_t *s) {
+    close(s->fd);
+    s->fd = -1;
+}
+
+static int file_open(aesd_store_t *s) {
+    struct stat st;
+
+    s->fd = open(s->path, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(s->fd < 0) {
+        return -1;
+    }
+    if(fstat(s->fd, &st) == 0) {
+        s->size = st.st_size;
+    }
+    s->readBack = true;
+    return 0;
+}
+
+static int chardev_open(aesd_store_t *s) {
+    s->fd = open(s->path, O_RDWR | O_CLOEXEC);
+    if(s->fd < 0) {
+        return -1;
+    }
+    // the driver only keeps the latest writes, and each one has to be a packet
+    s->maxRecords = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    s->packetsOnly = true;
+    return 0;
+}
+
+static int memory_open(aesd_store_t *s) {
+    s->fd = -1;
+    return 0;
+}
+
+/* the history's own cache is the ring, there is nothing else to keep */
+static int memory_append(aesd_store_t *s, const struct iovec *iov, int iovcnt, size_t len) {
+    (void)s;
+    (void)iov;
+    (void)iovcnt;
+    (void)len;
+    return 0;
+}
+
+static ssize_t memory_read(aesd_store_t *s, size_t offset, void *buf, size_t len) {
+    (void)s;
+    (void)offset;
+    (void)buf;
+    (void)len;
+    return 0;
+}
+
+static int memory_sync(aesd_store_t *s) {
+    (void)s;
+    return 0;
+}
+
+static void memory_close(aesd_store_t *s) {
+    (void)s;
+}
+
+static const aesd_store_ops_t fileOps = {
+    .name = "file",
+    .open = file_open,
+    .append = fd_append,
+    .read = fd_read,
+    .sync = fd_sync,
+    .close = fd_close,
+};
+
+static const aesd_store_ops_t chardevOps = {
+    .name = "chardev",
+    .open = chardev_open,
+    .append = fd_append,
+    .read = fd_read,
+    .sync = fd_sync,
+    .close = fd_close,
+};
+
+static const aesd_store_ops_t memoryOps = {
+    .name = "memory",
+    .open = memory_open,
+    .append = memory_append,
+    .read = memory_read,
+    .sync = memory_sync,
+    .close = memory_close,
+};
+
+static const aesd_store_ops_t *storeOps[] = {
+    [AESD_STORE_FILE] = &fileOps,
+    [AESD_STORE_CHARDEV] = &chardevOps,
+    [AESD_STORE_MEMORY] = &memoryOps,
+    [AESD_STORE_MMAP] = &aesd_mmaplog_ops,
+    [AESD_STORE_MMAPFILE] = &aesd_mmapfile_ops,
+};
+
+int aesd_store_kind(const char *name) {
+    if(strcmp(name, "auto") == 0) {
+        return AESD_STORE_AUTO;
+    }
+    for(size_t i = 0; i < sizeof(storeOps) / sizeof(storeOps[0]); i++) {
+        if(storeOps[i] != NULL && strcmp(storeOps[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int aesd_store_open(aesd_store_t *s, const aesd_store_options_t *options) {
+    aesd_store_kind_t kind = options->kind;
+    const char *path = options->path;
+    struct stat st;
+
+    if(kind == AESD_STORE_AUTO) {
+        bool driver = stat(path != NULL ? path : AESD_STORE_CHARDEV_PATH, &st) == 0 && S_ISCHR(st.st_mode);
+        // the mapped file is the one with segments, a record index and checkpoints
+        kind = driver ? AESD_STORE_CHARDEV : AESD_STORE_MMAPFILE;
+    }
+    memset(s, 0, sizeof(*s));
+    s->kind = kind;
+    s->ops = storeOps[kind];
+    s->path = path;
+    if(s->path == NULL) {
+        s->path = kind == AESD_STORE_CHARDEV ? AESD_STORE_CHARDEV_PATH : AESD_STORE_FILE_PATH;
+    }
+    if(kind == AESD_STORE_MEMORY) {
+        s->maxBytes = options->memorySize > 0 ? options->memorySize : AESD_STORE_MEMORY_SIZE;
+    }
+    if(kind == AESD_STORE_FILE && options->segmentSize != 0) {
+        syslog(LOG_ERR, "The file store has no segments, use the mmapfile or mmap store");
+        errno = EINVAL;
+        return -1;
+    }
+    if(kind == AESD_STORE_MMAPFILE || kind == AESD_STORE_MMAP) {
+        // a single file could never shrink under a retention cap
+        s->segmentSize = options->segmentSize;
+        if(s->segmentSize == 0 && (options->retainBytes != 0 || options->retainRecords != 0)) {
+            s->segmentSize = AESD_STORE_SEGMENT_SIZE;
+        }
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    if(s->ops->open(s) < 0) {
+        int err = errno;
+        pthread_mutex_destroy(&s->lock);
+        errno = err;
+        return -1;
+    }
+    // the caps only ever tighten what the store keeps by itself
+    if(options->retainBytes != 0 && (s->maxBytes == 0 || options->retainBytes < s->maxBytes)) {
+        s->maxBytes = options->retainBytes;
+    }
+    if(options->retainRecords != 0 && (s->maxRecords == 0 || options->retainRecords < s->maxRecords)) {
+        s->maxRecords = options->retainRecords;
+    }
+    if(s->segmentSize != 0) {
+        syslog(LOG_INFO, "Storing history in the %s store %s.*, %zu byte segments", s->ops->name, s->path,
+               s->segmentSize);
+    } else {
+        syslog(LOG_INFO, "Storing history in the %s store %s", s->ops->name,
+               kind == AESD_STORE_MEMORY ? "(in memory)" : s->path);
+    }
+    return 0;
+}
+
+void aesd_store_close(aesd_store_t *s) {
+    aesd_store_checkpoint(s);
+    s->ops->close(s);
+    pthread_mutex_destroy(&s->lock);
+}
@@ -0,0 +1,200 @@
+#ifndef _AESD_STORE_H_
+#define _AESD_STORE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define AESD_STORE_FILE_PATH "/var/tmp/aesdsocketdata"
+#define AESD_STORE_CHARDEV_PATH "/dev/aesdchar"
+#define AESD_STORE_MEMORY_SIZE (64 * 1024 * 1024)
+#define AESD_STORE_SEGMENT_SIZE (16 * 1024 * 1024)  // segment files used when only a retention cap is set
+
+typedef enum {
+    AESD_STORE_AUTO,        // the aesdchar device if the driver is loaded, the mmapfile store otherwise
+    AESD_STORE_FILE,        // regular file appended with writev()
+    AESD_STORE_CHARDEV,     // aesdchar driver, keeps its latest AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED writes
+    AESD_STORE_MEMORY,      // bounded ring held by the history alone, lost on exit
+    AESD_STORE_MMAP,        // like AESD_STORE_MMAPFILE, with a header page holding the committed length
+    AESD_STORE_MMAPFILE,    // plain file, allocated in extents and appended through a mapping
+} aesd_store_kind_t;
+
+/**
+ * How to open a store. The retention caps apply on top of what the store itself
+ * keeps; mmapfile and mmap stores need segments to give disk space back, and switch
+ * to AESD_STORE_SEGMENT_SIZE segments when a cap is set without a segment size. The
+ * plain file store has no segments and keeps every byte it was sent.
+ */
+typedef struct aesd_store_options_s aesd_store_options_t;
+struct aesd_store_options_s {
+    aesd_store_kind_t kind;
+    const char *path;       // file or device of the store, NULL for the default of its kind
+    size_t memorySize;      // bytes kept by AESD_STORE_MEMORY, 0 for its default
+    size_t segmentSize;     // mapped file stores: history bytes per segment file, 0 for a single file
+    size_t retainBytes;     // history kept, whole records at a time, 0 for no limit
+    size_t retainRecords;   // records kept, 0 for no limit
+};
+
+typedef struct aesd_store_s aesd_store_t;
+typedef struct aesd_segment_s aesd_segment_t;
+
+/**
+ * Part of a mapped store, as returned by aesd_store_map().
+ */
+typedef struct aesd_store_view_s aesd_store_view_t;
+struct aesd_store_view_s {
+    char *data;             // the byte at offset base
+    size_t base;
+    size_t cap;             // bytes data can ever hold, only valid up to the stored end
+    void *map;              // mapping to munmap() once the view is no longer needed
+    size_t mapLen;
+};
+
+/**
+ * Operations of one kind of store. Offsets count history bytes from the creation
+ * of the store, so they carry on across restarts of a store that removes the files
+ * holding its oldest bytes.
+ */
+typedef struct aesd_store_ops_s aesd_store_ops_t;
+struct aesd_store_ops_s {
+    const char *name;
+    int (*open)(aesd_store_t *s);
+    /**
+     * Store the @param iovcnt records of @param iov, @param len bytes in total, after
+     * everything stored so far.
+     * @return 0 once all of it is stored, -1 on error.
+     */
+    int (*append)(aesd_store_t *s, const struct iovec *iov, int iovcnt, size_t len);
+    /**
+     * @return the number of bytes read at @param offset into @param buf, 0 past the
+     *   end, -1 on error.
+     */
+    ssize_t (*read)(aesd_store_t *s, size_t offset, void *buf, size_t len);
+    int (*sync)(aesd_store_t *s);
+    void (*close)(aesd_store_t *s);
+    /**
+     * Map the part of the store holding @param offset, which may also be the stored
+     * end. NULL for stores that cannot be mapped.
+     */
+    int (*map)(aesd_store_t *s, size_t offset, aesd_store_view_t *view);
+    /**
+     * Give back the space of whatever lies entirely before @param start, which no new
+     * reply reads. NULL for stores that keep everything or trim themselves.
+     */
+    void (*trim)(aesd_store_t *s, size_t start);
+    /**
+     * Report the records the index of the store held when it was opened, for the
+     * history to look them up with record() rather than scan for them; only called
+     * before anything is appended. NULL for stores that keep no index.
+     * @return 0 with their number in @param count and the sequence number of the
+     *   oldest in @param firstSeq, -1 if the index can't be used.
+     */
+    int (*records)(aesd_store_t *s, size_t *count, size_t *firstSeq);
+    /**
+     * @return the offset the record numbered @param seq starts at, for one of those
+     *   reported by records() that is still retained.
+     */
+    size_t (*record)(aesd_store_t *s, size_t seq);
+    /**
+     * Save what it takes to open the store again without checking all of it. NULL
+     * for stores with nothing to save.
+     * @return 0 on success, -1 on error, which only makes the next open slower.
+     */
+    int (*checkpoint)(aesd_store_t *s);
+};
+
+/**
+ * Where the history is persisted. The history keeps the records in memory and
+ * translates record numbers to offsets itself, so a store only deals in bytes;
+ * what differs between stores is how they append and what they retain.
+ */
+struct aesd_store_s {
+    aesd_store_kind_t kind;
+    const aesd_store_ops_t *ops;
+    const char *path;
+    int fd;                 // descriptor the history can be streamed back from, -1 if none
+    off_t dataOffset;       // file offset of the first history byte of each file
+    size_t start;           // offset of the oldest record the store holds
+    size_t size;            // offset one past the newest byte stored
+    size_t maxRecords;      // records the store retains, 0 for no limit
+    size_t maxBytes;        // bytes the store retains, whole records at a time, 0 for no limit
+    bool readBack;          // history evicted from memory can be streamed back from fd
+    bool packetsOnly;       // only client packets may be stored, no timestamp records
+    size_t segmentSize;     // mmapfile and mmap stores: history bytes per file, 0 for a single file
+    aesd_segment_t *head;   // mmapfile and mmap stores: oldest file
+    aesd_segment_t *tail;   // mmapfile and mmap stores: file appended to
+    pthread_mutex_t lock;   // segment list changes against sync
+};
+
+extern const aesd_store_ops_t aesd_mmapfile_ops;
+extern const aesd_store_ops_t aesd_mmaplog_ops;
+
+/**
+ * Open the store described by @param options, resolving AESD_STORE_AUTO.
+ * @return 0 on success, -1 with errno set if the store could not be opened.
+ */
+int aesd_store_open(aesd_store_t *s, const aesd_store_options_t *options);
+
+/**
+ * @return the kind named @param name, or -1 if there is none.
+ */
+int aesd_store_kind(const char *name);
+
+/**
+ * Checkpoint and close the store.
+ */
+void aesd_store_close(aesd_store_t *s);
+
+static inline int aesd_store_append(aesd_store_t *s, const struct iovec *iov, int iovcnt, size_t len) {
+    if(s->ops->append(s, iov, iovcnt, len) < 0) {
+        return -1;
+    }
+    s->size += len;
+    return 0;
+}
+
+static inline ssize_t aesd_store_read(aesd_store_t *s, size_t offset, void *buf, size_t len) {
+    return s->ops->read(s, offset, buf, len);
+}
+
+static inline size_t aesd_store_size(const aesd_store_t *s) {
+    return s->size;
+}
+
+static inline int aesd_store_sync(aesd_store_t *s) {
+    return s->ops->sync(s);
+}
+
+static inline bool aesd_store_mapped(const aesd_store_t *s) {
+    return s->ops->map != NULL;
+}
+
+static inline int aesd_store_map(aesd_store_t *s, size_t offset, aesd_store_view_t *view) {
+    return s->ops->map(s, offset, view);
+}
+
+static inline bool aesd_store_indexed(const aesd_store_t *s) {
+    return s->ops->records != NULL;
+}
+
+static inline int aesd_store_records(aesd_store_t *s, size_t *count, size_t *firstSeq) {
+    return s->ops->records(s, count, firstSeq);
+}
+
+static inline size_t aesd_store_record(aesd_store_t *s, size_t seq) {
+    return s->ops->record(s, seq);
+}
+
+static inline int aesd_store_checkpoint(aesd_store_t *s) {
+    return s->ops->checkpoint != NULL ? s->ops->checkpoint(s) : 0;
+}
+
+static inline void aesd_store_trim(aesd_store_t *s, size_t start) {
+    if(s->ops->trim != NULL) {
+        s->ops->trim(s, start);
+    }
+}
+
+#endif
@@ -0,0 +1,371 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "aesd_subscribe.h"
+#include "aesd_metrics.h"
+#include "aesd_outq.h"
+#include "aesd_slab.h"
+
+#define MAX_EVENTS 64
+
+static char listenMarker;   // epoll data of the listener, the publish eventfd and the stop eventfd
+static char publishMarker;
+static char stopMarker;
+static aesd_slab_t subscriberSlab = AESD_SLAB_INITIALIZER("subscribers", sizeof(aesd_subscriber_t));
+
+static const char *lagPolicyNames[] = { "skip", "drop" };
+
+int aesd_subscribe_lag_policy(const char *name) {
+    for(size_t i = 0; i < sizeof(lagPolicyNames) / sizeof(lagPolicyNames[0]); i++) {
+        if(strcmp(name, lagPolicyNames[i]) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static size_t subscribe_end(aesd_subscribe_server_t *server) {
+    aesd_history_stats_t stats;
+    aesd_history_stats(server->history, &stats);
+    return stats.end;
+}
+
+static void subscriber_close(aesd_subscribe_server_t *server, aesd_subscriber_t *sub) {
+    epoll_ctl(server->epollFd, EPOLL_CTL_DEL, sub->fd, NULL);
+    syslog(LOG_INFO, "Closed subscriber %s", sub->ip);
+    close(sub->fd);
+    if(sub->blocked) {
+        server->blocked--;
+    }
+    if(sub->prev != NULL) {
+        sub->prev->next = sub->next;
+    } else {
+        server->subscribers = sub->next;
+    }
+    if(sub->next != NULL) {
+        sub->next->prev = sub->prev;
+    }
+    if(sub->sending) {
+        aesd_history_reply_release(&sub->reply);
+    }
+    aesd_slab_free(&subscriberSlab, sub);
+    aesd_metrics_add(AESD_METRIC_UNSUBSCRIBED, 1);
+}
+
+static int subscriber_watch(aesd_subscribe_server_t *server, aesd_subscriber_t *sub, bool blocked) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | (blocked ? EPOLLOUT : 0), .data.ptr = sub };
+    if(blocked == sub->blocked) {
+        return 0;
+    }
+    if(epoll_ctl(server->epollFd, EPOLL_CTL_MOD, sub->fd, &ev) < 0) {
+        return -1;
+    }
+    server->blocked += blocked ? 1 : -1;
+    sub->blocked = blocked;
+    return 0;
+}
+
+/**
+ * @return where a subscriber that got everything before @param pos has to be moved
+ *   to so it is within maxLag of @param end, @param pos itself if it already is.
+ */
+static size_t subscribe_lag_target(aesd_subscribe_server_t *server, size_t pos, size_t end) {
+    size_t target = pos;
+
+    if(server->maxLag > 0 && end - pos > server->maxLag) {
+        aesd_history_record_after(server->history, end - server->maxLag, &target);
+    }
+    return target > pos ? target : pos;
+}
+
+static void subscriber_drop(aesd_subscriber_t *sub, size_t behind) {
+    syslog(LOG_WARNING, "Disconnecting subscriber %s, %zu bytes behind", sub->ip, behind);
+    aesd_metrics_add(AESD_METRIC_SLOW_READERS, 1);
+    aesd_outq_abort(sub->fd);
+}
+
+/**
+ * Send @param sub what was published up to @param end until its socket would block,
+ * applying the lag policy.
+ * @return 0 on success, -1 if the subscriber has to be disconnected.
+ */
+static int subscriber_feed(aesd_subscribe_server_t *server, aesd_subscriber_t *sub, size_t end) {
+    while(sub->sending || sub->pos < end) {
+        if(!sub->sending) {
+            size_t target = subscribe_lag_target(server, sub->pos, end);
+            if(target > sub->pos && server->lagPolicy == AESD_LAG_DROP) {
+                subscriber_drop(sub, end - sub->pos);
+                return -1;
+            }
+            aesd_history_reply_range(server->history, &sub->reply, target, end);
+            sub->sending = true;
+            sub->progress = aesd_metrics_now();
+            // retention may have removed more than the lag policy skips
+            size_t from = end - aesd_history_reply_pending(&sub->reply);
+            if(from > sub->pos && server->lagPolicy == AESD_LAG_DROP) {
+                subscriber_drop(sub, end - sub->pos);
+                return -1;
+            }
+            aesd_metrics_add(AESD_METRIC_SKIPPED, from - sub->pos);
+        } else if(server->lagPolicy == AESD_LAG_DROP) {
+            // a reply being sent cannot be cut short, but it can be too far behind already
+            size_t sent = sub->reply.snap.end - aesd_history_reply_pending(&sub->reply);
+            if(subscribe_lag_target(server, sent, end) > sent) {
+                subscriber_drop(sub, end - sent);
+                return -1;
+            }
+        }
+
+        size_t before = aesd_history_reply_pending(&sub->reply);
+        int ret = aesd_history_reply_send(&sub->reply, sub->fd);
+        if(aesd_history_reply_pending(&sub->reply) != before) {
+            sub->progress = aesd_metrics_now();
+        }
+        if(ret < 0) {
+            return -1;
+        }
+        if(ret == 0) {
+            return subscriber_watch(server, sub, true);
+        }
+        sub->pos = sub->reply.snap.end;
+        aesd_history_reply_release(&sub->reply);
+        sub->sending = false;
+    }
+    return subscriber_watch(server, sub, false);
+}
+
+static void subscriber_on_event(aesd_subscribe_server_t *server, aesd_subscriber_t *sub, uint32_t events) {
+    char discard[512];
+
+    // anything a subscriber sends is ignored, closing its side ends the subscription
+    while(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        ssize_t n = recv(sub->fd, discard, sizeof(discard), 0);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if(n <= 0) {
+            subscriber_close(server, sub);
+            return;
+        }
+        aesd_metrics_add(AESD_METRIC_BYTES_IN, n);
+    }
+    if((events & EPOLLOUT) && subscriber_feed(server, sub, subscribe_end(server)) < 0) {
+        subscriber_close(server, sub);
+    }
+}
+
+static void subscribe_accept(aesd_subscribe_server_t *server) {
+    while(1) {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+        int fd = accept4(server->listenFd, (struct sockaddr *)&addr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                syslog(LOG_ERR, "Unable to accept a subscriber: %s", strerror(errno));
+            }
+            return;
+        }
+
+        aesd_subscriber_t *sub = aesd_slab_zalloc(&subscriberSlab);
+        if(sub == NULL) {
+            syslog(LOG_ERR, "Unable to allocate memory for a subscriber");
+            close(fd);
+            continue;
+        }
+        sub->fd = fd;
+        inet_ntop(AF_INET, &addr.sin_addr, sub->ip, sizeof(sub->ip));
+        // a subscription starts with what is published after it
+        sub->pos = subscribe_end(server);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = sub };
+        if(epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            syslog(LOG_ERR, "Unable to watch a subscriber");
+            aesd_slab_free(&subscriberSlab, sub);
+            close(fd);
+            continue;
+        }
+        sub->next = server->subscribers;
+        if(server->subscribers != NULL) {
+            server->subscribers->prev = sub;
+        }
+        server->subscribers = sub;
+        aesd_metrics_add(AESD_METRIC_SUBSCRIBED, 1);
+        syslog(LOG_INFO, "Subscribed %s at offset %zu", sub->ip, sub->pos);
+    }
+}
+
+/**
+ * Fan what was just published out to every subscriber.
+ */
+static void subscribe_publish(aesd_subscribe_server_t *server) {
+    uint64_t count;
+    aesd_subscriber_t *next;
+
+    if(read(server->publishFd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    size_t end = subscribe_end(server);
+    for(aesd_subscriber_t *sub = server->subscribers; sub != NULL; sub = next) {
+        next = sub->next;
+        if(subscriber_feed(server, sub, end) < 0) {
+            subscriber_close(server, sub);
+        }
+    }
+}
+
+/**
+ * Disconnect the subscribers whose replies made no progress within the write timeout.
+ */
+static void subscribe_sweep(aesd_subscribe_server_t *server, uint64_t now) {
+    aesd_subscriber_t *next;
+    for(aesd_subscriber_t *sub = server->subscribers; sub != NULL; sub = next) {
+        next = sub->next;
+        if(sub->blocked && now - sub->progress >= (uint64_t)server->writeTimeoutMs * 1000000) {
+            syslog(LOG_WARNING, "Disconnecting subscriber %s, no bytes read for %u ms", sub->ip,
+                   server->writeTimeoutMs);
+            aesd_metrics_add(AESD_METRIC_SLOW_READERS, 1);
+            aesd_outq_abort(sub->fd);
+            subscriber_close(server, sub);
+        }
+    }
+}
+
+static void *subscribe_run(void *ptr) {
+    aesd_subscribe_server_t *server = (aesd_subscribe_server_t *)ptr;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t nextSweep = 0;
+    bool stopping = false;
+
+    while(!stopping) {
+        // only wake up regularly while some subscriber does not read
+        int timeout = -1;
+        if(server->blocked > 0 && server->writeTimeoutMs > 0) {
+            timeout = aesd_outq_sweep_ms(server->writeTimeoutMs);
+        }
+        int n = epoll_wait(server->epollFd, events, MAX_EVENTS, timeout);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Subscriber epoll_wait failed");
+            break;
+        }
+        bool published = false;
+        for(int i = 0; i < n; i++) {
+            void *data = events[i].data.ptr;
+            if(data == &stopMarker) {
+                stopping = true;
+            } else if(data == &listenMarker) {
+                subscribe_accept(server);
+            } else if(data == &publishMarker) {
+                published = true;
+            } else {
+                subscriber_on_event(server, data, events[i].events);
+            }
+        }
+        // after the events, so that none of them is for a subscriber closed meanwhile
+        if(published && !stopping) {
+            subscribe_publish(server);
+        }
+        if(timeout >= 0) {
+            uint64_t now = aesd_metrics_now();
+            if(now >= nextSweep) {
+                subscribe_sweep(server, now);
+                nextSweep = now + (uint64_t)timeout * 1000000;
+            }
+        }
+    }
+    while(server->subscribers != NULL) {
+        subscriber_close(server, server->subscribers);
+    }
+    return NULL;
+}
+
+static int subscribe_listen(int port) {
+    struct sockaddr_in addr;
+    int opt = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+       bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+aesd_subscribe_server_t *aesd_subscribe_start(aesd_history_t *history, int port, size_t maxLag,
+                                              aesd_lag_policy_t lagPolicy, unsigned writeTimeoutMs) {
+    aesd_subscribe_server_t *server = calloc(1, sizeof(aesd_subscribe_server_t));
+    if(server == NULL) {
+        return NULL;
+    }
+    server->history = history;
+    server->maxLag = maxLag;
+    server->lagPolicy = lagPolicy;
+    server->writeTimeoutMs = writeTimeoutMs;
+    server->listenFd = subscribe_listen(port);
+    server->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    server->publishFd = aesd_history_watch(history);
+    server->stopFd = eventfd(0, EFD_CLOEXEC);
+
+    struct epoll_event listenEv = { .events = EPOLLIN, .data.ptr = &listenMarker };
+    struct epoll_event publishEv = { .events = EPOLLIN, .data.ptr = &publishMarker };
+    struct epoll_event stopEv = { .events = EPOLLIN, .data.ptr = &stopMarker };
+    if(server->listenFd < 0 || server->epollFd < 0 || server->publishFd < 0 || server->stopFd < 0 ||
+       epoll_ctl(server->epollFd, EPOLL_CTL_ADD, server->listenFd, &listenEv) < 0 ||
+       epoll_ctl(server->epollFd, EPOLL_CTL_ADD, server->publishFd, &publishEv) < 0 ||
+       epoll_ctl(server->epollFd, EPOLL_CTL_ADD, server->stopFd, &stopEv) < 0 ||
+       pthread_create(&server->thread, NULL, subscribe_run, server) != 0) {
+        syslog(LOG_ERR, "Unable to start subscriber server: %s", strerror(errno));
+        if(server->listenFd >= 0) {
+            close(server->listenFd);
+        }
+        if(server->epollFd >= 0) {
+            close(server->epollFd);
+        }
+        if(server->stopFd >= 0) {
+            close(server->stopFd);
+        }
+        if(server->publishFd >= 0) {
+            aesd_history_unwatch(history);
+        }
+        free(server);
+        return NULL;
+    }
+    syslog(LOG_INFO, "Serving subscribers at port %d, lag limit %zu byte(s), %s lagging ones", port, maxLag,
+           lagPolicyNames[lagPolicy]);
+    return server;
+}
+
+void aesd_subscribe_stop(aesd_subscribe_server_t *server) {
+    uint64_t one = 1;
+
+    if(write(server->stopFd, &one, sizeof(one)) != sizeof(one)) {
+        syslog(LOG_ERR, "Unable to stop subscriber server");
+        return;
+    }
+    pthread_join(server->thread, NULL);
+    close(server->listenFd);
+    close(server->epollFd);
+    close(server->stopFd);
+    free(server);
+}
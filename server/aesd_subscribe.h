@@ -0,0 +1,81 @@
+#ifndef _AESD_SUBSCRIBE_H_
+#define _AESD_SUBSCRIBE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "aesd_history.h"
+
+typedef enum {
+    AESD_LAG_SKIP,          // jump a lagging subscriber forward to a newer record
+    AESD_LAG_DROP,          // disconnect a lagging subscriber
+} aesd_lag_policy_t;
+
+/**
+ * One client of the subscriber port, sent every record as it is published.
+ */
+typedef struct aesd_subscriber_s aesd_subscriber_t;
+struct aesd_subscriber_s {
+    aesd_subscriber_t *prev;
+    aesd_subscriber_t *next;
+    int fd;
+    char ip[INET6_ADDRSTRLEN];
+    size_t pos;             // offset the next reply starts at, a record boundary
+    bool sending;           // reply holds published bytes not sent yet
+    bool blocked;           // waiting for the socket to drain
+    aesd_history_reply_t reply;
+    uint64_t progress;      // aesd_metrics_now() of the last bytes sent, or of the reply start
+};
+
+/**
+ * Tail of the history pushed to subscribers: a client connecting to the subscriber
+ * port is registered at the current end of the history and from then on sent each
+ * group commit once it is published, without sending anything itself. A single
+ * thread serves every subscriber with nonblocking sends of snapshot replies, so all
+ * of them stream the same chunks of the history and none is copied per subscriber.
+ *
+ * A subscriber that falls more than maxLag bytes behind the end, counting only
+ * whole records before the newest one, is handled by the lag policy: skipped
+ * forward to the oldest record within maxLag of the end once its current reply is
+ * sent, or disconnected. The same goes for one that retention overtook. One whose
+ * reply makes no progress for the write timeout is disconnected either way.
+ */
+typedef struct aesd_subscribe_server_s aesd_subscribe_server_t;
+struct aesd_subscribe_server_s {
+    pthread_t thread;
+    aesd_history_t *history;
+    int listenFd;
+    int epollFd;
+    int publishFd;          // aesd_history_watch() of history, owned by it
+    int stopFd;             // eventfd signalled by aesd_subscribe_stop()
+    size_t maxLag;          // 0 for no limit
+    aesd_lag_policy_t lagPolicy;
+    unsigned writeTimeoutMs;
+    aesd_subscriber_t *subscribers;
+    int blocked;            // subscribers waiting for their socket to drain
+};
+
+/**
+ * Start accepting subscribers of @param history on TCP port @param port.
+ * @param maxLag bytes a subscriber may fall behind before @param lagPolicy applies,
+ *   0 for no limit.
+ * @param writeTimeoutMs time a reply may make no progress, 0 to wait forever.
+ * @return the server, or NULL if it could not be started.
+ */
+aesd_subscribe_server_t *aesd_subscribe_start(aesd_history_t *history, int port, size_t maxLag,
+                                              aesd_lag_policy_t lagPolicy, unsigned writeTimeoutMs);
+
+/**
+ * Disconnect every subscriber and stop the server.
+ */
+void aesd_subscribe_stop(aesd_subscribe_server_t *server);
+
+/**
+ * @return the lag policy named @param name, or -1 if there is none.
+ */
+int aesd_subscribe_lag_policy(const char *name);
+
+#endif
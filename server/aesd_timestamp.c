@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "aesd_timestamp.h"
+
+static void timestamp_append(aesd_timestamp_t *ts) {
+    char record[64];
+    struct tm tm;
+    time_t now = time(NULL);
+
+    localtime_r(&now, &tm);
+    size_t len = strftime(record, sizeof(record), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", &tm);
+    if(len == 0 || aesd_history_append(ts->history, record, len) < 0) {
+        syslog(LOG_ERR, "Unable to append timestamp record");
+    }
+}
+
+static void *timestamp_run(void *ptr) {
+    aesd_timestamp_t *ts = (aesd_timestamp_t *)ptr;
+    struct pollfd fds[2] = {
+        { .fd = ts->timerFd, .events = POLLIN },
+        { .fd = ts->stopFd, .events = POLLIN },
+    };
+
+    while(1) {
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Timestamp writer poll failed");
+            break;
+        }
+        if(fds[1].revents) {
+            break;
+        }
+        uint64_t expirations;
+        if(read(ts->timerFd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            // a late wakeup still writes a single record, with the current time
+            timestamp_append(ts);
+        }
+    }
+    return NULL;
+}
+
+aesd_timestamp_t *aesd_timestamp_start(aesd_history_t *history, unsigned intervalSec) {
+    aesd_timestamp_t *ts = calloc(1, sizeof(aesd_timestamp_t));
+    if(ts == NULL) {
+        return NULL;
+    }
+    ts->history = history;
+    ts->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    ts->stopFd = eventfd(0, EFD_CLOEXEC);
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = intervalSec;
+    spec.it_interval.tv_sec = intervalSec;
+    if(ts->timerFd < 0 || ts->stopFd < 0 || timerfd_settime(ts->timerFd, 0, &spec, NULL) < 0 ||
+       pthread_create(&ts->thread, NULL, timestamp_run, ts) != 0) {
+        syslog(LOG_ERR, "Unable to start timestamp writer");
+        if(ts->timerFd >= 0) {
+            close(ts->timerFd);
+        }
+        if(ts->stopFd >= 0) {
+            close(ts->stopFd);
+        }
+        free(ts);
+        return NULL;
+    }
+    return ts;
+}
+
+void aesd_timestamp_stop(aesd_timestamp_t *ts) {
+    uint64_t one = 1;
+
+    if(write(ts->stopFd, &one, sizeof(one)) != sizeof(one)) {
+        syslog(LOG_ERR, "Unable to stop timestamp writer");
+        return;
+    }
+    pthread_join(ts->thread, NULL);
+    close(ts->timerFd);
+    close(ts->stopFd);
+    free(ts);
+}
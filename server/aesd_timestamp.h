@@ -0,0 +1,34 @@
+#ifndef _AESD_TIMESTAMP_H_
+#define _AESD_TIMESTAMP_H_
+
+#include <pthread.h>
+
+#include "aesd_history.h"
+
+/**
+ * Writer of the periodic "timestamp:" records. A dedicated thread sleeps in poll()
+ * on a timerfd, so no signal ever interrupts the connection threads, and appends
+ * each record through aesd_history_append() like any packet, ordered with them by
+ * the group commit.
+ */
+typedef struct aesd_timestamp_s aesd_timestamp_t;
+struct aesd_timestamp_s {
+    pthread_t thread;
+    aesd_history_t *history;
+    int timerFd;
+    int stopFd;             // eventfd signalled by aesd_timestamp_stop()
+};
+
+/**
+ * Start appending an RFC 2822 "timestamp:" record to @param history every
+ * @param intervalSec seconds, the first one after a full interval.
+ * @return the writer, or NULL if it could not be started.
+ */
+aesd_timestamp_t *aesd_timestamp_start(aesd_history_t *history, unsigned intervalSec);
+
+/**
+ * Stop the writer and wait for its thread, letting a record being appended complete.
+ */
+void aesd_timestamp_stop(aesd_timestamp_t *ts);
+
+#endif
@@ -0,0 +1,859 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "aesdsocket.h"
+#include "aesd_uring.h"
+#include "aesd_packet.h"
+#include "aesd_framer.h"
+#include "aesd_slab.h"
+#include "aesd_metrics.h"
+#include "aesd_outq.h"
+
+#define URING_ENTRIES 256
+#define URING_BUF_COUNT 256     // provided receive buffers, must be a power of 2
+#define URING_BUF_SIZE 2048
+#define URING_BGID 0
+#define URING_MAX_IOV 16        // cached history pieces handed to one sendmsg
+#define URING_OUT_POOL_SIZE (64 * 1024)  // read-back reply buffers up to this size come from a slab
+
+/* user_data carries the connection pointer with the operation in its low bits */
+enum {
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_CANCEL,
+    URING_OP_STOP,      // poll on stopFd, completes once shutdown was requested
+    URING_OP_TICK,      // timeout looking for stalled replies while connections are open
+    URING_OP_COMMITTED, // poll on the completions eventfd, completes once packets came back
+};
+#define URING_OP_MASK 7ULL
+
+typedef struct uring_conn_s uring_conn_t;
+struct uring_conn_s {
+    uring_conn_t *prev;     // connections of the ring, swept for stalled replies
+    uring_conn_t *next;
+    int fd;
+    char ip[INET6_ADDRSTRLEN];
+    aesd_framer_t framer;
+    aesd_outq_t out;        // replies of the packets committed so far, the head one is being sent
+    char *outBuf;           // part of the reply only found in the store, read back first
+    size_t outLen;
+    size_t outCap;
+    size_t outSent;
+    struct msghdr msg;      // cached part of the reply, sent straight from the history chunks
+    struct iovec iov[URING_MAX_IOV];
+    int inflight;           // submitted operations that have not completed yet
+    bool recvArmed;
+    bool framed;            // the last packet is complete, later bytes are ignored
+    bool peerClosed;        // the client sent everything it is going to send
+    bool closing;
+    bool committing;        // commit is with the committer, later packets wait for it
+    aesd_commit_t commit;
+    char *packet;           // copy of the packet of commit, as receives go on meanwhile
+    size_t packetCap;
+    aesd_registry_entry_t entry;
+};
+
+static aesd_slab_t connSlab = AESD_SLAB_INITIALIZER("io_uring connections", sizeof(uring_conn_t));
+static aesd_slab_t outSlab = AESD_SLAB_INITIALIZER("io_uring reply buffers", URING_OUT_POOL_SIZE);
+
+typedef struct aesd_uring_s aesd_uring_t;
+struct aesd_uring_s {
+    pthread_t thread;
+    int ringFd;
+    int listenFd;
+    bool recvMultishot;
+    int conns;              // connections not released yet
+    uring_conn_t *connList;
+    bool stopping;          // accept cancelled, exits once conns drops to 0
+    bool ticking;           // URING_OP_TICK armed
+    struct __kernel_timespec tick;
+    aesd_completions_t completions; // packets of the ring's connections back from the committer
+
+    void *ringMem;
+    size_t ringMemSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned *sqArray;
+    unsigned sqLocalTail;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *bufRing;
+    size_t bufRingSize;
+    char *bufBase;
+    unsigned short bufTail;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nrArgs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+static int ring_submit(aesd_uring_t *ring, unsigned waitNr) {
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    unsigned toSubmit = ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    return sys_io_uring_enter(ring->ringFd, toSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0);
+}
+
+static struct io_uring_sqe *ring_get_sqe(aesd_uring_t *ring) {
+    if(ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+        // queue full: push what we have so far to the kernel to make room
+        ring_submit(ring, 0);
+        if(ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+            return NULL;
+        }
+    }
+    unsigned idx = ring->sqLocalTail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[idx] = idx;
+    ring->sqLocalTail++;
+    return sqe;
+}
+
+static void ring_recycle_buffer(aesd_uring_t *ring, unsigned short bid) {
+    struct io_uring_buf *buf = &ring->bufRing->bufs[ring->bufTail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufBase + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->bufTail++;
+    __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+static bool ring_probe(aesd_uring_t *ring) {
+    static const int needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_READ,
+        IORING_OP_ASYNC_CANCEL, IORING_OP_POLL_ADD, IORING_OP_TIMEOUT,
+    };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    bool ok = probe != NULL && sys_io_uring_register(ring->ringFd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for(size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static void ring_teardown(aesd_uring_t *ring) {
+    if(ring->bufRing != NULL) {
+        munmap(ring->bufRing, ring->bufRingSize);
+    }
+    free(ring->bufBase);
+    if(ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if(ring->ringMem != NULL) {
+        munmap(ring->ringMem, ring->ringMemSize);
+    }
+    if(ring->ringFd >= 0) {
+        close(ring->ringFd);
+    }
+}
+
+/**
+ * Create the ring, map its queues and register the provided receive buffers.
+ * @return 0 on success, AESD_URING_UNSUPPORTED if the kernel lacks a needed feature.
+ */
+static int ring_setup(aesd_uring_t *ring, int listenFd) {
+    struct io_uring_params p;
+
+    ring->listenFd = listenFd;
+    ring->recvMultishot = true;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    ring->ringFd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if(ring->ringFd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        ring->ringFd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    if(ring->ringFd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) || !ring_probe(ring)) {
+        goto unsupported;
+    }
+
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringMemSize = sqSize > cqSize ? sqSize : cqSize;
+    ring->ringMem = mmap(NULL, ring->ringMemSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->ringFd, IORING_OFF_SQ_RING);
+    ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ringFd, IORING_OFF_SQES);
+    if(ring->ringMem == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        ring->ringMem = ring->ringMem == MAP_FAILED ? NULL : ring->ringMem;
+        ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+        goto failed;
+    }
+    char *mem = ring->ringMem;
+    ring->sqHead = (unsigned *)(mem + p.sq_off.head);
+    ring->sqTail = (unsigned *)(mem + p.sq_off.tail);
+    ring->sqMask = *(unsigned *)(mem + p.sq_off.ring_mask);
+    ring->sqEntries = *(unsigned *)(mem + p.sq_off.ring_entries);
+    ring->sqArray = (unsigned *)(mem + p.sq_off.array);
+    ring->sqLocalTail = *ring->sqTail;
+    ring->cqHead = (unsigned *)(mem + p.cq_off.head);
+    ring->cqTail = (unsigned *)(mem + p.cq_off.tail);
+    ring->cqMask = *(unsigned *)(mem + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(mem + p.cq_off.cqes);
+
+    ring->bufRingSize = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ring->bufRing = mmap(NULL, ring->bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufBase = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if(ring->bufRing == MAP_FAILED || ring->bufBase == NULL) {
+        ring->bufRing = ring->bufRing == MAP_FAILED ? NULL : ring->bufRing;
+        goto failed;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufRing;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+    if(sys_io_uring_register(ring->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        goto unsupported;
+    }
+    for(unsigned short bid = 0; bid < URING_BUF_COUNT; bid++) {
+        ring_recycle_buffer(ring, bid);
+    }
+    return 0;
+
+unsupported:
+    ring_teardown(ring);
+    return AESD_URING_UNSUPPORTED;
+failed:
+    ring_teardown(ring);
+    return -1;
+}
+
+static void ring_arm_accept(aesd_uring_t *ring) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    if(sqe == NULL) {
+        syslog(LOG_ERR, "io_uring submission queue full, accept not armed");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_OP_ACCEPT;
+}
+
+static void ring_arm_stop(aesd_uring_t *ring) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    if(sqe == NULL) {
+        syslog(LOG_ERR, "io_uring submission queue full, shutdown not watched");
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = stopFd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_OP_STOP;
+}
+
+/**
+ * Wake up the ring after a while to look for stalled replies, as long as it has
+ * connections and a write timeout is set.
+ */
+static void ring_arm_tick(aesd_uring_t *ring) {
+    if(ring->ticking || ring->conns == 0 || config.writeTimeoutMs == 0) {
+        return;
+    }
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    if(sqe == NULL) {
+        return;
+    }
+    unsigned ms = aesd_outq_sweep_ms(config.writeTimeoutMs);
+    ring->tick.tv_sec = ms / 1000;
+    ring->tick.tv_nsec = (long long)(ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->tick;
+    sqe->len = 1;
+    sqe->user_data = URING_OP_TICK;
+    ring->ticking = true;
+}
+
+static void ring_arm_committed(aesd_uring_t *ring) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    if(sqe == NULL) {
+        syslog(LOG_ERR, "io_uring submission queue full, commits not watched");
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ring->completions.fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_OP_COMMITTED;
+}
+
+/**
+ * Stop accepting once shutdown was requested; the connections already accepted
+ * are served until they close or the registry shuts them down.
+ */
+static void ring_on_stop(aesd_uring_t *ring) {
+    ring->stopping = true;
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    if(sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = URING_OP_ACCEPT;
+    sqe->user_data = URING_OP_CANCEL;
+}
+
+static bool conn_queue(aesd_uring_t *ring, uring_conn_t *conn, int op, struct io_uring_sqe **out) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    if(sqe == NULL) {
+        return false;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)conn | op;
+    conn->inflight++;
+    *out = sqe;
+    return true;
+}
+
+static void conn_close(aesd_uring_t *ring, uring_conn_t *conn);
+
+static void conn_arm_recv(aesd_uring_t *ring, uring_conn_t *conn) {
+    struct io_uring_sqe *sqe;
+    if(!conn_queue(ring, conn, URING_OP_RECV, &sqe)) {
+        conn_close(ring, conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = ring->recvMultishot ? IORING_RECV_MULTISHOT : 0;
+    conn->recvArmed = true;
+}
+
+static void conn_cancel_recv(aesd_uring_t *ring, uring_conn_t *conn) {
+    struct io_uring_sqe *sqe;
+    if(!conn->recvArmed || !conn_queue(ring, conn, URING_OP_CANCEL, &sqe)) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)conn | URING_OP_RECV;
+}
+
+static void conn_close(aesd_uring_t *ring, uring_conn_t *conn) {
+    if(conn->closing) {
+        return;
+    }
+    conn->closing = true;
+    conn_cancel_recv(ring, conn);
+    syslog(LOG_INFO, "Closed connection from %s", conn->ip);
+    aesd_registry_remove(&registry, &conn->entry);
+    // in-flight operations hold their own file reference, the memory is freed once they complete
+    close(conn->fd);
+}
+
+static void conn_free_out(uring_conn_t *conn) {
+    if(conn->outCap <= URING_OUT_POOL_SIZE) {
+        aesd_slab_free(&outSlab, conn->outBuf);
+    } else {
+        free(conn->outBuf);
+    }
+    conn->outBuf = NULL;
+}
+
+static void conn_release(aesd_uring_t *ring, uring_conn_t *conn) {
+    if(conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        ring->connList = conn->next;
+    }
+    if(conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    aesd_outq_destroy(&conn->out);
+    aesd_framer_destroy(&conn->framer);
+    conn_free_out(conn);
+    free(conn->packet);
+    aesd_slab_free(&connSlab, conn);
+    ring->conns--;
+}
+
+static aesd_history_reply_t *conn_reply(uring_conn_t *conn) {
+    return &conn->out.head->reply;
+}
+
+static void conn_queue_read(aesd_uring_t *ring, uring_conn_t *conn) {
+    struct io_uring_sqe *sqe;
+    if(!conn_queue(ring, conn, URING_OP_READ, &sqe)) {
+        conn_close(ring, conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = conn_reply(conn)->store.file;
+    sqe->addr = (uint64_t)(uintptr_t)(conn->outBuf + conn->outLen);
+    sqe->len = conn->outCap - conn->outLen;
+    sqe->off = conn_reply(conn)->store.offset + conn->outLen;
+}
+
+static void conn_queue_send(aesd_uring_t *ring, uring_conn_t *conn) {
+    struct io_uring_sqe *sqe;
+    if(!conn_queue(ring, conn, URING_OP_SEND, &sqe)) {
+        conn_close(ring, conn);
+        return;
+    }
+    sqe->fd = conn->fd;
+    if(conn->outSent < conn->outLen) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t)(uintptr_t)(conn->outBuf + conn->outSent);
+        sqe->len = conn->outLen - conn->outSent;
+    } else {
+        memset(&conn->msg, 0, sizeof(conn->msg));
+        conn->msg.msg_iov = conn->iov;
+        conn->msg.msg_iovlen = aesd_history_reply_iov(conn_reply(conn), conn->iov, URING_MAX_IOV);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (uint64_t)(uintptr_t)&conn->msg;
+        sqe->len = 1;
+    }
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/**
+ * Start sending the reply at the head of the queue of @param conn, reading back
+ * first whatever part is no longer cached.
+ * @return true if an operation was queued, false if the reply is empty or the
+ *   connection had to be closed.
+ */
+static bool conn_start_reply(aesd_uring_t *ring, uring_conn_t *conn) {
+    aesd_history_reply_t *reply = conn_reply(conn);
+
+    if(reply->fromStore) {
+        conn->outCap = reply->store.remaining;
+        conn->outBuf = conn->outCap <= URING_OUT_POOL_SIZE ? aesd_slab_alloc(&outSlab) : malloc(conn->outCap);
+        if(conn->outBuf == NULL) {
+            conn_close(ring, conn);
+            return false;
+        }
+        conn_queue_read(ring, conn);
+        return true;
+    }
+    if(reply->snap.pos < reply->snap.end) {
+        conn_queue_send(ring, conn);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Send the queued replies of @param conn one after the other, dropping empty ones.
+ * Once the queue is empty, the connection is closed if no more packets can come.
+ */
+static void conn_next_reply(aesd_uring_t *ring, uring_conn_t *conn) {
+    while(!conn->closing && !aesd_outq_empty(&conn->out)) {
+        if(conn_start_reply(ring, conn) || conn->closing) {
+            return;
+        }
+        aesd_outq_pop(&conn->out);
+    }
+    if(!conn->closing && !conn->committing && (conn->framed || conn->peerClosed)) {
+        conn_close(ring, conn);
+    }
+}
+
+static void conn_finish_reply(aesd_uring_t *ring, uring_conn_t *conn) {
+    conn_free_out(conn);
+    conn->outLen = 0;
+    conn->outCap = 0;
+    conn->outSent = 0;
+    aesd_outq_pop(&conn->out);
+    conn_next_reply(ring, conn);
+}
+
+/**
+ * Queue @param reply behind the earlier ones of @param conn.
+ * @return 0 on success, -1 if the connection had to be closed.
+ */
+static int conn_push_reply(aesd_uring_t *ring, uring_conn_t *conn, aesd_history_reply_t *reply) {
+    if(aesd_outq_push(&conn->out, reply, conn->framer.packetSince, config.maxQueued) < 0) {
+        if(errno == ENOBUFS) {
+            syslog(LOG_WARNING, "Disconnecting %s, more than %zu bytes of replies queued", conn->ip,
+                   config.maxQueued);
+            aesd_metrics_add(AESD_METRIC_SLOW_READERS, 1);
+            aesd_outq_abort(conn->fd);
+        } else {
+            syslog(LOG_ERR, "Unable to allocate memory for a reply to %s", conn->ip);
+        }
+        conn_close(ring, conn);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Copy @param packet out of the framer of @param conn, which receives go on into
+ * while it is committed.
+ * @return the copy, or NULL if the connection had to be closed.
+ */
+static const char *conn_copy_packet(aesd_uring_t *ring, uring_conn_t *conn, const char *packet, size_t len) {
+    if(len > conn->packetCap) {
+        char *grown = realloc(conn->packet, len);
+        if(grown == NULL) {
+            syslog(LOG_ERR, "Unable to allocate memory for a packet of %s", conn->ip);
+            conn_close(ring, conn);
+            return NULL;
+        }
+        conn->packet = grown;
+        conn->packetCap = len;
+    }
+    memcpy(conn->packet, packet, len);
+    return conn->packet;
+}
+
+/**
+ * Resolve the commands among the complete packets buffered in @param conn and queue
+ * their replies, which are sent in order while later packets keep coming, up to the
+ * first packet to store: that one goes to the committer and the packets after it
+ * wait for it to come back. Without keep-alive, everything received up to the last
+ * newline is one packet and the connection closes after its reply.
+ */
+static void conn_serve(aesd_uring_t *ring, uring_conn_t *conn) {
+    bool idle = aesd_outq_empty(&conn->out);
+    const char *packet;
+    size_t packetLen;
+    aesd_history_reply_t reply;
+
+    while(!conn->framed && !conn->closing && !conn->committing &&
+          aesd_framer_next(&conn->framer, &packet, &packetLen)) {
+        if(!config.keepAlive) {
+            conn->framed = true;
+            conn_cancel_recv(ring, conn);
+        }
+        packet = conn_copy_packet(ring, conn, packet, packetLen);
+        if(packet == NULL) {
+            return;
+        }
+        int ret = aesd_packet_submit(packet, packetLen, conn->ip, &reply, &conn->commit, &ring->completions, conn);
+        if(ret == AESD_PACKET_SUBMITTED) {
+            conn->committing = true;
+        } else if(ret < 0) {
+            conn_close(ring, conn);
+            return;
+        } else if(conn_push_reply(ring, conn, &reply) < 0) {
+            return;
+        }
+    }
+    // a reply in flight starts the next one when it completes
+    if(idle) {
+        conn_next_reply(ring, conn);
+    }
+}
+
+/**
+ * Queue the replies to the packets the committer handed back to @param ring, and
+ * go on with the packets that waited for them.
+ */
+static void ring_on_committed(aesd_uring_t *ring) {
+    aesd_commit_t *next;
+    for(aesd_commit_t *commit = aesd_completions_take(&ring->completions); commit != NULL; commit = next) {
+        next = commit->next;
+        uring_conn_t *conn = commit->owner;
+        aesd_history_reply_t reply;
+
+        conn->committing = false;
+        if(conn->closing) {
+            if(conn->inflight == 0) {
+                conn_release(ring, conn);
+            }
+            continue;
+        }
+        bool idle = aesd_outq_empty(&conn->out);
+        if(aesd_packet_committed(commit, &reply) < 0) {
+            conn_close(ring, conn);
+            continue;
+        }
+        if(conn_push_reply(ring, conn, &reply) < 0) {
+            continue;
+        }
+        if(idle) {
+            conn_next_reply(ring, conn);
+        }
+        conn_serve(ring, conn);
+    }
+    ring_arm_committed(ring);
+}
+
+/**
+ * Close the connections of @param ring whose replies made no progress within the
+ * write timeout. Aborting the socket first fails the send still in flight.
+ */
+static void ring_on_tick(aesd_uring_t *ring) {
+    uint64_t now = aesd_metrics_now();
+
+    ring->ticking = false;
+    uring_conn_t *next;
+    for(uring_conn_t *conn = ring->connList; conn != NULL; conn = next) {
+        next = conn->next;
+        if(!conn->closing && aesd_outq_stalled(&conn->out, now, config.writeTimeoutMs)) {
+            syslog(LOG_WARNING, "Disconnecting %s, no reply bytes read for %u ms", conn->ip,
+                   config.writeTimeoutMs);
+            aesd_metrics_add(AESD_METRIC_SLOW_READERS, 1);
+            aesd_outq_abort(conn->fd);
+            conn_close(ring, conn);
+            if(conn->inflight == 0 && !conn->committing) {
+                conn_release(ring, conn);
+            }
+        }
+    }
+    ring_arm_tick(ring);
+}
+
+static void ring_on_accept(aesd_uring_t *ring, struct io_uring_cqe *cqe) {
+    if(!(cqe->flags & IORING_CQE_F_MORE) && !ring->stopping) {
+        ring_arm_accept(ring);
+    }
+    if(cqe->res < 0) {
+        if(cqe->res != -ECANCELED && !ring->stopping) {
+            syslog(LOG_ERR, "Unable to accept the client's connection: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    uring_conn_t *conn = aesd_slab_zalloc(&connSlab);
+    if(conn == NULL || aesd_framer_init(&conn->framer, URING_BUF_SIZE, !config.keepAlive) < 0) {
+        syslog(LOG_ERR, "Unable to allocate memory for client connection");
+        aesd_slab_free(&connSlab, conn);
+        close(cqe->res);
+        return;
+    }
+    conn->fd = cqe->res;
+    if(!aesd_registry_add(&registry, &conn->entry, conn->fd)) {
+        aesd_framer_destroy(&conn->framer);
+        aesd_slab_free(&connSlab, conn);
+        close(cqe->res);
+        return;
+    }
+    aesd_outq_init(&conn->out);
+    conn->next = ring->connList;
+    if(ring->connList != NULL) {
+        ring->connList->prev = conn;
+    }
+    ring->connList = conn;
+    ring->conns++;
+    ring_arm_tick(ring);
+
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    if(getpeername(conn->fd, (struct sockaddr *)&client_addr, &client_len) == 0) {
+        inet_ntop(AF_INET, &client_addr.sin_addr, conn->ip, sizeof(conn->ip));
+    }
+    syslog(LOG_INFO, "Accepted connection from %s", conn->ip);
+    conn_arm_recv(ring, conn);
+}
+
+static void ring_on_recv(aesd_uring_t *ring, uring_conn_t *conn, struct io_uring_cqe *cqe) {
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recvArmed = false;
+    }
+
+    if(cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = ring->bufBase + (size_t)bid * URING_BUF_SIZE;
+        size_t len = cqe->res;
+
+        aesd_metrics_add(AESD_METRIC_BYTES_IN, len);
+
+        if(!conn->framed && !conn->closing) {
+            if(aesd_framer_push(&conn->framer, data, len) < 0) {
+                ring_recycle_buffer(ring, bid);
+                conn_close(ring, conn);
+                return;
+            }
+            conn_serve(ring, conn);
+        }
+        ring_recycle_buffer(ring, bid);
+    } else if(cqe->res == 0) {
+        conn->peerClosed = true;
+        if(aesd_outq_empty(&conn->out) && !conn->committing) {
+            conn_close(ring, conn);
+        }
+        return;
+    } else if(cqe->res == -EINVAL && ring->recvMultishot) {
+        syslog(LOG_INFO, "Multishot recv unsupported, using single shot recv");
+        ring->recvMultishot = false;
+    } else if(cqe->res < 0 && cqe->res != -ENOBUFS) {
+        if(cqe->res != -ECANCELED && !conn->framed) {
+            syslog(LOG_ERR, "Received error from %s", conn->ip);
+            conn_close(ring, conn);
+        }
+        return;
+    }
+
+    if(!conn->recvArmed && !conn->framed && !conn->peerClosed && !conn->closing) {
+        conn_arm_recv(ring, conn);
+    }
+}
+
+static void ring_on_read(aesd_uring_t *ring, uring_conn_t *conn, struct io_uring_cqe *cqe) {
+    if(conn->closing) {
+        return;
+    }
+    if(cqe->res < 0) {
+        syslog(LOG_ERR, "Unable to read back history for %s", conn->ip);
+        conn_close(ring, conn);
+        return;
+    }
+    conn->outLen += cqe->res;
+    if(cqe->res > 0 && conn->outLen < conn->outCap) {
+        conn_queue_read(ring, conn);
+    } else {
+        conn_queue_send(ring, conn);
+    }
+}
+
+static void ring_on_send(aesd_uring_t *ring, uring_conn_t *conn, struct io_uring_cqe *cqe) {
+    if(conn->closing) {
+        return;
+    }
+    if(cqe->res < 0) {
+        conn_close(ring, conn);
+        return;
+    }
+    aesd_metrics_add(AESD_METRIC_BYTES_OUT, cqe->res);
+    aesd_outq_sent(&conn->out, cqe->res);
+    if(conn->outSent < conn->outLen) {
+        conn->outSent += cqe->res;
+    } else {
+        aesd_history_reply_advance(conn_reply(conn), cqe->res);
+    }
+    if(conn->outSent < conn->outLen || conn_reply(conn)->snap.pos < conn_reply(conn)->snap.end) {
+        conn_queue_send(ring, conn);
+        return;
+    }
+    conn_finish_reply(ring, conn);
+}
+
+static void ring_on_completion(aesd_uring_t *ring, struct io_uring_cqe *cqe) {
+    int op = cqe->user_data & URING_OP_MASK;
+    uring_conn_t *conn = (uring_conn_t *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+
+    if(conn == NULL) {
+        // operations of the ring itself
+        if(op == URING_OP_ACCEPT) {
+            ring_on_accept(ring, cqe);
+        } else if(op == URING_OP_STOP) {
+            ring_on_stop(ring);
+        } else if(op == URING_OP_TICK) {
+            ring_on_tick(ring);
+        } else if(op == URING_OP_COMMITTED) {
+            ring_on_committed(ring);
+        }
+        return;
+    }
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->inflight--;
+    }
+    switch(op) {
+        case URING_OP_RECV:
+            ring_on_recv(ring, conn, cqe);
+            break;
+        case URING_OP_READ:
+            ring_on_read(ring, conn, cqe);
+            break;
+        case URING_OP_SEND:
+            ring_on_send(ring, conn, cqe);
+            break;
+        default:
+            break;
+    }
+    if(conn->closing && conn->inflight == 0 && !conn->committing) {
+        conn_release(ring, conn);
+    }
+}
+
+static void *ring_run(void *ptr) {
+    aesd_uring_t *ring = (aesd_uring_t *)ptr;
+
+    ring_arm_accept(ring);
+    ring_arm_stop(ring);
+    ring_arm_committed(ring);
+    while(!ring->stopping || ring->conns > 0) {
+        // submit everything queued while handling the last batch and wait for more completions
+        if(ring_submit(ring, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) {
+            ring_on_completion(ring, &ring->cqes[head & ring->cqMask]);
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int aesd_uring_run(const int *listenFds, int numRings) {
+    aesd_uring_t *rings = calloc(numRings, sizeof(aesd_uring_t));
+    if(rings == NULL) {
+        syslog(LOG_ERR, "Unable to allocate io_uring instances");
+        return -1;
+    }
+
+    int started = 0;
+    int ret = 0;
+    for(; started < numRings; started++) {
+        ret = ring_setup(&rings[started], listenFds[started]);
+        if(ret < 0) {
+            break;
+        }
+        if(aesd_completions_init(&rings[started].completions) < 0) {
+            ring_teardown(&rings[started]);
+            break;
+        }
+        if(pthread_create(&rings[started].thread, NULL, ring_run, &rings[started]) != 0) {
+            syslog(LOG_ERR, "Unable to start io_uring thread %d", started);
+            aesd_completions_destroy(&rings[started].completions);
+            ring_teardown(&rings[started]);
+            break;
+        }
+    }
+    if(started == 0) {
+        free(rings);
+        return ret == AESD_URING_UNSUPPORTED ? AESD_URING_UNSUPPORTED : -1;
+    }
+    syslog(LOG_INFO, "Serving connections with %d io_uring instance(s)", started);
+
+    for(int i = 0; i < started; i++) {
+        pthread_join(rings[i].thread, NULL);
+        ring_teardown(&rings[i]);
+        aesd_completions_destroy(&rings[i].completions);
+    }
+    free(rings);
+    return 0;
+}
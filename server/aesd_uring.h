@@ -0,0 +1,24 @@
+#ifndef _AESD_URING_H_
+#define _AESD_URING_H_
+
+/**
+ * Returned by aesd_uring_run() when the running kernel cannot provide the
+ * io_uring features the engine relies on, so the caller can fall back.
+ */
+#define AESD_URING_UNSUPPORTED -2
+
+/**
+ * Serve connections with @param numRings io_uring instances, each driven by its
+ * own thread and accepting on @param listenFds[i], shared or a SO_REUSEPORT
+ * listener of its own. Every ring keeps one multishot accept armed on its socket,
+ * receives with multishot recv into a ring of provided buffers, submits each packet
+ * to the commit thread of the history and sends the reply from it once the packet
+ * is handed back, submitting everything queued in one io_uring_enter() call per
+ * loop iteration. Once stopFd becomes readable each ring
+ * cancels its accept and exits when its last connection is released.
+ * @return AESD_URING_UNSUPPORTED if io_uring is unavailable, -1 on other setup
+ *   failures, otherwise only returns once all rings exit.
+ */
+int aesd_uring_run(const int *listenFds, int numRings);
+
+#endif
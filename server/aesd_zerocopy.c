@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "aesd_zerocopy.h"
+#include "aesd_slab.h"
+
+#define ZC_CHUNK_SIZE (64 * 1024)
+
+static aesd_slab_t copyBufs = AESD_SLAB_INITIALIZER("copy buffers", ZC_CHUNK_SIZE);
+
+static size_t zc_chunk(const aesd_zc_t *zc) {
+    return zc->remaining < ZC_CHUNK_SIZE ? zc->remaining : ZC_CHUNK_SIZE;
+}
+
+void aesd_zc_init(aesd_zc_t *zc, int file, size_t count) {
+    struct stat st;
+
+    zc->file = file;
+    zc->offset = 0;
+    zc->useOffset = false;
+    zc->remaining = count;
+    zc->method = (fstat(file, &st) == 0 && S_ISREG(st.st_mode)) ? AESD_ZC_SENDFILE : AESD_ZC_SPLICE;
+    zc->pipeFds[0] = -1;
+    zc->pipeFds[1] = -1;
+    zc->pending = 0;
+    zc->copyBuf = NULL;
+    zc->copyOff = 0;
+}
+
+void aesd_zc_init_range(aesd_zc_t *zc, int file, off_t offset, size_t count) {
+    aesd_zc_init(zc, file, count);
+    zc->offset = offset;
+    zc->useOffset = true;
+}
+
+void aesd_zc_release(aesd_zc_t *zc) {
+    if(zc->pipeFds[0] >= 0) {
+        close(zc->pipeFds[0]);
+        close(zc->pipeFds[1]);
+        zc->pipeFds[0] = -1;
+        zc->pipeFds[1] = -1;
+    }
+    aesd_slab_free(&copyBufs, zc->copyBuf);
+    zc->copyBuf = NULL;
+}
+
+static int zc_would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static int zc_send_file(aesd_zc_t *zc, int sockfd) {
+    while(zc->remaining > 0) {
+        ssize_t sent = sendfile(sockfd, zc->file, zc->useOffset ? &zc->offset : NULL, zc_chunk(zc));
+        if(sent == 0) {
+            break;
+        }
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return zc_would_block() ? 0 : -1;
+        }
+        zc->remaining -= sent;
+    }
+    return 1;
+}
+
+static int zc_send_splice(aesd_zc_t *zc, int sockfd) {
+    if(zc->pipeFds[0] < 0 && pipe2(zc->pipeFds, O_CLOEXEC) < 0) {
+        zc->pipeFds[0] = -1;
+        return -1;
+    }
+    while(1) {
+        if(zc->pending == 0) {
+            if(zc->remaining == 0) {
+                return 1;
+            }
+            ssize_t moved = splice(zc->file, zc->useOffset ? &zc->offset : NULL, zc->pipeFds[1], NULL,
+                                  zc_chunk(zc), SPLICE_F_MOVE);
+            if(moved == 0) {
+                return 1;
+            }
+            if(moved < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            zc->pending = moved;
+            zc->remaining -= moved;
+        }
+        ssize_t sent = splice(zc->pipeFds[0], NULL, sockfd, NULL, zc->pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return zc_would_block() ? 0 : -1;
+        }
+        zc->pending -= sent;
+    }
+}
+
+static int zc_send_copy(aesd_zc_t *zc, int sockfd) {
+    if(zc->copyBuf == NULL && (zc->copyBuf = aesd_slab_alloc(&copyBufs)) == NULL) {
+        return -1;
+    }
+    while(1) {
+        if(zc->pending == 0) {
+            if(zc->remaining == 0) {
+                return 1;
+            }
+            ssize_t bytesRead = zc->useOffset ? pread(zc->file, zc->copyBuf, zc_chunk(zc), zc->offset)
+                                              : read(zc->file, zc->copyBuf, zc_chunk(zc));
+            if(bytesRead == 0) {
+                return 1;
+            }
+            if(bytesRead < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            zc->pending = bytesRead;
+            zc->copyOff = 0;
+            zc->offset += bytesRead;
+            zc->remaining -= bytesRead;
+        }
+        ssize_t sent = send(sockfd, zc->copyBuf + zc->copyOff, zc->pending, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return zc_would_block() ? 0 : -1;
+        }
+        zc->copyOff += sent;
+        zc->pending -= sent;
+    }
+}
+
+int aesd_zc_send(aesd_zc_t *zc, int sockfd) {
+    int ret;
+
+    if(zc->method == AESD_ZC_SENDFILE) {
+        ret = zc_send_file(zc, sockfd);
+        if(ret >= 0 || errno != EINVAL || zc->pending != 0) {
+            return ret;
+        }
+        zc->method = AESD_ZC_SPLICE;
+    }
+    if(zc->method == AESD_ZC_SPLICE) {
+        ret = zc_send_splice(zc, sockfd);
+        // only fall back before anything was taken out of the store
+        if(ret >= 0 || errno != EINVAL || zc->pending != 0) {
+            return ret;
+        }
+        zc->method = AESD_ZC_COPY;
+    }
+    return zc_send_copy(zc, sockfd);
+}
@@ -0,0 +1,55 @@
+#ifndef _AESD_ZEROCOPY_H_
+#define _AESD_ZEROCOPY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef enum {
+    AESD_ZC_SENDFILE,   // regular files: sendfile() straight from the page cache
+    AESD_ZC_SPLICE,     // other stores: splice() through a pipe
+    AESD_ZC_COPY,       // stores without splice support: read() and send()
+} aesd_zc_method_t;
+
+/**
+ * State of one reply streamed from the store to a socket without passing the
+ * bytes through userspace. The transfer can be resumed after the socket
+ * reported EAGAIN, so the same code serves blocking and nonblocking sockets.
+ */
+typedef struct aesd_zc_s aesd_zc_t;
+struct aesd_zc_s {
+    int file;               // store descriptor positioned at the first byte to send
+    off_t offset;           // next byte to send when useOffset is set
+    bool useOffset;         // send from offset instead of the descriptor's file position
+    size_t remaining;       // bytes still to move out of the store, SIZE_MAX for up to end of file
+    aesd_zc_method_t method;
+    int pipeFds[2];         // pipe used by AESD_ZC_SPLICE, -1 until needed
+    size_t pending;         // bytes already taken from the store but not sent yet
+    char *copyBuf;          // bounce buffer used by AESD_ZC_COPY
+    size_t copyOff;
+};
+
+/**
+ * Prepare to send up to @param count bytes (SIZE_MAX for everything up to end of file)
+ * from the current position of @param file. @param file stays owned by the caller.
+ */
+void aesd_zc_init(aesd_zc_t *zc, int file, size_t count);
+
+/**
+ * Like aesd_zc_init() but send from @param offset, leaving the file position of
+ * @param file untouched so the descriptor can be shared between replies.
+ */
+void aesd_zc_init_range(aesd_zc_t *zc, int file, off_t offset, size_t count);
+
+/**
+ * Move as much of the reply to @param sockfd as it accepts.
+ * @return 1 when the reply is complete, 0 if the socket would block, -1 on error.
+ */
+int aesd_zc_send(aesd_zc_t *zc, int sockfd);
+
+/**
+ * Release the pipe and buffers held by @param zc (not the store descriptor).
+ */
+void aesd_zc_release(aesd_zc_t *zc);
+
+#endif
@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/**
+ * Load generator for aesdsocket. Every worker repeatedly connects, sends one packet,
+ * reads the history the server replies with up to the close, and checks that the
+ * packet is in it. Against a server keeping connections alive, a worker instead
+ * sends all its packets on one connection, each followed by AESDCHAR_STATS: replies
+ * come back in order, so the history replied to a packet ends where the stats start,
+ * and can be no longer than the history they describe. With a target rate, the latency of a packet counts from the time
+ * it was scheduled rather than sent, so a server falling behind shows up in the
+ * percentiles instead of silently lowering the rate. The server's AESDCHAR_STATS
+ * before and after the run tell how durable the replied packets were.
+ */
+
+typedef struct {
+    const char *host;
+    int port;
+    int connections;
+    unsigned durationSec;
+    size_t maxPackets;      // 0 for no limit besides the duration
+    size_t packetSize;
+    double rate;            // packets per second over all workers, 0 for as fast as possible
+    bool verify;
+    bool keepAlive;         // one connection per worker, the server does not close it
+    unsigned timeoutMs;     // time a reply may take past the end of the run
+} bench_config_t;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    uint64_t *latencies;    // nanoseconds
+    size_t count;
+    size_t cap;
+    size_t errors;
+    size_t mismatches;
+    size_t bytesOut;
+    size_t bytesIn;
+} bench_worker_t;
+
+static bench_config_t config = {
+    .host = "127.0.0.1",
+    .port = 9000,
+    .connections = 8,
+    .durationSec = 10,
+    .maxPackets = 0,
+    .packetSize = 64,
+    .rate = 0,
+    .verify = true,
+    .keepAlive = false,
+    .timeoutMs = 5000,
+};
+
+typedef struct {
+    bool known;             // the server reported its sync policy
+    char policy[16];
+    size_t start;
+    size_t end;
+    size_t durable;
+    size_t syncs;
+} bench_durability_t;
+
+static struct sockaddr_in serverAddr;
+static uint64_t startNs;
+static uint64_t stopNs;
+static size_t packetsStarted;   // shared with every worker to honour maxPackets
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+    struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static bool record_latency(bench_worker_t *w, uint64_t ns) {
+    if(w->count == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 4096;
+        uint64_t *grown = realloc(w->latencies, cap * sizeof(uint64_t));
+        if(grown == NULL) {
+            return false;
+        }
+        w->latencies = grown;
+        w->cap = cap;
+    }
+    w->latencies[w->count++] = ns;
+    return true;
+}
+
+/**
+ * Build a packet of config.packetSize bytes, newline included, unique to @param w and
+ * @param seq as long as the size leaves room for the tag.
+ * @return its length.
+ */
+static size_t build_packet(char *packet, bench_worker_t *w, size_t seq) {
+    int len = snprintf(packet, config.packetSize + 1, "aesdbench %d.%zu ", w->id, seq);
+    size_t tagLen = (size_t)len < config.packetSize ? (size_t)len : config.packetSize - 1;
+
+    memset(packet + tagLen, 'x', config.packetSize - 1 - tagLen);
+    packet[config.packetSize - 1] = '\n';
+    return config.packetSize;
+}
+
+/**
+ * @return the time by which a reply to a request sent at @param now must have
+ *   arrived: the end of the run, or @param now if that is later or there is none,
+ *   plus the reply timeout.
+ */
+static uint64_t reply_deadline(uint64_t now) {
+    uint64_t from = stopNs != UINT64_MAX && stopNs > now ? stopNs : now;
+    return from + (uint64_t)config.timeoutMs * 1000000;
+}
+
+/**
+ * Find the reply to AESDCHAR_STATS that @param reply of @param len bytes ends with,
+ * and parse it into @param d.
+ * @return the offset it starts at, or SIZE_MAX if @param reply does not end with one.
+ */
+static size_t find_stats(const char *reply, size_t len, bench_durability_t *d) {
+    static const int statsLines = 8;
+    size_t pos = len;
+
+    if(len == 0 || reply[len - 1] != '\n') {
+        return SIZE_MAX;
+    }
+    for(int lines = 0; lines < statsLines; lines++) {
+        const char *newline = pos > 1 ? memrchr(reply, '\n', pos - 1) : NULL;
+        pos = newline != NULL ? (size_t)(newline - reply) + 1 : 0;
+        if(pos == 0 && lines < statsLines - 1) {
+            return SIZE_MAX;
+        }
+    }
+    char text[256];
+    int parsed = 0;
+    if(len - pos >= sizeof(text)) {
+        return SIZE_MAX;
+    }
+    memcpy(text, reply + pos, len - pos);
+    text[len - pos] = '\0';
+    memset(d, 0, sizeof(*d));
+    if(sscanf(text, "start %zu\nend %zu\ncached_from %*u\nfirst_record %*u\nrecords %*u\nsync %15s\n"
+                    "durable %zu\nsyncs %zu\n%n",
+              &d->start, &d->end, d->policy, &d->durable, &d->syncs, &parsed) != 5 ||
+       (size_t)parsed != len - pos) {
+        return SIZE_MAX;
+    }
+    d->known = true;
+    return pos;
+}
+
+/**
+ * @return a connection to the server, or -1 if it could not be made.
+ */
+static int bench_connect(void) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+
+    if(fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(fd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    for(size_t sent = 0; sent < len;) {
+        ssize_t n = send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+/**
+ * Read from @param fd into @param reply until the server closes the connection or,
+ * with @param stats, until what arrived ends with the reply to AESDCHAR_STATS, which
+ * is parsed into it.
+ * @return 0 on success, -1 on a connection error, or if @param deadline passed first.
+ */
+static int receive(int fd, uint64_t deadline, bench_durability_t *stats, char **reply, size_t *replyCap,
+                   size_t *replyLen) {
+    *replyLen = 0;
+    while(stats == NULL || find_stats(*reply, *replyLen, stats) == SIZE_MAX) {
+        if(*replyCap - *replyLen < 65536) {
+            size_t cap = *replyCap ? *replyCap * 2 : 1 << 20;
+            char *grown = realloc(*reply, cap);
+            if(grown == NULL) {
+                return -1;
+            }
+            *reply = grown;
+            *replyCap = cap;
+        }
+        uint64_t now = now_ns();
+        if(now >= deadline) {
+            return -1;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+        if(ready <= 0) {
+            if(ready < 0 && errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+        // acknowledge at once, Nagle holds back the stats reply until the packet reply is acknowledged
+        if(stats != NULL) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+        }
+        ssize_t n = recv(fd, *reply + *replyLen, *replyCap - *replyLen, 0);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0) {
+            return -1;
+        }
+        if(n == 0) {
+            return stats == NULL ? 0 : -1;
+        }
+        *replyLen += n;
+    }
+    return 0;
+}
+
+/**
+ * Send @param packet on a new connection and read the whole reply into @param reply.
+ * @return 0 on success, -1 on any connection error or if the reply timed out.
+ */
+static int exchange(bench_worker_t *w, const char *packet, size_t len, char **reply, size_t *replyCap,
+                    size_t *replyLen) {
+    int fd = bench_connect();
+
+    if(fd < 0) {
+        return -1;
+    }
+    if(send_all(fd, packet, len) < 0) {
+        close(fd);
+        return -1;
+    }
+    w->bytesOut += len;
+    int ret = receive(fd, reply_deadline(now_ns()), NULL, reply, replyCap, replyLen);
+    close(fd);
+    if(ret < 0) {
+        return -1;
+    }
+    w->bytesIn += *replyLen;
+    return 0;
+}
+
+/**
+ * Send @param packet of @param len bytes, followed by AESDCHAR_STATS, on the kept
+ * connection *@param fd, making it first if there is none, and read the reply to the
+ * packet into @param reply. The connection is closed again after an error.
+ * @return 0 on success, 1 if the reply is longer than the history it came from,
+ *   -1 on any connection error or if the replies timed out.
+ */
+static int exchange_kept(bench_worker_t *w, int *fd, char *packet, size_t len, char **reply, size_t *replyCap,
+                         size_t *replyLen) {
+    static const char command[] = "AESDCHAR_STATS\n";
+    bench_durability_t stats;
+
+    if(*fd < 0 && (*fd = bench_connect()) < 0) {
+        return -1;
+    }
+    // packet has room for the command after it
+    memcpy(packet + len, command, sizeof(command) - 1);
+    if(send_all(*fd, packet, len + sizeof(command) - 1) < 0 ||
+       receive(*fd, reply_deadline(now_ns()), &stats, reply, replyCap, replyLen) < 0) {
+        close(*fd);
+        *fd = -1;
+        return -1;
+    }
+    w->bytesOut += len + sizeof(command) - 1;
+    w->bytesIn += *replyLen;
+    *replyLen = find_stats(*reply, *replyLen, &stats);
+    return *replyLen <= stats.end - stats.start ? 0 : 1;
+}
+
+static void *worker_run(void *ptr) {
+    bench_worker_t *w = (bench_worker_t *)ptr;
+    char *packet = malloc(config.packetSize + 64);    // room for the command of a kept connection
+    int fd = -1;
+    char *reply = NULL;
+    size_t replyCap = 0;
+    size_t replyLen;
+    // each worker takes an equal share of the rate, offset so the workers interleave
+    uint64_t interval = config.rate > 0 ? (uint64_t)(1e9 * config.connections / config.rate) : 0;
+    uint64_t scheduled = startNs + interval * w->id / config.connections;
+
+    if(packet == NULL) {
+        w->errors++;
+        return NULL;
+    }
+    for(size_t seq = 0;; seq++) {
+        if(interval > 0) {
+            sleep_until(scheduled);
+        }
+        uint64_t begin = interval > 0 ? scheduled : now_ns();
+        if(now_ns() >= stopNs) {
+            break;
+        }
+        if(config.maxPackets > 0 &&
+           __atomic_fetch_add(&packetsStarted, 1, __ATOMIC_RELAXED) >= config.maxPackets) {
+            break;
+        }
+        scheduled += interval;
+
+        size_t len = build_packet(packet, w, seq);
+        int ret = config.keepAlive ? exchange_kept(w, &fd, packet, len, &reply, &replyCap, &replyLen)
+                                   : exchange(w, packet, len, &reply, &replyCap, &replyLen);
+        if(ret < 0) {
+            w->errors++;
+            continue;
+        }
+        uint64_t end = now_ns();
+        if(config.verify && (ret > 0 || replyLen == 0 || reply[replyLen - 1] != '\n' ||
+                             memmem(reply, replyLen, packet, len) == NULL)) {
+            w->mismatches++;
+        }
+        if(!record_latency(w, end - begin)) {
+            w->errors++;
+        }
+    }
+    if(fd >= 0) {
+        close(fd);
+    }
+    free(reply);
+    free(packet);
+    return NULL;
+}
+
+/**
+ * Ask the server for its AESDCHAR_STATS and keep the durability lines in @param d,
+ * without waiting for a server keeping connections alive to close.
+ */
+static void query_durability(bench_durability_t *d) {
+    static const char command[] = "AESDCHAR_STATS\n";
+    char *reply = NULL;
+    size_t replyCap = 0;
+    size_t replyLen;
+
+    memset(d, 0, sizeof(*d));
+    int fd = bench_connect();
+    if(fd < 0) {
+        return;
+    }
+    if(send_all(fd, command, sizeof(command) - 1) < 0 ||
+       receive(fd, now_ns() + (uint64_t)config.timeoutMs * 1000000, d, &reply, &replyCap, &replyLen) < 0) {
+        memset(d, 0, sizeof(*d));
+    }
+    close(fd);
+    free(reply);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t count, double p) {
+    if(count == 0) {
+        return 0;
+    }
+    size_t idx = (size_t)(p * (count - 1) + 0.5);
+    return sorted[idx] / 1e3;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-d seconds] [-n packets] [-s size]\n"
+                    "          [-r rate] [-k] [-t msec] [--no-verify]\n"
+                    "  -H, --host ADDR    server address (default %s)\n"
+                    "  -p, --port N       server port (default %d)\n"
+                    "  -c, --connections N  concurrent connections (default %d)\n"
+                    "  -d, --duration S   run time in seconds (default %u)\n"
+                    "  -n, --packets N    stop after N packets in total\n"
+                    "  -s, --size B       packet size, newline included (default %zu)\n"
+                    "  -r, --rate R       target packets per second over all connections,\n"
+                    "                     0 for as fast as possible (default)\n"
+                    "  -k, --keep-alive   send every packet of a connection on it, for a server run with -k\n"
+                    "  -t, --timeout MS   time a reply may take past the end of the run, or past its\n"
+                    "                     packet without -d, before it counts as an error (default %u)\n"
+                    "      --no-verify    do not check that each reply holds its packet\n",
+            prog, config.host, config.port, config.connections, config.durationSec, config.packetSize,
+            config.timeoutMs);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longOptions[] = {
+        { "host",        required_argument, NULL, 'H' },
+        { "port",        required_argument, NULL, 'p' },
+        { "connections", required_argument, NULL, 'c' },
+        { "duration",    required_argument, NULL, 'd' },
+        { "packets",     required_argument, NULL, 'n' },
+        { "size",        required_argument, NULL, 's' },
+        { "rate",        required_argument, NULL, 'r' },
+        { "keep-alive",  no_argument,       NULL, 'k' },
+        { "timeout",     required_argument, NULL, 't' },
+        { "no-verify",   no_argument,       NULL, 'V' },
+        { NULL,          0,                 NULL, 0 }
+    };
+    int opt;
+
+    while((opt = getopt_long(argc, argv, "H:p:c:d:n:s:r:kt:", longOptions, NULL)) != -1) {
+        switch(opt) {
+            case 'H':
+                config.host = optarg;
+                break;
+            case 'p':
+                config.port = atoi(optarg);
+                break;
+            case 'c':
+                config.connections = atoi(optarg);
+                break;
+            case 'd':
+                config.durationSec = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                config.maxPackets = strtoull(optarg, NULL, 0);
+                break;
+            case 's':
+                config.packetSize = strtoull(optarg, NULL, 0);
+                break;
+            case 'r':
+                config.rate = atof(optarg);
+                break;
+            case 'k':
+                config.keepAlive = true;
+                break;
+            case 't':
+                config.timeoutMs = strtoul(optarg, NULL, 0);
+                break;
+            case 'V':
+                config.verify = false;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(config.connections < 1 || config.port < 1 || config.port > 65535 || config.packetSize < 2 ||
+       config.rate < 0 || (config.durationSec == 0 && config.maxPackets == 0)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(config.port);
+    if(inet_pton(AF_INET, config.host, &serverAddr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid server address %s\n", config.host);
+        return EXIT_FAILURE;
+    }
+
+    bench_worker_t *workers = calloc(config.connections, sizeof(bench_worker_t));
+    if(workers == NULL) {
+        perror("Unable to allocate workers");
+        return EXIT_FAILURE;
+    }
+    bench_durability_t before;
+    bench_durability_t after;
+    query_durability(&before);
+    startNs = now_ns();
+    stopNs = config.durationSec > 0 ? startNs + (uint64_t)config.durationSec * 1000000000 : UINT64_MAX;
+    int started = 0;
+    for(; started < config.connections; started++) {
+        workers[started].id = started;
+        if(pthread_create(&workers[started].thread, NULL, worker_run, &workers[started]) != 0) {
+            perror("Unable to start worker");
+            break;
+        }
+    }
+
+    size_t total = 0;
+    size_t errors = 0;
+    size_t mismatches = 0;
+    size_t bytesOut = 0;
+    size_t bytesIn = 0;
+    for(int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].count;
+        errors += workers[i].errors;
+        mismatches += workers[i].mismatches;
+        bytesOut += workers[i].bytesOut;
+        bytesIn += workers[i].bytesIn;
+    }
+    double elapsed = (now_ns() - startNs) / 1e9;
+    query_durability(&after);
+
+    uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+    if(all == NULL) {
+        perror("Unable to allocate latencies");
+        return EXIT_FAILURE;
+    }
+    size_t n = 0;
+    for(int i = 0; i < started; i++) {
+        memcpy(all + n, workers[i].latencies, workers[i].count * sizeof(uint64_t));
+        n += workers[i].count;
+        free(workers[i].latencies);
+    }
+    qsort(all, n, sizeof(uint64_t), compare_u64);
+
+    printf("connections  %d\n", started);
+    printf("packets      %zu in %.2fs, %zu error(s), %zu mismatch(es)\n", total, elapsed, errors, mismatches);
+    printf("throughput   %.1f packets/s, %.2f MB/s sent, %.2f MB/s received\n",
+           total / elapsed, bytesOut / elapsed / 1e6, bytesIn / elapsed / 1e6);
+    printf("latency us   p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           percentile_us(all, n, 0.5), percentile_us(all, n, 0.99), percentile_us(all, n, 0.999),
+           n > 0 ? all[n - 1] / 1e3 : 0.0);
+    if(before.known && after.known) {
+        size_t syncs = after.syncs - before.syncs;
+        printf("durability   sync %s, %zu sync(s), %.1f packets/sync, %zu byte(s) not durable at the end\n",
+               after.policy, syncs, syncs > 0 ? (double)total / syncs : 0.0, after.end - after.durable);
+    }
+
+    free(all);
+    free(workers);
+    return errors > 0 || mismatches > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<unistd.h>
 #include<sys/socket.h>
@@ -6,51 +7,100 @@
 #include<syslog.h>
 #include<arpa/inet.h>
 #include<stdlib.h>
+#include<stdint.h>
 #include<signal.h>
 #include<stdbool.h>
 #include<sys/stat.h>
 #include<pthread.h>
 #include<time.h>
 #include<sys/time.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
-
-
-#define USE_AESD_CHAR_DEVICE 1
-
-#ifdef USE_AESD_CHAR_DEVICE
+#include<getopt.h>
+#include<errno.h>
+#include<poll.h>
+#include<sys/eventfd.h>
 #include<fcntl.h>
-#endif
-
-int sockfd;
-
-#ifndef USE_AESD_CHAR_DEVICE //change it later
-const char *filepath = "/var/tmp/aesdsocketdata";
-#else
-const char *filepath = "/dev/aesdchar";
-#endif
-
-#ifndef USE_AESD_CHAR_DEVICE // change it later
-FILE *file;
-#else
-int file;
-#endif
-
-pthread_mutex_t file_mutex;
+#include "aesdsocket.h"
+#include "aesd_epoll.h"
+#include "aesd_pool.h"
+#include "aesd_uring.h"
+#include "aesd_history.h"
+#include "aesd_packet.h"
+#include "aesd_framer.h"
+#include "aesd_timestamp.h"
+#include "aesd_registry.h"
+#include "aesd_slab.h"
+#include "aesd_metrics.h"
+#include "aesd_outq.h"
+#include "aesd_store.h"
+#include "aesd_subscribe.h"
+
+#define RECV_MIN_SIZE 1024  // smallest receive, larger ones as the packet buffer grows
+
+int *listenFds;      // one listener, or one per loop with SO_REUSEPORT
+int numListeners;
+
+aesd_store_t store;
+aesd_history_t history;
+aesd_timestamp_t *timestamp;
+aesd_metrics_server_t *metricsServer;
+aesd_subscribe_server_t *subscribeServer;
+aesd_registry_t registry;
+int stopFd = -1;
+
+aesd_config_t config = {
+    .deamonize = false,
+    .mode = AESD_MODE_THREAD,
+    .numLoops = 2,
+    .numWorkers = 8,
+    .queueDepth = 64,
+    .queueFullWait = false,
+    .maxCached = 0,
+    .keepAlive = false,
+    .commitWindowUs = 0,
+    .commitBatch = 64,
+    .syncPolicy = AESD_SYNC_NONE,
+    .syncIntervalMs = 10,
+    .syncBytes = 0,
+    .checkpointSec = 10,
+    .backlog = SOMAXCONN,
+    .reusePort = false,
+    .timestampSec = 10,
+    .drainTimeoutSec = 5,
+    .statsPort = 0,
+    .statsSocket = NULL,
+    .writeTimeoutMs = 30000,
+    .maxQueued = 0,
+    .subscribePort = 0,
+    .maxLag = 1024 * 1024,
+    .lagPolicy = AESD_LAG_SKIP,
+    .store = {
+        .kind = AESD_STORE_AUTO,
+        .path = NULL,
+        .memorySize = 0,
+        .segmentSize = 0,
+        .retainBytes = 0,
+        .retainRecords = 0,
+    },
+};
 
 void *handle_client(void *ptr);
 void signalInterruptHandler(int signo);
-int createTCPServer(int deamonize);
-
-typedef struct node {
-    pthread_t tid;
-    struct node *next;
-} Node;
+int createTCPServer(void);
 
 typedef struct {
     int client_sockfd;
     struct sockaddr_in client_addr;
 } client_info_t;
 
+static aesd_slab_t clientInfoSlab = AESD_SLAB_INITIALIZER("client info", sizeof(client_info_t));
+
+typedef struct {
+    pthread_t tid;
+    int listenFd;
+    aesd_pool_t *pool;      // hand connections to the pool instead of a thread each
+    int ret;
+} accept_loop_t;
+
 void *handle_client(void *ptr) {
     client_info_t *client_info = (client_info_t *)ptr;
     int client_sockfd = client_info->client_sockfd;
@@ -58,7 +108,7 @@ void *handle_client(void *ptr) {
     socklen_t client_len = sizeof(client_addr);
     char client_ip[INET6_ADDRSTRLEN];
 
-    free(client_info);
+    aesd_slab_free(&clientInfoSlab, client_info);
     if(getpeername(client_sockfd, (struct sockaddr *)&client_addr, &client_len) == 0) {
         if(client_addr.sin_family == AF_INET) {
             struct sockaddr_in *ipv4 = (struct sockaddr_in *)&client_addr;
@@ -73,220 +123,209 @@ void *handle_client(void *ptr) {
         return NULL;
     }
 
+    aesd_registry_entry_t entry;
+    if(!aesd_registry_add(&registry, &entry, client_sockfd)) {
+        close(client_sockfd);
+        return NULL;
+    }
     syslog(LOG_INFO, "Accepted connection from %s", client_ip);
 
-    char *buffer = NULL;
-    // ssize_t num_bytes = 0;
+    aesd_framer_t framer;
+    aesd_outq_t out;
     ssize_t recv_bytes = 0;
-    struct aesd_seekto seekto;
-    const char *pattern = "AESDCHAR_IOCSEEKTO:";
-    uint32_t X, Y;
-    bool needToReopen = 0;
-    int connection_closed = 0;
-    int received_error = 0;
-    bool isNewLineFound = 0;
-
-    buffer = malloc(1024 * sizeof(char));
-    if (!buffer) {
+    bool framed = false;        // without keep-alive, the one packet of the connection is complete
+    bool peerClosed = false;
+
+    if(aesd_framer_init(&framer, 2 * RECV_MIN_SIZE, !config.keepAlive) < 0) {
         syslog(LOG_INFO, "Unable to allocate space on heap");
         printf("Unable to allocate space on heap\n");
-        close(sockfd);
+        aesd_registry_remove(&registry, &entry);
+        close(client_sockfd);
         return NULL;
     }
+    aesd_outq_init(&out);
 
-    memset(buffer, 0, 1024 * sizeof(char));
-    file = open(filepath, O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
-    while(!isNewLineFound) {
-        recv_bytes = recv(client_sockfd, buffer, 1024, 0);
-        if(recv_bytes == 0) {
-            syslog(LOG_INFO, "Closed connection from %s", client_ip);
-            connection_closed = 1;
-        } else if(recv_bytes < 0) {
-            syslog(LOG_ERR, "Received error");
-            perror("Received error\n");
-            received_error = 1;
-        } else if(received_error == 1 || connection_closed == 1) {
-            free(buffer);
-            buffer = NULL;
-            needToReopen = 0;
-            // printf("File closed due to receive error\n");
-            close(file);
-            break;
-        } else {
-            char * match = strstr(buffer, pattern);
-            if(match) {
-                if(sscanf(match, "AESDCHAR_IOCSEEKTO:%u,%u", &X, &Y) == 2) {
-                    seekto.write_cmd = X;
-                    seekto.write_cmd_offset = Y;
-                    ioctl(file, AESDCHAR_IOCSEEKTO, &seekto);
-                    // printf("IOCTL Issued\n");
-                    needToReopen = 0;
-                    break;
+    while(1) {
+        // queue a reply for every complete packet, in order; without keep-alive everything
+        // up to the last newline of the first complete batch is one packet
+        const char *packet;
+        size_t packetLen;
+        bool failed = false;
+        while(!framed && aesd_framer_next(&framer, &packet, &packetLen)) {
+            aesd_history_reply_t reply;
+
+            if(aesd_packet_commit(packet, packetLen, client_ip, &reply) < 0) {
+                failed = true;
+                break;
+            }
+            if(aesd_outq_push(&out, &reply, framer.packetSince, config.maxQueued) < 0) {
+                if(errno == ENOBUFS) {
+                    syslog(LOG_WARNING, "Disconnecting %s, more than %zu bytes of replies queued", client_ip,
+                           config.maxQueued);
+                    aesd_metrics_add(AESD_METRIC_SLOW_READERS, 1);
+                    aesd_outq_abort(client_sockfd);
+                } else {
+                    syslog(LOG_ERR, "Unable to allocate memory for a reply to %s", client_ip);
                 }
+                failed = true;
+                break;
             }
+            framed = !config.keepAlive;
+        }
+        if(failed) {
+            break;
+        }
 
-            write(file, buffer, recv_bytes);
-            if(memchr(buffer, '\n', 1024*sizeof(char)) != NULL) {
-                isNewLineFound = 1;
-                lseek(file, 0, SEEK_SET);
-                needToReopen = 1;
-                close(file);
-            } else {
-                memset(buffer, 0, 1024*sizeof(char));
-            }
+        int sent = aesd_outq_send(&out, client_sockfd);
+        if(sent < 0) {
+            syslog(LOG_ERR, "Unable to send history to %s", client_ip);
+            break;
+        }
+        if(sent > 0 && (framed || peerClosed)) {
+            break;
+        }
+        uint64_t now = aesd_metrics_now();
+        if(aesd_outq_stalled(&out, now, config.writeTimeoutMs)) {
+            syslog(LOG_WARNING, "Disconnecting %s, no reply bytes read for %u ms", client_ip, config.writeTimeoutMs);
+            aesd_metrics_add(AESD_METRIC_SLOW_READERS, 1);
+            aesd_outq_abort(client_sockfd);
+            break;
         }
-    }
 
-    pthread_mutex_lock(&file_mutex);
-    size_t bufferSize = 1024; // or any other size you want
-    char* writeBuf = malloc(bufferSize * sizeof(char));
-    if(writeBuf == NULL) {
-        // perror("Unable to allocate memory for writeBuf");
-        pthread_mutex_unlock(&file_mutex);
-        return NULL;
-    }
+        struct pollfd pfd = { .fd = client_sockfd, .events = 0 };
+        if(!framed && !peerClosed) {
+            pfd.events |= POLLIN;
+        }
+        if(sent == 0) {
+            pfd.events |= POLLOUT;
+        }
+        if(poll(&pfd, 1, aesd_outq_timeout_ms(&out, now, config.writeTimeoutMs)) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Unable to poll the connection of %s", client_ip);
+            break;
+        }
+        if(!(pfd.events & POLLIN) || !(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
 
-    ssize_t bytesRead;
-    if(needToReopen) {
-        file = open(filepath, O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    }
-    while ((bytesRead = read(file, writeBuf, bufferSize)) > 0) {
-        send(client_sockfd, writeBuf, bytesRead, 0);
+        size_t avail;
+        char *space = aesd_framer_reserve(&framer, RECV_MIN_SIZE, &avail);
+        if(space == NULL) {
+            syslog(LOG_ERR, "Unable to grow receive buffer for %s", client_ip);
+            break;
+        }
+        recv_bytes = recv(client_sockfd, space, avail, 0);
+        if(recv_bytes < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Received error");
+            perror("Received error\n");
+            break;
+        }
+        if(recv_bytes == 0) {
+            // answer what was already received, then close
+            peerClosed = true;
+            continue;
+        }
+        aesd_metrics_add(AESD_METRIC_BYTES_IN, recv_bytes);
+        aesd_framer_received(&framer, recv_bytes);
     }
-    close(file);
-    free(writeBuf); // don't forget to free the memory when you're done with it
-    pthread_mutex_unlock(&file_mutex);
-    free(buffer);
-    buffer = NULL;
+    aesd_outq_destroy(&out);
+    aesd_framer_destroy(&framer);
 
     syslog(LOG_INFO, "Closed connection from %s", client_ip);
+    aesd_registry_remove(&registry, &entry);
     close(client_sockfd);  
     return NULL;
 }
 
-void signalInterruptHandler(int signo) {
-    if((signo == SIGTERM) || (signo == SIGINT)) {
-        printf("Gracefully handling SIGTERM\n");
-        syslog(LOG_INFO,  "Caught signal, exiting");
-        close(sockfd);
-        close(file);
-        pthread_mutex_destroy(&file_mutex);
-        closelog();
-        exit(EXIT_SUCCESS);
+static void closeListeners(void) {
+    for(int i = 0; i < numListeners; i++) {
+        close(listenFds[i]);
     }
 }
 
-int createTCPServer(int deamonize) {
-    signal(SIGINT, signalInterruptHandler);
-    signal(SIGTERM, signalInterruptHandler);
-
-    file = open(filepath, O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if(file < 0) {
-        perror("Unable to open or create the file");
-        return -1;
-    }  
-    close(file);
-
-    openlog("aesdsocket.c", LOG_CONS | LOG_PID, LOG_USER);
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(sockfd == -1) {
+/**
+ * Create a socket listening on port 9000, sharing the port with the other listeners
+ * when @param reusePort is set so the kernel spreads connections across them.
+ * @return the listening socket, or -1 on failure.
+ */
+static int createListener(bool reusePort) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
         syslog(LOG_ERR, "Unable to create TCP Socket");
         perror("Unable to create TCP Socket\n");
-
-        close(file);
-        closelog();
         return -1;
     }
 
     int enable = 1;
-    if(setsockopt(sockfd, SOL_SOCKET,SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+    if(setsockopt(fd, SOL_SOCKET,SO_REUSEADDR, &enable, sizeof(int)) < 0) {
         syslog(LOG_ERR, "setsockopt(SO_REUSEADDR) failed");
         perror("setsockopt(SO_REUSEADDR) failed");
     }
+    if(reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+        syslog(LOG_ERR, "setsockopt(SO_REUSEPORT) failed");
+        perror("setsockopt(SO_REUSEPORT) failed");
+        close(fd);
+        return -1;
+    }
 
     struct sockaddr_in addr;
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_family = AF_INET;
     addr.sin_port = htons(9000);
 
-    if(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
         syslog(LOG_ERR, "TCP Socket bind failure");
         perror("TCP Socket bind failure\n");
-        close(sockfd);
-        close(file);
-        closelog();        
+        close(fd);
         return -1;
     }
 
-    if(listen(sockfd, 5) == -1) {
+    if(listen(fd, config.backlog) == -1) {
         syslog(LOG_ERR, "Unable to listen at created TCP socket");
         perror("Unable to listen at created TCP socket\n");
-        close(sockfd);
-        close(file);
-        closelog();        
+        close(fd);
         return -1;
     }
+    return fd;
+}
 
-    if(deamonize == 1) {
-        pid_t pid = fork();
-        if(pid < 0) {
-            printf("failed to fork\n"); 
-            close(sockfd);
-            #ifndef USE_AESD_CHAR_DEVICE // change it later
-            fclose(file);
-            #else
-            close(file);
-            #endif
-            closelog();  
-            exit(EXIT_FAILURE);      
-        }
-        if(pid > 0 ) {
-            printf("Running as a deamon\n");
-            exit(EXIT_SUCCESS);
-        }
-        umask(0);
-        if(setsid() < 0) {
-            printf("Failed to create SID for child\n");
-            close(sockfd);
-            close(file);
-            closelog(); 
-            exit(EXIT_FAILURE);
-        } 
-        if(chdir("/") < 0) {
-            printf("Unable to change directory to root\n");
-            close(sockfd);
-            close(file);
-            closelog(); 
-            exit(EXIT_FAILURE);
-        }
-
-        close(STDIN_FILENO);
-        close(STDOUT_FILENO);
-        close(STDERR_FILENO);        
-    }
+static bool stopRequested(void) {
+    struct pollfd pfd = { .fd = stopFd, .events = POLLIN };
+    return poll(&pfd, 1, 0) > 0;
+}
 
-    signal(SIGALRM, signalInterruptHandler);
-    alarm(10);
-    syslog(LOG_INFO, "TCP server listening at port %d", ntohs(addr.sin_port));
+/**
+ * Accept connections on one listener for the thread and pool modes.
+ */
+static void *acceptLoop(void *ptr) {
+    accept_loop_t *loop = (accept_loop_t *)ptr;
 
-    int num_threads = 0;
-    Node *head = NULL;
-    
     while(1) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
 
-        int client_sockfd = accept(sockfd, (struct sockaddr *)&client_addr, &client_len);
+        // handle_client() only sends nonblocking, a client that stops reading cannot hold its thread
+        int client_sockfd = accept4(loop->listenFd, (struct sockaddr *)&client_addr, &client_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
         if(client_sockfd == -1) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if(stopRequested()) {
+                break;
+            }
             syslog(LOG_ERR, "Unable to accept the client's connection");
             perror("Unable to accept the client's connection\n");
-            close(file);
-            closelog();            
-            return -1;
+            loop->ret = -1;
+            break;
         }      
 
-        client_info_t *client_info = malloc(sizeof(client_info_t));
+        client_info_t *client_info = aesd_slab_alloc(&clientInfoSlab);
         if(client_info == NULL) {
             syslog(LOG_ERR, "Unable to allocate memory for client_info");
             perror("Unable to allocate memory for client_info");
@@ -297,58 +336,594 @@ int createTCPServer(int deamonize) {
         client_info->client_sockfd = client_sockfd;
         client_info->client_addr = client_addr;
 
-        Node *n = malloc(sizeof(Node)); 
-        if(n == NULL) {
-            syslog(LOG_ERR, "Failed to allocate memory for thread");
-            perror("Failed to allocate memory for thread\n");
-            close(client_sockfd);
-            free(client_info);
+        if(loop->pool != NULL) {
+            if(!aesd_pool_submit(loop->pool, client_info, config.queueFullWait)) {
+                syslog(LOG_WARNING, "Worker queue full, rejecting connection");
+                close(client_sockfd);
+                aesd_slab_free(&clientInfoSlab, client_info);
+            }
             continue;
         }
 
-        if(pthread_create(&(n->tid), NULL, handle_client, (void *) client_info) != 0) {
+        // the thread is detached and accounted for by the registry until it finishes
+        if(aesd_registry_spawn(&registry, handle_client, client_info) < 0) {
             syslog(LOG_ERR, "Unable to create thread");
             perror("Unable to create thread");
             close(client_sockfd);
-            free(client_info);
-            continue;
+            aesd_slab_free(&clientInfoSlab, client_info);
         }
-        n->next = head;
-        head = n;
-        num_threads++;
     }
+    return NULL;
+}
 
-    Node *current = head;
-    Node *next;
+void signalInterruptHandler(int signo) {
+    if((signo == SIGTERM) || (signo == SIGINT)) {
+        // only async-signal-safe calls here, shutdownWaiter() does the actual work
+        uint64_t one = 1;
+        ssize_t ret = write(stopFd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+/**
+ * Stop accepting once a signal arrived, then let the open connections finish within
+ * config.drainTimeoutSec. The engines return when their last connection is gone.
+ */
+static void *shutdownWaiter(void *ptr) {
+    struct pollfd pfd = { .fd = stopFd, .events = POLLIN };
+    (void)ptr;
 
-    while(current != NULL) {
-        if (pthread_join(current->tid, NULL) != 0) {
-            printf("Failed to join thread \n");
+    // poll only, the engines watch the same eventfd
+    while(poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+    }
+    printf("Gracefully handling SIGTERM\n");
+    syslog(LOG_INFO,  "Caught signal, exiting with %zu connection(s) open", aesd_registry_live(&registry));
+    for(int i = 0; i < numListeners; i++) {
+        shutdown(listenFds[i], SHUT_RD);
+    }
+    if(aesd_registry_drain(&registry, config.drainTimeoutSec) < 0) {
+        syslog(LOG_ERR, "Connections still running after shutdown");
+        return (void *)-1L;
+    }
+    return NULL;
+}
+
+/**
+ * Serve connections with the configured engine until it stops after a signal.
+ */
+static int serveConnections(void) {
+    // each loop takes its own listener, or they all share the single one
+    int *loopFds = malloc(config.numLoops * sizeof(int));
+    if(loopFds == NULL) {
+        syslog(LOG_ERR, "Unable to allocate listeners");
+        return -1;
+    }
+    for(int i = 0; i < config.numLoops; i++) {
+        loopFds[i] = listenFds[i % numListeners];
+    }
+
+    // event loops hand their packets to the commit thread instead of waiting for a commit
+    if((config.mode == AESD_MODE_URING || config.mode == AESD_MODE_EPOLL) &&
+       aesd_history_start_committer(&history) < 0) {
+        free(loopFds);
+        return -1;
+    }
+    int ret = AESD_URING_UNSUPPORTED;
+    if(config.mode == AESD_MODE_URING) {
+        ret = aesd_uring_run(loopFds, config.numLoops);
+        if(ret == AESD_URING_UNSUPPORTED) {
+            syslog(LOG_WARNING, "io_uring not supported by this kernel, falling back to epoll");
+            config.mode = AESD_MODE_EPOLL;
+        }
+    }
+    if(config.mode == AESD_MODE_EPOLL) {
+        ret = aesd_epoll_run(loopFds, config.numLoops);
+    }
+    free(loopFds);
+    if(config.mode == AESD_MODE_URING || config.mode == AESD_MODE_EPOLL) {
+        return ret;
+    }
+
+    aesd_pool_t *pool = NULL;
+    if(config.mode == AESD_MODE_POOL) {
+        pool = aesd_pool_create(config.numWorkers, config.queueDepth, handle_client);
+        if(pool == NULL) {
+            syslog(LOG_ERR, "Unable to start worker pool");
+            return -1;
+        }
+        syslog(LOG_INFO, "Serving connections with %d pool worker(s), queue depth %d",
+               pool->numWorkers, config.queueDepth);
+    }
+
+    accept_loop_t *loops = calloc(numListeners, sizeof(accept_loop_t));
+    int started = 0;
+    ret = loops == NULL ? -1 : 0;
+    for(; loops != NULL && started < numListeners; started++) {
+        loops[started].listenFd = listenFds[started];
+        loops[started].pool = pool;
+        if(pthread_create(&loops[started].tid, NULL, acceptLoop, &loops[started]) != 0) {
+            syslog(LOG_ERR, "Unable to start accept loop %d", started);
+            break;
+        }
+    }
+    if(started == 0) {
+        ret = -1;
+    }
+    for(int i = 0; i < started; i++) {
+        pthread_join(loops[i].tid, NULL);
+        if(loops[i].ret < 0) {
+            ret = -1;
+        }
+    }
+    free(loops);
+
+    // queued connections are turned away by the registry once shutdown started
+    if(pool != NULL) {
+        aesd_pool_destroy(pool);
+    }
+    return ret;
+}
+
+int createTCPServer(void) {
+    struct sigaction sa;
+
+    aesd_registry_init(&registry);
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    if(stopFd < 0) {
+        perror("Unable to create the shutdown eventfd");
+        return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signalInterruptHandler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // sendfile() and splice() have no MSG_NOSIGNAL, a vanished client must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if(aesd_store_open(&store, &config.store) < 0) {
+        perror("Unable to open the store");
+        return -1;
+    }
+    if(config.maxCached != 0 && !store.readBack) {
+        printf("Ignoring --cache-max, the %s store is never read back\n", store.ops->name);
+    }
+    if(aesd_history_init(&history, &store, config.maxCached) < 0) {
+        perror("Unable to load the history from the store");
+        aesd_history_destroy(&history);
+        return -1;
+    }
+    aesd_history_group_commit(&history, config.commitWindowUs, config.commitBatch);
+    aesd_history_durability(&history, config.syncPolicy, config.syncIntervalMs, config.syncBytes);
+    aesd_history_checkpoints(&history, config.checkpointSec);
+
+    openlog("aesdsocket.c", LOG_CONS | LOG_PID, LOG_USER);
+
+    numListeners = config.reusePort ? config.numLoops : 1;
+    listenFds = calloc(numListeners, sizeof(int));
+    if(listenFds == NULL) {
+        syslog(LOG_ERR, "Unable to allocate listeners");
+        aesd_history_destroy(&history);
+        closelog();
+        return -1;
+    }
+    for(int i = 0; i < numListeners; i++) {
+        listenFds[i] = createListener(config.reusePort);
+        if(listenFds[i] == -1) {
+            numListeners = i;
+            closeListeners();
+            free(listenFds);
+            aesd_history_destroy(&history);
+            closelog();        
+            return -1;
+        }
+    }
+
+    if(config.deamonize) {
+        pid_t pid = fork();
+        if(pid < 0) {
+            printf("failed to fork\n"); 
+            closeListeners();
+            aesd_history_destroy(&history);
+            closelog();  
+            exit(EXIT_FAILURE);      
+        }
+        if(pid > 0 ) {
+            printf("Running as a deamon\n");
+            exit(EXIT_SUCCESS);
         }
-        current = current->next;
+        umask(0);
+        if(setsid() < 0) {
+            printf("Failed to create SID for child\n");
+            closeListeners();
+            aesd_history_destroy(&history);
+            closelog(); 
+            exit(EXIT_FAILURE);
+        } 
+        if(chdir("/") < 0) {
+            printf("Unable to change directory to root\n");
+            closeListeners();
+            aesd_history_destroy(&history);
+            closelog(); 
+            exit(EXIT_FAILURE);
+        }
+
+        close(STDIN_FILENO);
+        close(STDOUT_FILENO);
+        close(STDERR_FILENO);        
     }
 
-    current = head;
-    while(current != NULL) {
-        next = current->next;
-        free(current);
-        current = next;
+    // threads only survive a fork in the parent, so they start in the daemon
+    if(aesd_history_start_syncer(&history) < 0) {
+        closeListeners();
+        free(listenFds);
+        aesd_history_destroy(&history);
+        closelog();
+        return -1;
+    }
+    // watching the history has to start before anything is appended
+    if(config.subscribePort > 0) {
+        subscribeServer = aesd_subscribe_start(&history, config.subscribePort, config.maxLag, config.lagPolicy,
+                                               config.writeTimeoutMs);
+        if(subscribeServer == NULL) {
+            closeListeners();
+            free(listenFds);
+            aesd_history_destroy(&history);
+            closelog();
+            return -1;
+        }
+    }
+    // the aesdchar driver only keeps the packets themselves
+    if(config.timestampSec > 0 && !store.packetsOnly) {
+        timestamp = aesd_timestamp_start(&history, config.timestampSec);
+    }
+    if(config.statsPort > 0 || config.statsSocket != NULL) {
+        metricsServer = aesd_metrics_start(config.statsPort, config.statsSocket);
+        if(metricsServer == NULL) {
+            if(timestamp != NULL) {
+                aesd_timestamp_stop(timestamp);
+            }
+            if(subscribeServer != NULL) {
+                aesd_subscribe_stop(subscribeServer);
+            }
+            closeListeners();
+            free(listenFds);
+            aesd_history_destroy(&history);
+            closelog();
+            return -1;
+        }
+    }
+    syslog(LOG_INFO, "TCP server listening at port %d with %d listener(s), backlog %d",
+           9000, numListeners, config.backlog);
+
+    pthread_t waiter;
+    if(pthread_create(&waiter, NULL, shutdownWaiter, NULL) != 0) {
+        syslog(LOG_ERR, "Unable to start shutdown handler");
+        if(timestamp != NULL) {
+            aesd_timestamp_stop(timestamp);
+        }
+        if(metricsServer != NULL) {
+            aesd_metrics_stop(metricsServer);
+        }
+        if(subscribeServer != NULL) {
+            aesd_subscribe_stop(subscribeServer);
+        }
+        closeListeners();
+        aesd_history_destroy(&history);
+        closelog();
+        return -1;
     }
 
-    close(sockfd);
-    close(file);
+    int ret = serveConnections();
+
+    // an engine that gave up on its own still has to release the waiter
+    signalInterruptHandler(SIGTERM);
+    void *drained;
+    pthread_join(waiter, &drained);
+    if(timestamp != NULL) {
+        aesd_timestamp_stop(timestamp);
+    }
+    if(metricsServer != NULL) {
+        aesd_metrics_stop(metricsServer);
+    }
+    if(subscribeServer != NULL) {
+        aesd_subscribe_stop(subscribeServer);
+    }
+    closeListeners();
+    free(listenFds);
+    aesd_slab_log_stats();
+    // a connection thread that did not finish may still use the history
+    if(drained == NULL) {
+        aesd_history_destroy(&history);
+        aesd_registry_destroy(&registry);
+    }
     closelog();               
-    return 0; 
+    return ret; 
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-m thread|epoll|pool|uring] [-l loops] [-w workers] [-q depth] [--queue-full reject|wait] [--cache-max bytes] [-k]\n"
+                    "          [--commit-window usec] [--commit-batch N] [--sync none|packet|group]\n"
+                    "          [--sync-interval msec] [--sync-bytes bytes] [-b backlog] [--reuseport] [-t seconds]\n"
+                    "          [--drain-timeout seconds] [--stats-port port] [--stats-socket path]\n"
+                    "          [--write-timeout msec] [--max-queued bytes]\n"
+                    "          [--subscribe-port port] [--lag-limit bytes] [--lag-policy skip|drop]\n"
+                    "          [--store auto|file|chardev|memory|mmapfile|mmap] [--store-path path] [--store-size bytes]\n"
+                    "          [--segment-size bytes] [--retain-bytes bytes] [--retain-records N]\n"
+                    "          [--checkpoint-interval seconds]\n"
+                    "  -d, --daemon       run as a daemon\n"
+                    "  -m, --mode MODE    thread: one thread per connection (default), epoll: event loops,\n"
+                    "                     pool: fixed worker pool fed by a bounded queue,\n"
+                    "                     uring: io_uring engine, epoll if the kernel lacks io_uring\n"
+                    "  -l, --loops N      number of epoll loop or io_uring threads (default %d)\n"
+                    "  -w, --workers N    number of pool worker threads (default %d)\n"
+                    "  -q, --queue-depth N  connections waiting for a pool worker (default %d)\n"
+                    "      --queue-full P reject (default) or wait when the pool queue is full\n"
+                    "      --cache-max B  history bytes of the file store kept in memory, older replies\n"
+                    "                     are streamed back from the file; 0 for all (default)\n"
+                    "  -k, --keep-alive   reply to each packet and keep the connection open for the next one\n"
+                    "      --commit-window US  time a store write waits for packets of other connections\n"
+                    "                     to join it (default %u)\n"
+                    "      --commit-batch N  most packets stored by one write (default %zu)\n"
+                    "      --sync P       when a packet is made durable before its reply: none (default)\n"
+                    "                     leaves it to the kernel, packet syncs every write before\n"
+                    "                     replying, group syncs once for all the packets stored within\n"
+                    "                     --sync-interval or --sync-bytes and replies to them together\n"
+                    "      --sync-interval MS  longest a packet waits for its group sync (default %u)\n"
+                    "      --sync-bytes B sync a group as soon as B bytes are pending, 0 for no limit\n"
+                    "                     (default)\n"
+                    "  -b, --backlog N    listen backlog of each listener (default %d)\n"
+                    "      --reuseport    one SO_REUSEPORT listener per loop (per accept thread in thread\n"
+                    "                     and pool mode), -l defaults to the number of online CPUs\n"
+                    "  -t, --timestamp S  append a timestamp record every S seconds, except to the aesdchar driver,\n"
+                    "                     0 to disable (default %u)\n"
+                    "      --drain-timeout S  time open connections get to finish on SIGINT/SIGTERM\n"
+                    "                     before they are shut down (default %u)\n"
+                    "      --stats-port P serve metrics in Prometheus text format on 127.0.0.1:P\n"
+                    "      --stats-socket PATH  serve the same metrics on a UNIX socket\n"
+                    "      --write-timeout MS  disconnect a client whose queued replies make no progress\n"
+                    "                     for MS milliseconds, 0 to wait forever (default %u)\n"
+                    "      --max-queued B disconnect a client once more than B bytes of replies wait for\n"
+                    "                     it to read them, 0 for no limit (default)\n"
+                    "      --subscribe-port P  push every record to the clients of port P as it is\n"
+                    "                     stored, from when they connect on; they send nothing\n"
+                    "      --lag-limit B  bytes of whole records a subscriber may fall behind, 0 for no\n"
+                    "                     limit (default %zu)\n"
+                    "      --lag-policy P skip (default) jumps a subscriber past the limit forward to\n"
+                    "                     the oldest record within it, drop disconnects it\n"
+                    "      --store S      where the history is kept: file (%s, appended with\n"
+                    "                     writev()), chardev (the aesdchar driver at %s),\n"
+                    "                     memory (a ring of the latest --store-size bytes, lost on exit),\n"
+                    "                     mmapfile (the same file, mapped and replied from memory),\n"
+                    "                     mmap (a mapped file with a header keeping its length across\n"
+                    "                     crashes), or auto (default): chardev if the driver is loaded,\n"
+                    "                     mmapfile otherwise\n"
+                    "      --store-path PATH  file or device of the store instead of its default\n"
+                    "      --store-size B bytes kept by the memory store (default %d)\n"
+                    "      --segment-size B  keep an mmapfile or mmap store in files of B history bytes each,\n"
+                    "                     named PATH.N, instead of a single file\n"
+                    "      --retain-bytes B  keep only the latest B bytes of history, in whole records;\n"
+                    "                     segments wholly older than that are removed\n"
+                    "      --retain-records N  keep only the latest N records, likewise\n"
+                    "                     (with either cap, mmapfile and mmap stores default to %d byte\n"
+                    "                     segments; the file store keeps every byte on disk)\n"
+                    "      --checkpoint-interval S  save where the records of an mmapfile or mmap store are\n"
+                    "                     every S seconds, and on exit, so that starting again only checks\n"
+                    "                     what was stored since; 0 for only on exit (default %u)\n",
+            prog, config.numLoops, config.numWorkers, config.queueDepth, config.commitWindowUs, config.commitBatch,
+            config.syncIntervalMs, config.backlog, config.timestampSec, config.drainTimeoutSec, config.writeTimeoutMs,
+            config.maxLag, AESD_STORE_FILE_PATH, AESD_STORE_CHARDEV_PATH, AESD_STORE_MEMORY_SIZE, AESD_STORE_SEGMENT_SIZE,
+            config.checkpointSec);
 }
 
 int main(int argc, char *argv[]) {
-    int deamonize = 0;
-    for(int i = 1; i < argc; i++) {
-        if(strcmp(argv[1], "-d") == 0) {
-            deamonize = 1;
+    static const struct option longOptions[] = {
+        { "daemon",      no_argument,       NULL, 'd' },
+        { "mode",        required_argument, NULL, 'm' },
+        { "loops",       required_argument, NULL, 'l' },
+        { "workers",     required_argument, NULL, 'w' },
+        { "queue-depth", required_argument, NULL, 'q' },
+        { "queue-full",  required_argument, NULL, 'Q' },
+        { "cache-max",   required_argument, NULL, 'C' },
+        { "keep-alive",  no_argument,       NULL, 'k' },
+        { "commit-window", required_argument, NULL, 'W' },
+        { "commit-batch",  required_argument, NULL, 'B' },
+        { "backlog",     required_argument, NULL, 'b' },
+        { "reuseport",   no_argument,       NULL, 'R' },
+        { "timestamp",   required_argument, NULL, 't' },
+        { "drain-timeout", required_argument, NULL, 'D' },
+        { "stats-port",  required_argument, NULL, 'P' },
+        { "stats-socket", required_argument, NULL, 'U' },
+        { "write-timeout", required_argument, NULL, 'T' },
+        { "max-queued",  required_argument, NULL, 'M' },
+        { "store",       required_argument, NULL, 'S' },
+        { "store-path",  required_argument, NULL, 'F' },
+        { "store-size",  required_argument, NULL, 'Z' },
+        { "segment-size", required_argument, NULL, 'G' },
+        { "retain-bytes", required_argument, NULL, 'Y' },
+        { "retain-records", required_argument, NULL, 'N' },
+        { "sync",        required_argument, NULL, 'X' },
+        { "sync-interval", required_argument, NULL, 'I' },
+        { "sync-bytes",  required_argument, NULL, 'K' },
+        { "checkpoint-interval", required_argument, NULL, 'O' },
+        { "subscribe-port", required_argument, NULL, 'A' },
+        { "lag-limit",   required_argument, NULL, 'E' },
+        { "lag-policy",  required_argument, NULL, 'H' },
+        { NULL,          0,                 NULL, 0 }
+    };
+    int opt;
+    bool loopsSet = false;
+
+    while((opt = getopt_long(argc, argv, "dm:l:w:q:kb:t:", longOptions, NULL)) != -1) {
+        switch(opt) {
+            case 'd':
+                config.deamonize = true;
+                break;
+            case 'm':
+                if(strcmp(optarg, "thread") == 0) {
+                    config.mode = AESD_MODE_THREAD;
+                } else if(strcmp(optarg, "epoll") == 0) {
+                    config.mode = AESD_MODE_EPOLL;
+                } else if(strcmp(optarg, "pool") == 0) {
+                    config.mode = AESD_MODE_POOL;
+                } else if(strcmp(optarg, "uring") == 0) {
+                    config.mode = AESD_MODE_URING;
+                } else {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'l':
+                config.numLoops = atoi(optarg);
+                loopsSet = true;
+                if(config.numLoops < 1) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+                config.numWorkers = atoi(optarg);
+                if(config.numWorkers < 1) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'q':
+                config.queueDepth = atoi(optarg);
+                if(config.queueDepth < 1) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'Q':
+                if(strcmp(optarg, "reject") == 0) {
+                    config.queueFullWait = false;
+                } else if(strcmp(optarg, "wait") == 0) {
+                    config.queueFullWait = true;
+                } else {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'C':
+                config.maxCached = strtoull(optarg, NULL, 0);
+                break;
+            case 'k':
+                config.keepAlive = true;
+                break;
+            case 'D':
+                config.drainTimeoutSec = strtoul(optarg, NULL, 0);
+                break;
+            case 'P':
+                config.statsPort = atoi(optarg);
+                if(config.statsPort < 1 || config.statsPort > 65535) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'U':
+                config.statsSocket = optarg;
+                break;
+            case 'T':
+                config.writeTimeoutMs = strtoul(optarg, NULL, 0);
+                break;
+            case 'M':
+                config.maxQueued = strtoull(optarg, NULL, 0);
+                break;
+            case 'A':
+                config.subscribePort = atoi(optarg);
+                if(config.subscribePort < 1 || config.subscribePort > 65535) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'E':
+                config.maxLag = strtoull(optarg, NULL, 0);
+                break;
+            case 'H': {
+                int policy = aesd_subscribe_lag_policy(optarg);
+                if(policy < 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                config.lagPolicy = policy;
+                break;
+            }
+            case 'S': {
+                int kind = aesd_store_kind(optarg);
+                if(kind < 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                config.store.kind = kind;
+                break;
+            }
+            case 'F':
+                config.store.path = optarg;
+                break;
+            case 'Z':
+                config.store.memorySize = strtoull(optarg, NULL, 0);
+                break;
+            case 'G':
+                config.store.segmentSize = strtoull(optarg, NULL, 0);
+                break;
+            case 'Y':
+                config.store.retainBytes = strtoull(optarg, NULL, 0);
+                break;
+            case 'N':
+                config.store.retainRecords = strtoull(optarg, NULL, 0);
+                break;
+            case 'W':
+                config.commitWindowUs = strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                config.commitBatch = strtoull(optarg, NULL, 0);
+                if(config.commitBatch < 1) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'X': {
+                int policy = aesd_history_sync_policy(optarg);
+                if(policy < 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                config.syncPolicy = policy;
+                break;
+            }
+            case 'I':
+                config.syncIntervalMs = strtoul(optarg, NULL, 0);
+                break;
+            case 'K':
+                config.syncBytes = strtoull(optarg, NULL, 0);
+                break;
+            case 'O':
+                config.checkpointSec = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                config.backlog = atoi(optarg);
+                if(config.backlog < 1) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'R':
+                config.reusePort = true;
+                break;
+            case 't':
+                config.timestampSec = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
         }
     }
-    if(createTCPServer(deamonize) == -1) {
+    if(config.reusePort && !loopsSet) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.numLoops = cpus > 0 ? cpus : 1;
+    }
+    if(createTCPServer() == -1) {
         printf("Error in running application\n");
     }
     return 0;
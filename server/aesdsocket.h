@@ -0,0 +1,60 @@
+#ifndef _AESDSOCKET_H_
+#define _AESDSOCKET_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "aesd_history.h"
+#include "aesd_registry.h"
+#include "aesd_store.h"
+#include "aesd_subscribe.h"
+
+/**
+ * How accepted connections are serviced.
+ */
+typedef enum {
+    AESD_MODE_THREAD,   // one pthread per accepted connection
+    AESD_MODE_EPOLL,    // a fixed number of nonblocking epoll loop threads
+    AESD_MODE_POOL,     // a fixed pool of worker threads fed by a bounded job queue
+    AESD_MODE_URING,    // io_uring instances, falls back to AESD_MODE_EPOLL when unsupported
+} aesd_mode_t;
+
+typedef struct aesd_config_s aesd_config_t;
+struct aesd_config_s {
+    bool deamonize;
+    aesd_mode_t mode;
+    int numLoops;       // event loop threads for AESD_MODE_EPOLL and AESD_MODE_URING, and
+                        // accept threads for the other modes with reusePort
+    int numWorkers;     // number of worker threads for AESD_MODE_POOL
+    int queueDepth;     // accepted connections that may wait for a pool worker
+    bool queueFullWait; // stop accepting instead of rejecting when the queue is full
+    size_t maxCached;   // history bytes of a store read back rather than mapped kept in memory, 0 for all
+    bool keepAlive;     // reply to every packet and keep the connection until the client closes it
+    unsigned commitWindowUs;    // how long a group commit waits for more packets
+    size_t commitBatch;         // most packets stored by one group commit
+    aesd_sync_policy_t syncPolicy;  // when appends are made durable before they are replied to
+    unsigned syncIntervalMs;    // AESD_SYNC_GROUP: longest a stored packet waits for its sync
+    size_t syncBytes;           // AESD_SYNC_GROUP: bytes pending that sync at once, 0 for no limit
+    unsigned checkpointSec;     // interval of the store checkpoints, 0 for only on exit
+    int backlog;        // listen() backlog of each listening socket
+    bool reusePort;     // one SO_REUSEPORT listener per loop instead of a shared one
+    unsigned timestampSec;  // interval of the timestamp records, 0 for none
+    unsigned drainTimeoutSec;   // time open connections get to finish on shutdown
+    int statsPort;          // loopback port serving the metrics, 0 for none
+    const char *statsSocket;    // UNIX socket serving the metrics, NULL for none
+    unsigned writeTimeoutMs;    // time queued replies may make no progress before the client is cut off, 0 for none
+    size_t maxQueued;           // reply bytes queued for one client before it is cut off, 0 for no limit
+    int subscribePort;          // port pushing each new record to its clients, 0 for none
+    size_t maxLag;              // bytes a subscriber may fall behind, 0 for no limit
+    aesd_lag_policy_t lagPolicy;    // what happens to a subscriber further behind
+    aesd_store_options_t store; // backend the history is persisted to and what it retains
+};
+
+extern aesd_config_t config;
+extern aesd_store_t store;
+extern aesd_history_t history;
+extern aesd_registry_t registry;
+extern int stopFd;      // eventfd readable once shutdown was requested, never read
+
+#endif